@@ -16,11 +16,37 @@ int main(int argc, const char* const* argv)
         ("h,help", "print usage")
         ("chunk_list_file_path", "file contain existing chunk name", cxxopts::value<std::string>()->default_value(std::string()))
         ("chunk_dir", "where chunk saved", cxxopts::value<std::string>()->default_value(std::string()))
+        ("chunk_store", "chunk dir layout: auto keeps an existing pack store and is dir otherwise, dir is a file per chunk, pack", cxxopts::value<std::string>()->default_value("auto"))
         ("manifest_output_path", "manifest file output name path", cxxopts::value<std::string>()->default_value(std::string()))
+        ("chunk_mode", "chunking strategy: gather_all, min_chunk or fastcdc", cxxopts::value<std::string>()->default_value("gather_all"))
+        ("weak_hash", "rolling weak hash: adler32 or rabinkarp64, recorded in the manifest", cxxopts::value<std::string>()->default_value("adler32"))
+        ("chunk_size", "chunk size in bytes, power of two from 65536 to 8388608, recorded in the manifest", cxxopts::value<uint32_t>()->default_value(std::to_string(FileChunkSize)))
+        ("pack_threshold", "files smaller than this many bytes are packed together into shared chunks, 0 disables", cxxopts::value<uint32_t>()->default_value("0"))
+        ("mmap", "scan regular files through a memory mapping instead of reading them")
+        ("io_threads", "threads reading files for the chunking workers, 0 reads on the main thread", cxxopts::value<uint32_t>()->default_value("2"))
+        ("io_queue_depth", "reads in flight per device", cxxopts::value<uint32_t>()->default_value("8"))
+        ("io_backend", "io stage reads: uring, falls back to stream when unavailable, or stream", cxxopts::value<std::string>()->default_value("uring"))
+        ("direct_io", "io_uring reads bypass the page cache")
+        ("previous_manifest", "manifest of the previous backup, unchanged files take their chunks from it", cxxopts::value<std::string>()->default_value(std::string()))
+        ("stat_cache", "file stats of the previous backup, read if it exists and rewritten", cxxopts::value<std::string>()->default_value(std::string()))
+        ("file_dedupe", "hash files of the same size before the scan and chunk only one of each set of identical files")
+        ("zstd_level", "compression level of new chunks, the starting level with zstd_adaptive", cxxopts::value<int>()->default_value("1"))
+        ("zstd_strategy", "zstd strategy: default, fast, dfast, greedy, lazy, lazy2, btlazy2, btopt, btultra or btultra2", cxxopts::value<std::string>()->default_value("default"))
+        ("zstd_long", "zstd long distance matching, only pays off with large chunk sizes")
+        ("zstd_workers", "zstd threads per chunk, 0 compresses on the store pipeline threads", cxxopts::value<int>()->default_value("0"))
+        ("zstd_raw", "store chunks whose bytes look incompressible as is, older builds can not restore them")
+        ("zstd_adaptive", "raise the level while writes lag behind and lower it while compression does")
+        ("zstd_min_level", "lowest level of zstd_adaptive", cxxopts::value<int>()->default_value("1"))
+        ("zstd_max_level", "highest level of zstd_adaptive", cxxopts::value<int>()->default_value("9"))
+        ("chunk_id_index", "keep a binary index of the chunks in chunk_dir, read instead of listing it once it exists")
         ;
     options.parse_positional({ "path" });
     auto result = options.parse(argc, argv);
     std::vector<std::string> hexNameList;
+    EFileBackupChunkMode chunkMode{ EFileBackupChunkMode::GatherAll };
+    GenFolderChunkOptions_t chunkOptions;
+    EChunkStoreKind chunkStoreKind{ EChunkStoreKind::Auto };
+    ChunkCompressionOptions_t compressionOptions;
 
     if (result.count("help"))
     {
@@ -31,10 +57,62 @@ int main(int argc, const char* const* argv)
         goto options_error;
     }
 
+    if (!parse_chunk_mode(result["chunk_mode"].as<std::string>(), chunkMode)) {
+        goto options_error;
+    }
+    if (!parse_weak_hash_kind(result["weak_hash"].as<std::string>(), chunkOptions.WeakHashKind)) {
+        goto options_error;
+    }
+    if (!parse_chunk_store_kind(result["chunk_store"].as<std::string>(), chunkStoreKind)) {
+        goto options_error;
+    }
+    compressionOptions.Profile.Level = result["zstd_level"].as<int>();
+    if (!parse_compression_strategy(result["zstd_strategy"].as<std::string>(), compressionOptions.Profile.Strategy)) {
+        goto options_error;
+    }
+    compressionOptions.Profile.bLongDistanceMatching = result.count("zstd_long") > 0;
+    compressionOptions.Profile.WorkerNum = result["zstd_workers"].as<int>();
+    compressionOptions.Profile.bStoreIncompressibleRaw = result.count("zstd_raw") > 0;
+    compressionOptions.bAdaptiveLevel = result.count("zstd_adaptive") > 0;
+    compressionOptions.MinLevel = result["zstd_min_level"].as<int>();
+    compressionOptions.MaxLevel = result["zstd_max_level"].as<int>();
+    if (compressionOptions.Profile.WorkerNum < 0 || compressionOptions.MinLevel > compressionOptions.MaxLevel) {
+        goto options_error;
+    }
+    chunkOptions.ChunkSize = result["chunk_size"].as<uint32_t>();
+    if (!IsValidFileChunkSize(chunkOptions.ChunkSize)) {
+        goto options_error;
+    }
+    chunkOptions.PackFileSizeThreshold = result["pack_threshold"].as<uint32_t>();
+    if (chunkOptions.PackFileSizeThreshold > chunkOptions.ChunkSize) {
+        goto options_error;
+    }
+    chunkOptions.bMemoryMapFiles = result.count("mmap") > 0;
+    chunkOptions.IOThreadNum = result["io_threads"].as<uint32_t>();
+    chunkOptions.IOQueueDepth = result["io_queue_depth"].as<uint32_t>();
+    if (chunkOptions.IOThreadNum > 0 && chunkOptions.IOQueueDepth == 0) {
+        goto options_error;
+    }
+    if (result["io_backend"].as<std::string>() == "stream") {
+        chunkOptions.bIOUring = false;
+    }
+    else if (result["io_backend"].as<std::string>() != "uring") {
+        goto options_error;
+    }
+    chunkOptions.bDirectIO = result.count("direct_io") > 0;
+    chunkOptions.bDedupeFiles = result.count("file_dedupe") > 0;
+
     if (!gen_folder_manifest_action((const char8_t*)result["path"].as<std::string>().c_str(),
         (const char8_t*)result["chunk_list_file_path"].as<std::string>().c_str(),
         (const char8_t*)result["chunk_dir"].as<std::string>().c_str(),
-        (const char8_t*)result["manifest_output_path"].as<std::string>().c_str())
+        (const char8_t*)result["manifest_output_path"].as<std::string>().c_str(),
+        chunkMode,
+        chunkOptions,
+        (const char8_t*)result["previous_manifest"].as<std::string>().c_str(),
+        (const char8_t*)result["stat_cache"].as<std::string>().c_str(),
+        chunkStoreKind,
+        result.count("chunk_id_index") > 0,
+        compressionOptions)
         ) {
         goto options_error;
     }
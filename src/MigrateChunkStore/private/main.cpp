@@ -0,0 +1,40 @@
+#include "ofilebackup_actions.h"
+#include <iostream>
+#include <cxxopts.hpp>
+
+int main(int argc, const char* const* argv)
+{
+    cxxopts::Options options("oMigrateChunkStore", "copy every chunk of a chunk dir into another chunk store");
+    options.positional_help("[source_dir] [target_dir]").show_positional_help();
+    options.add_options()
+        ("h,help", "print usage")
+        ("source_dir", "existing chunk store, its kind is detected", cxxopts::value<std::string>())
+        ("target_dir", "chunk store to write", cxxopts::value<std::string>())
+        ("kind", "target chunk store: pack or dir", cxxopts::value<std::string>()->default_value("pack"))
+        ;
+    options.parse_positional({ "source_dir","target_dir" });
+    auto result = options.parse(argc, argv);
+    EChunkStoreKind targetKind{ EChunkStoreKind::Pack };
+    if (result.count("help"))
+    {
+        goto options_error;
+    }
+
+    if (!result.count("source_dir") || !result.count("target_dir")) {
+        goto options_error;
+    }
+    if (!parse_chunk_store_kind(result["kind"].as<std::string>(), targetKind) || targetKind == EChunkStoreKind::Auto) {
+        goto options_error;
+    }
+    if (!migrate_chunk_store((const char8_t*)result["source_dir"].as<std::string>().c_str(),
+        (const char8_t*)result["target_dir"].as<std::string>().c_str(),
+        targetKind)
+        ) {
+        goto options_error;
+    }
+
+    exit(0);
+options_error:
+    std::cout << options.help() << std::endl;
+    exit(-1);
+}
@@ -0,0 +1,433 @@
+#include "ChunkStore.h"
+#include "FileBackupInternal.h"
+
+#include <dir_util.h>
+#include <filesystem>
+#include <fstream>
+#include <shared_mutex>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+#include <array>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+namespace {
+    constexpr char PackIndexFileName[] = "chunks.idx";
+    constexpr char PackIndexTempFileName[] = "chunks.idx.tmp";
+    constexpr uint64_t PackMaxSize = uint64_t(1) << 30;//the next chunk starts a new pack once a pack reaches this
+    constexpr char PackIndexMagic[8] = { 'O','F','B','P','I','D','X','1' };
+
+    typedef struct PackIndexHeader_t {
+        char Magic[8];
+        uint32_t EntrySize;//also tells an index of the other byte order apart
+        uint32_t PackNum;//packs written so far, a new session appends to a new pack after them
+        uint64_t EntryNum;
+    }PackIndexHeader_t;
+
+    //fixed size and sorted by HexName so the mapped index is searched in place
+    typedef struct PackIndexEntry_t {
+        char HexName[HexNameStrLen];//zero padded
+        uint64_t Offset;
+        uint32_t PackID;
+        uint32_t Length;
+    }PackIndexEntry_t;
+    static_assert(sizeof(PackIndexEntry_t) == 64);
+
+    typedef std::array<char, HexNameStrLen> TPackKey;
+    TPackKey ToPackKey(std::u8string_view hexName) {
+        TPackKey key{};
+        memcpy(key.data(), hexName.data(), std::min(hexName.size(), key.size()));
+        return key;
+    }
+}
+
+class FDirChunkStore :public IChunkStore {
+public:
+    explicit FDirChunkStore(std::filesystem::path dir) :Dir(std::move(dir)) {}
+    EChunkStoreKind GetKind() const override {
+        return EChunkStoreKind::Dir;
+    }
+    bool Put(std::u8string_view hexName, std::span<const char> chunkFile) override;
+    bool Get(std::u8string_view hexName, void* buf, size_t bufSize, size_t& outLen) override;
+    void ForEachName(const std::function<void(std::u8string_view)>& func) override;
+    std::error_code Flush() override {
+        return {};
+    }
+private:
+    std::filesystem::path Dir;
+};
+
+bool FDirChunkStore::Put(std::u8string_view hexName, std::span<const char> chunkFile)
+{
+    std::ofstream ofs(Dir / hexName, std::ios::binary);
+    if (!ofs.is_open()) {
+        return false;
+    }
+    ofs.write(chunkFile.data(), std::streamsize(chunkFile.size()));
+    ofs.close();
+    return bool(ofs);
+}
+
+bool FDirChunkStore::Get(std::u8string_view hexName, void* buf, size_t bufSize, size_t& outLen)
+{
+    std::ifstream ifs(Dir / hexName, std::ios::binary | std::ios::ate);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    outLen = size_t(ifs.tellg());
+    if (outLen > bufSize) {
+        return false;
+    }
+    ifs.seekg(0);
+    ifs.read((char*)buf, std::streamsize(outLen));
+    return size_t(ifs.gcount()) == outLen;
+}
+
+void FDirChunkStore::ForEachName(const std::function<void(std::u8string_view)>& func)
+{
+    DirUtil::IterateDir(Dir.u8string(),
+        [&](DirEntry_t& entry)->bool {
+            if (entry.bDir) {
+                return true;
+            }
+            std::string fileName(entry.pPathBuf->FileName());
+            if (fileName.starts_with(ChunkIDIndexFileName)) {
+                return true;
+            }
+            func(std::u8string_view((const char8_t*)fileName.data(), fileName.size()));
+            return true;
+        },
+        0);
+}
+
+///
+/// @brief chunk files appended to pack-N.pack files, located through chunks.idx
+/// @detail the index is a header and then fixed size entries sorted by hex name, mapped and binary searched.
+/// chunks put since the index was loaded are kept in memory until Flush merges them into a new index.
+/// every session writes new packs only, so bytes a crashed session left behind are never indexed
+///
+class FPackChunkStore :public IChunkStore {
+public:
+    explicit FPackChunkStore(std::filesystem::path dir) :Dir(std::move(dir)) {}
+    ~FPackChunkStore() override {
+        Flush();
+    }
+    EChunkStoreKind GetKind() const override {
+        return EChunkStoreKind::Pack;
+    }
+    bool Put(std::u8string_view hexName, std::span<const char> chunkFile) override;
+    bool Get(std::u8string_view hexName, void* buf, size_t bufSize, size_t& outLen) override;
+    void ForEachName(const std::function<void(std::u8string_view)>& func) override;
+    std::error_code Flush() override;
+
+    //no index yet is an empty store
+    bool LoadIndex(std::error_code& ec);
+private:
+    std::filesystem::path GetPackPath(uint32_t packID) const {
+        char name[32];
+        snprintf(name, sizeof(name), "pack-%08u.pack", packID);
+        return Dir / name;
+    }
+    const char* GetBaseEntry(uint64_t index) const {
+        return BaseEntries + index * sizeof(PackIndexEntry_t);
+    }
+    //EntriesMtx held
+    bool FindEntry(const TPackKey& key, PackIndexEntry_t& outEntry) const;
+    FPositionalFile* GetPackFile(uint32_t packID);
+
+    std::filesystem::path Dir;
+    std::shared_mutex EntriesMtx;//guards the mapped index and NewEntries
+    FMappedFile IndexFile;
+    const char* BaseEntries{ nullptr };
+    uint64_t BaseEntryNum{ 0 };
+    std::map<TPackKey, PackIndexEntry_t> NewEntries;
+    std::mutex WriteMtx;//one append at a time
+    std::ofstream PackStream;
+    uint32_t NextPackID{ 0 };
+    uint32_t WritePackID{ 0 };
+    uint64_t WritePackSize{ 0 };
+    std::vector<uint32_t> UnsyncedPackIDs;//written since the last Flush
+    std::shared_mutex PackFilesMtx;
+    std::unordered_map<uint32_t, std::unique_ptr<FPositionalFile>> PackFiles;
+};
+
+bool FPackChunkStore::LoadIndex(std::error_code& ec)
+{
+    IndexFile.Close();
+    BaseEntries = nullptr;
+    BaseEntryNum = 0;
+    auto indexPath = Dir / PackIndexFileName;
+    if (!std::filesystem::exists(indexPath, ec)) {
+        return !ec;
+    }
+    if (!IndexFile.Open(indexPath)) {
+        ec = std::make_error_code(std::errc::io_error);
+        return false;
+    }
+    auto indexSize = IndexFile.GetSize();
+    auto pData = indexSize >= sizeof(PackIndexHeader_t) ? IndexFile.Map(0, size_t(indexSize)) : nullptr;
+    if (!pData) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return false;
+    }
+    PackIndexHeader_t header;
+    memcpy(&header, pData, sizeof(header));
+    if (memcmp(header.Magic, PackIndexMagic, sizeof(PackIndexMagic)) != 0 || header.EntrySize != sizeof(PackIndexEntry_t)
+        || sizeof(header) + header.EntryNum * sizeof(PackIndexEntry_t) != indexSize) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return false;
+    }
+    BaseEntries = pData + sizeof(header);
+    BaseEntryNum = header.EntryNum;
+    NextPackID = std::max(NextPackID, header.PackNum);
+    return true;
+}
+
+bool FPackChunkStore::FindEntry(const TPackKey& key, PackIndexEntry_t& outEntry) const
+{
+    if (auto itr = NewEntries.find(key); itr != NewEntries.end()) {
+        outEntry = itr->second;
+        return true;
+    }
+    uint64_t low{ 0 };
+    uint64_t high{ BaseEntryNum };
+    while (low < high) {
+        auto mid = low + (high - low) / 2;
+        auto res = memcmp(GetBaseEntry(mid), key.data(), key.size());
+        if (res == 0) {
+            memcpy(&outEntry, GetBaseEntry(mid), sizeof(outEntry));
+            return true;
+        }
+        if (res < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return false;
+}
+
+FPositionalFile* FPackChunkStore::GetPackFile(uint32_t packID)
+{
+    {
+        std::shared_lock lock(PackFilesMtx);
+        if (auto itr = PackFiles.find(packID); itr != PackFiles.end()) {
+            return itr->second.get();
+        }
+    }
+    std::unique_lock lock(PackFilesMtx);
+    auto& pPackFile = PackFiles[packID];
+    if (!pPackFile) {
+        pPackFile = std::make_unique<FPositionalFile>();
+        if (!pPackFile->Open(GetPackPath(packID))) {
+            PackFiles.erase(packID);
+            return nullptr;
+        }
+    }
+    return pPackFile.get();
+}
+
+bool FPackChunkStore::Put(std::u8string_view hexName, std::span<const char> chunkFile)
+{
+    if (hexName.size() > HexNameStrLen) {
+        return false;
+    }
+    auto key = ToPackKey(hexName);
+    PackIndexEntry_t entry;
+    {
+        std::shared_lock lock(EntriesMtx);
+        if (FindEntry(key, entry)) {
+            return true;
+        }
+    }
+    std::scoped_lock writeLock(WriteMtx);
+    {
+        //another writer may have put it meanwhile
+        std::shared_lock lock(EntriesMtx);
+        if (FindEntry(key, entry)) {
+            return true;
+        }
+    }
+    if (!PackStream.is_open() || (WritePackSize > 0 && WritePackSize + chunkFile.size() > PackMaxSize)) {
+        if (PackStream.is_open()) {
+            PackStream.close();
+        }
+        WritePackID = NextPackID++;
+        WritePackSize = 0;
+        UnsyncedPackIDs.push_back(WritePackID);
+        PackStream.open(GetPackPath(WritePackID), std::ios::binary | std::ios::trunc);
+        if (!PackStream.is_open()) {
+            return false;
+        }
+    }
+    PackStream.write(chunkFile.data(), std::streamsize(chunkFile.size()));
+    //Get reads the pack through its own handle
+    PackStream.flush();
+    if (!PackStream) {
+        return false;
+    }
+    memcpy(entry.HexName, key.data(), key.size());
+    entry.Offset = WritePackSize;
+    entry.PackID = WritePackID;
+    entry.Length = uint32_t(chunkFile.size());
+    WritePackSize += chunkFile.size();
+    std::unique_lock lock(EntriesMtx);
+    NewEntries.emplace(key, entry);
+    return true;
+}
+
+bool FPackChunkStore::Get(std::u8string_view hexName, void* buf, size_t bufSize, size_t& outLen)
+{
+    if (hexName.size() > HexNameStrLen) {
+        return false;
+    }
+    PackIndexEntry_t entry;
+    {
+        std::shared_lock lock(EntriesMtx);
+        if (!FindEntry(ToPackKey(hexName), entry)) {
+            return false;
+        }
+    }
+    outLen = entry.Length;
+    if (outLen > bufSize) {
+        return false;
+    }
+    auto pPackFile = GetPackFile(entry.PackID);
+    return pPackFile && pPackFile->ReadAt(buf, outLen, entry.Offset);
+}
+
+void FPackChunkStore::ForEachName(const std::function<void(std::u8string_view)>& func)
+{
+    std::shared_lock lock(EntriesMtx);
+    for (uint64_t i = 0; i < BaseEntryNum; i++) {
+        auto hexName = GetBaseEntry(i);
+        func(std::u8string_view((const char8_t*)hexName, strnlen(hexName, HexNameStrLen)));
+    }
+    for (auto& [key, _] : NewEntries) {
+        func(std::u8string_view((const char8_t*)key.data(), strnlen(key.data(), key.size())));
+    }
+}
+
+std::error_code FPackChunkStore::Flush()
+{
+    std::error_code ec;
+    std::scoped_lock writeLock(WriteMtx);
+    if (NewEntries.empty()) {
+        return ec;
+    }
+    if (PackStream.is_open()) {
+        PackStream.flush();
+        if (!PackStream) {
+            return std::make_error_code(std::errc::io_error);
+        }
+    }
+    //the index must not reach the disk before the chunks it points to
+    for (auto packID : UnsyncedPackIDs) {
+        if (!SyncFile(GetPackPath(packID))) {
+            return std::make_error_code(std::errc::io_error);
+        }
+    }
+    UnsyncedPackIDs.clear();
+    //writers are held by WriteMtx, readers only search, so the shared lock is enough until the swap
+    std::shared_lock lock(EntriesMtx);
+    auto tempPath = Dir / PackIndexTempFileName;
+    std::ofstream ofs(tempPath, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open()) {
+        return std::make_error_code(std::errc::io_error);
+    }
+    PackIndexHeader_t header;
+    memcpy(header.Magic, PackIndexMagic, sizeof(PackIndexMagic));
+    header.EntrySize = sizeof(PackIndexEntry_t);
+    header.PackNum = NextPackID;
+    header.EntryNum = BaseEntryNum + NewEntries.size();
+    ofs.write((const char*)&header, sizeof(header));
+    //merge of the sorted index and the sorted new entries
+    std::vector<PackIndexEntry_t> entryBuf;
+    entryBuf.reserve(4096);
+    auto newItr = NewEntries.begin();
+    uint64_t baseIndex{ 0 };
+    while (baseIndex < BaseEntryNum || newItr != NewEntries.end()) {
+        auto& entry = entryBuf.emplace_back();
+        if (newItr == NewEntries.end() || (baseIndex < BaseEntryNum && memcmp(GetBaseEntry(baseIndex), newItr->first.data(), HexNameStrLen) < 0)) {
+            memcpy(&entry, GetBaseEntry(baseIndex), sizeof(entry));
+            baseIndex++;
+        }
+        else {
+            entry = newItr->second;
+            newItr++;
+        }
+        if (entryBuf.size() == entryBuf.capacity()) {
+            ofs.write((const char*)entryBuf.data(), std::streamsize(entryBuf.size() * sizeof(PackIndexEntry_t)));
+            entryBuf.clear();
+        }
+    }
+    ofs.write((const char*)entryBuf.data(), std::streamsize(entryBuf.size() * sizeof(PackIndexEntry_t)));
+    ofs.close();
+    if (!ofs || !SyncFile(tempPath)) {
+        return std::make_error_code(std::errc::io_error);
+    }
+    lock.unlock();
+    std::unique_lock exclusiveLock(EntriesMtx);
+    //the old index is unmapped first, a mapped file can not be replaced on windows
+    IndexFile.Close();
+    BaseEntries = nullptr;
+    BaseEntryNum = 0;
+    std::filesystem::rename(tempPath, Dir / PackIndexFileName, ec);
+    if (ec) {
+        //the old index is still in place, map it again so the store keeps every older chunk
+        std::error_code loadEC;
+        LoadIndex(loadEC);
+        return ec;
+    }
+    if (!LoadIndex(ec)) {
+        return ec;
+    }
+    NewEntries.clear();
+    return ec;
+}
+
+EChunkStoreKind DetectChunkStoreKind(std::u8string_view dirStr)
+{
+    std::error_code ec;
+    std::filesystem::path dir(dirStr);
+    if (std::filesystem::exists(dir / PackIndexFileName, ec)) {
+        return EChunkStoreKind::Pack;
+    }
+    //a first session that stopped before its Flush leaves packs and no index
+    bool bHasPack{ false };
+    for (auto itr = std::filesystem::directory_iterator(dir, ec); !ec && itr != std::filesystem::directory_iterator(); itr.increment(ec)) {
+        auto fileName = itr->path().filename().string();
+        if (fileName.starts_with("pack-") && fileName.ends_with(".pack")) {
+            bHasPack = true;
+            break;
+        }
+    }
+    //a new dir keeps the file per chunk layout that tools fetching chunks by hex name expect, packs are opted into
+    return bHasPack ? EChunkStoreKind::Pack : EChunkStoreKind::Dir;
+}
+
+std::shared_ptr<IChunkStore> OpenChunkStore(std::u8string_view dirStr, EChunkStoreKind kind, std::error_code& ec)
+{
+    std::filesystem::path dir(dirStr);
+    if (kind == EChunkStoreKind::Auto) {
+        kind = DetectChunkStoreKind(dirStr);
+    }
+    if (!std::filesystem::exists(dir, ec)) {
+        std::filesystem::create_directories(dir, ec);
+    }
+    if (ec) {
+        return nullptr;
+    }
+    if (kind == EChunkStoreKind::Dir) {
+        return std::make_shared<FDirChunkStore>(dir);
+    }
+    auto pStore = std::make_shared<FPackChunkStore>(dir);
+    if (!pStore->LoadIndex(ec)) {
+        return nullptr;
+    }
+    return pStore;
+}
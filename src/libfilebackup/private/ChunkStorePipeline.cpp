@@ -0,0 +1,200 @@
+#include "ChunkStorePipeline.h"
+
+#include <moodycamel/blockingconcurrentqueue.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+    typedef struct ChunkStoreBuf_t {
+        char8_t Name[HexNameStrLen + 1]{};
+        uint32_t NameLen{ 0 };
+        std::vector<char> Content;
+        uint32_t ContentLen{ 0 };
+        std::vector<char> ChunkFile;//compressed, filled by the compression pool
+    }ChunkStoreBuf_t;
+    //chunks a compressor handles between two looks at the queues
+    constexpr uint32_t AdaptInterval = 8;
+}
+
+class FChunkStorePipeline :public IChunkStorePipeline {
+public:
+    FChunkStorePipeline(std::shared_ptr<IChunkStore> pChunkStore, const ChunkStorePipelineOptions_t& options);
+    ~FChunkStorePipeline() override;
+    bool Enqueue(std::span<const char8_t> name, std::span<const char> content) override;
+    std::error_code Finish() override;
+    int GetCompressionLevel() const override {
+        return CompressionLevel;
+    }
+
+private:
+    void CompressLoop();
+    //one step towards the stage that holds the chunks back
+    void AdaptCompressionLevel();
+    void WriteLoop();
+    void SetError(std::errc err) {
+        auto expected = std::error_code();
+        ErrorCode.compare_exchange_strong(expected, std::make_error_code(err));
+    }
+
+    std::shared_ptr<IChunkStore> ChunkStore;
+    std::vector<ChunkStoreBuf_t> Bufs;
+    //a buffer is in exactly one queue or held by one stage, null asks a thread to stop
+    moodycamel::BlockingConcurrentQueue<ChunkStoreBuf_t*> FreeQueue;
+    moodycamel::BlockingConcurrentQueue<ChunkStoreBuf_t*> CompressQueue;
+    moodycamel::BlockingConcurrentQueue<ChunkStoreBuf_t*> WriteQueue;
+    std::vector<std::jthread> CompressThreads;
+    std::vector<std::jthread> WriteThreads;
+    uint32_t MaxFileChunkSize;
+    ChunkCompressionOptions_t CompressionOptions;
+    std::atomic<int> CompressionLevel;
+    std::atomic<std::error_code> ErrorCode;
+    std::atomic_bool bFinished{ false };
+};
+
+FChunkStorePipeline::FChunkStorePipeline(std::shared_ptr<IChunkStore> pChunkStore, const ChunkStorePipelineOptions_t& options)
+    :ChunkStore(std::move(pChunkStore)), Bufs(std::max(1u, options.BufNum)), MaxFileChunkSize(options.MaxFileChunkSize), CompressionOptions(options.Compression)
+{
+    if (CompressionOptions.bAdaptiveLevel) {
+        CompressionOptions.MinLevel = std::max(CompressionOptions.MinLevel, GetMinCompressionLevel());
+        CompressionOptions.MaxLevel = std::max(CompressionOptions.MinLevel, std::min(CompressionOptions.MaxLevel, GetMaxCompressionLevel()));
+        CompressionOptions.Profile.Level = std::clamp(CompressionOptions.Profile.Level, CompressionOptions.MinLevel, CompressionOptions.MaxLevel);
+    }
+    CompressionLevel = CompressionOptions.Profile.Level;
+    for (auto& buf : Bufs) {
+        buf.Content.resize(MaxFileChunkSize);
+        FreeQueue.enqueue(&buf);
+    }
+    for (uint32_t i = 0; i < std::max(1u, options.CompressThreadNum); i++) {
+        CompressThreads.emplace_back(&FChunkStorePipeline::CompressLoop, this);
+    }
+    for (uint32_t i = 0; i < std::max(1u, options.WriteThreadNum); i++) {
+        WriteThreads.emplace_back(&FChunkStorePipeline::WriteLoop, this);
+    }
+}
+
+FChunkStorePipeline::~FChunkStorePipeline()
+{
+    Finish();
+}
+
+bool FChunkStorePipeline::Enqueue(std::span<const char8_t> name, std::span<const char> content)
+{
+    if (bFinished || ErrorCode.load()) {
+        return false;
+    }
+    //a chunk that can not be stored is an error of the whole backup, the manifest would name it anyway
+    if (name.size() > HexNameStrLen || content.size() > MaxFileChunkSize) {
+        SetError(std::errc::value_too_large);
+        return false;
+    }
+    //back pressure, only here the scan waits for the stages
+    ChunkStoreBuf_t* pBuf;
+    FreeQueue.wait_dequeue(pBuf);
+    memcpy(pBuf->Name, name.data(), name.size());
+    pBuf->NameLen = uint32_t(name.size());
+    memcpy(pBuf->Content.data(), content.data(), content.size());
+    pBuf->ContentLen = uint32_t(content.size());
+    CompressQueue.enqueue(pBuf);
+    return true;
+}
+
+std::error_code FChunkStorePipeline::Finish()
+{
+    if (bFinished.exchange(true)) {
+        return ErrorCode.load();
+    }
+    //the queues keep no order between producers, a stop token may be taken before chunks queued earlier.
+    //so every buffer is taken back first, then no chunk is left in any stage when the tokens are sent
+    ChunkStoreBuf_t* pBuf;
+    for (size_t i = 0; i < Bufs.size(); i++) {
+        FreeQueue.wait_dequeue(pBuf);
+    }
+    for (size_t i = 0; i < CompressThreads.size(); i++) {
+        CompressQueue.enqueue(nullptr);
+    }
+    CompressThreads.clear();
+    for (size_t i = 0; i < WriteThreads.size(); i++) {
+        WriteQueue.enqueue(nullptr);
+    }
+    WriteThreads.clear();
+    return ErrorCode.load();
+}
+
+void FChunkStorePipeline::CompressLoop()
+{
+    //zstd context per thread, the converter output is copied so the converter is free for the next chunk
+    auto profile = CompressionOptions.Profile;
+    auto pConverter = NewChunkConverter(profile);
+    pConverter->UpdateMaxFileChunkSize(MaxFileChunkSize);
+    pConverter->UpdateConvertDirection(EConvertDirection::ToChunkFile);
+    ChunkStoreBuf_t* pBuf;
+    uint32_t chunkNum{ 0 };
+    while (true) {
+        CompressQueue.wait_dequeue(pBuf);
+        if (!pBuf) {
+            break;
+        }
+        if (CompressionOptions.bAdaptiveLevel) {
+            if (++chunkNum % AdaptInterval == 0) {
+                AdaptCompressionLevel();
+            }
+            if (profile.Level != CompressionLevel) {
+                profile.Level = CompressionLevel;
+                pConverter->UpdateCompressionProfile(profile);
+            }
+        }
+        pConverter->Convert((const uint8_t*)pBuf->Content.data(), pBuf->ContentLen);
+        if (pConverter->GetChunkFileSize() == 0) {
+            SetError(std::errc::io_error);
+            FreeQueue.enqueue(pBuf);
+            continue;
+        }
+        auto chunkFileBuf = (const char*)pConverter->GetChunkFileBuf();
+        pBuf->ChunkFile.assign(chunkFileBuf, chunkFileBuf + pConverter->GetChunkFileSize());
+        WriteQueue.enqueue(pBuf);
+    }
+}
+
+void FChunkStorePipeline::AdaptCompressionLevel()
+{
+    //a quarter of the buffers waiting on a stage means it is the slow one
+    auto backlog = std::max<size_t>(Bufs.size() / 4, 1);
+    auto writeBacklog = WriteQueue.size_approx();
+    auto compressBacklog = CompressQueue.size_approx();
+    auto level = CompressionLevel.load();
+    if (writeBacklog >= backlog && compressBacklog < backlog) {
+        //the disk is slow, spare cpu buys a better ratio
+        if (level < CompressionOptions.MaxLevel) {
+            CompressionLevel.compare_exchange_strong(level, level + 1);
+        }
+    }
+    else if (compressBacklog >= backlog && writeBacklog == 0) {
+        //the writers wait on compression
+        if (level > CompressionOptions.MinLevel) {
+            CompressionLevel.compare_exchange_strong(level, level - 1);
+        }
+    }
+}
+
+void FChunkStorePipeline::WriteLoop()
+{
+    ChunkStoreBuf_t* pBuf;
+    while (true) {
+        WriteQueue.wait_dequeue(pBuf);
+        if (!pBuf) {
+            break;
+        }
+        if (!ChunkStore->Put(std::u8string_view(pBuf->Name, pBuf->NameLen), pBuf->ChunkFile)) {
+            SetError(std::errc::io_error);
+        }
+        FreeQueue.enqueue(pBuf);
+    }
+}
+
+std::shared_ptr<IChunkStorePipeline> NewChunkStorePipeline(std::shared_ptr<IChunkStore> pChunkStore, const ChunkStorePipelineOptions_t& options)
+{
+    return std::make_shared<FChunkStorePipeline>(std::move(pChunkStore), options);
+}
@@ -0,0 +1,334 @@
+#include "FileBackupInternal.h"
+
+#include <cstring>
+#include <cassert>
+#include <array>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define OFB_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define OFB_TARGET(x)
+#else
+#define OFB_TARGET(x) __attribute__((target(x)))
+#endif
+
+namespace {
+    constexpr uint32_t AdlerMod = 65521;
+    //multiple of AdlerMod above WindowMod * 255, keeps b positive before the reduction
+    constexpr uint32_t OutBias = AdlerMod * 256;
+
+    typedef void(*TRollBlockKernel)(uint32_t& A, uint32_t& B, uint32_t windowMod, const uint8_t* in, const uint8_t* out, uint32_t len, uint32_t* hashes);
+
+    void InitState(const uint8_t* data, uint32_t len, uint32_t& A, uint32_t& B) {
+        //5552 is the most bytes that can be summed before b overflows uint32
+        uint32_t a = 1, b = 0;
+        while (len > 0) {
+            uint32_t n = len < 5552 ? len : 5552;
+            len -= n;
+            while (n--) {
+                a += *data++;
+                b += a;
+            }
+            a %= AdlerMod;
+            b %= AdlerMod;
+        }
+        A = a;
+        B = b;
+    }
+
+    ///
+    /// a' = a + in - out
+    /// b' = b + a' - 1 - window * out
+    ///
+    void RollBlockScalar(uint32_t& A, uint32_t& B, uint32_t windowMod, const uint8_t* in, const uint8_t* out, uint32_t len, uint32_t* hashes) {
+        uint32_t a = A, b = B;
+        for (uint32_t i = 0; i < len; i++) {
+            a = (a + AdlerMod + in[i] - out[i]) % AdlerMod;
+            b = (b + a + OutBias - 1 - windowMod * out[i]) % AdlerMod;
+            hashes[i] = (b << 16) | a;
+        }
+        A = a;
+        B = b;
+    }
+
+#ifdef OFB_X86
+    ///
+    /// a block of positions is two prefix sums: a_j over in - out, then b_j over a_k - 1 - window * out_k.
+    /// sums stay below 2^28, reduced by folding 65536 = 15 (mod 65521)
+    ///
+    OFB_TARGET("sse4.1") inline __m128i PrefixSum4(__m128i x) {
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    }
+    OFB_TARGET("sse4.1") inline __m128i FoldMod4(__m128i x, __m128i low16, __m128i mod) {
+        auto hi = _mm_srli_epi32(x, 16);
+        x = _mm_add_epi32(_mm_and_si128(x, low16), _mm_sub_epi32(_mm_slli_epi32(hi, 4), hi));
+        hi = _mm_srli_epi32(x, 16);
+        x = _mm_add_epi32(_mm_and_si128(x, low16), _mm_sub_epi32(_mm_slli_epi32(hi, 4), hi));
+        return _mm_min_epu32(x, _mm_sub_epi32(x, mod));
+    }
+    OFB_TARGET("sse4.1") void RollBlockSSE41(uint32_t& A, uint32_t& B, uint32_t windowMod, const uint8_t* in, const uint8_t* out, uint32_t len, uint32_t* hashes) {
+        const auto mod = _mm_set1_epi32(AdlerMod);
+        const auto nmod = _mm_set1_epi32(windowMod);
+        const auto bias = _mm_set1_epi32(OutBias - 1);
+        const auto low16 = _mm_set1_epi32(0xffff);
+        auto a = _mm_set1_epi32(A);
+        auto b = _mm_set1_epi32(B);
+        uint32_t i = 0;
+        for (; i + 4 <= len; i += 4) {
+            uint32_t inWord, outWord;
+            memcpy(&inWord, in + i, sizeof(inWord));
+            memcpy(&outWord, out + i, sizeof(outWord));
+            auto vin = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(int(inWord)));
+            auto vout = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(int(outWord)));
+
+            auto va = _mm_add_epi32(_mm_add_epi32(a, mod), PrefixSum4(_mm_sub_epi32(vin, vout)));
+            va = _mm_min_epu32(va, _mm_sub_epi32(va, mod));
+            va = _mm_min_epu32(va, _mm_sub_epi32(va, mod));
+
+            auto e = _mm_sub_epi32(_mm_add_epi32(va, bias), _mm_mullo_epi32(vout, nmod));
+            auto vb = FoldMod4(_mm_add_epi32(b, PrefixSum4(e)), low16, mod);
+
+            _mm_storeu_si128((__m128i*)(hashes + i), _mm_or_si128(_mm_slli_epi32(vb, 16), va));
+            a = _mm_shuffle_epi32(va, 0xFF);
+            b = _mm_shuffle_epi32(vb, 0xFF);
+        }
+        A = uint32_t(_mm_cvtsi128_si32(a));
+        B = uint32_t(_mm_cvtsi128_si32(b));
+        RollBlockScalar(A, B, windowMod, in + i, out + i, len - i, hashes + i);
+    }
+
+    OFB_TARGET("avx2") inline __m256i PrefixSum8(__m256i x) {
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        auto carry = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(3));
+        return _mm256_add_epi32(x, _mm256_blend_epi32(_mm256_setzero_si256(), carry, 0xF0));
+    }
+    OFB_TARGET("avx2") inline __m256i FoldMod8(__m256i x, __m256i low16, __m256i mod) {
+        auto hi = _mm256_srli_epi32(x, 16);
+        x = _mm256_add_epi32(_mm256_and_si256(x, low16), _mm256_sub_epi32(_mm256_slli_epi32(hi, 4), hi));
+        hi = _mm256_srli_epi32(x, 16);
+        x = _mm256_add_epi32(_mm256_and_si256(x, low16), _mm256_sub_epi32(_mm256_slli_epi32(hi, 4), hi));
+        return _mm256_min_epu32(x, _mm256_sub_epi32(x, mod));
+    }
+    OFB_TARGET("avx2") void RollBlockAVX2(uint32_t& A, uint32_t& B, uint32_t windowMod, const uint8_t* in, const uint8_t* out, uint32_t len, uint32_t* hashes) {
+        const auto mod = _mm256_set1_epi32(AdlerMod);
+        const auto nmod = _mm256_set1_epi32(windowMod);
+        const auto bias = _mm256_set1_epi32(OutBias - 1);
+        const auto low16 = _mm256_set1_epi32(0xffff);
+        const auto last = _mm256_set1_epi32(7);
+        auto a = _mm256_set1_epi32(A);
+        auto b = _mm256_set1_epi32(B);
+        uint32_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            auto vin = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)));
+            auto vout = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(out + i)));
+
+            auto va = _mm256_add_epi32(_mm256_add_epi32(a, mod), PrefixSum8(_mm256_sub_epi32(vin, vout)));
+            va = _mm256_min_epu32(va, _mm256_sub_epi32(va, mod));
+            va = _mm256_min_epu32(va, _mm256_sub_epi32(va, mod));
+
+            auto e = _mm256_sub_epi32(_mm256_add_epi32(va, bias), _mm256_mullo_epi32(vout, nmod));
+            auto vb = FoldMod8(_mm256_add_epi32(b, PrefixSum8(e)), low16, mod);
+
+            _mm256_storeu_si256((__m256i*)(hashes + i), _mm256_or_si256(_mm256_slli_epi32(vb, 16), va));
+            a = _mm256_permutevar8x32_epi32(va, last);
+            b = _mm256_permutevar8x32_epi32(vb, last);
+        }
+        A = uint32_t(_mm_cvtsi128_si32(_mm256_castsi256_si128(a)));
+        B = uint32_t(_mm_cvtsi128_si32(_mm256_castsi256_si128(b)));
+        RollBlockScalar(A, B, windowMod, in + i, out + i, len - i, hashes + i);
+    }
+
+    bool CpuSupportsAVX2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+        __cpuid(info, 1);
+        bool bOSXSave = info[2] & (1 << 27);
+        bool bAVX = info[2] & (1 << 28);
+        if (!bOSXSave || !bAVX || (_xgetbv(0) & 6) != 6) {
+            return false;
+        }
+        __cpuidex(info, 7, 0);
+        return info[1] & (1 << 5);
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+    bool CpuSupportsSSE41() {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        return info[2] & (1 << 19);
+#else
+        return __builtin_cpu_supports("sse4.1");
+#endif
+    }
+#endif
+
+    TRollBlockKernel SelectRollBlockKernel() {
+#ifdef OFB_X86
+        if (CpuSupportsAVX2()) {
+            return RollBlockAVX2;
+        }
+        if (CpuSupportsSSE41()) {
+            return RollBlockSSE41;
+        }
+#endif
+        return RollBlockScalar;
+    }
+    TRollBlockKernel GetRollBlockKernel() {
+        static const TRollBlockKernel Kernel = SelectRollBlockKernel();
+        return Kernel;
+    }
+
+    bool CheckRollingAdler32Compatible() {
+        constexpr uint32_t windowLen = 256;
+        constexpr uint32_t rollLen = FBlockRollingAdler32::MaxBlockLen;
+        uint8_t data[windowLen + rollLen];
+        uint64_t state = 0x0F11EBAC4B5EEDULL;
+        for (auto& byte : data) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            byte = uint8_t(state >> 56);
+        }
+        FRollingAdler32 reference;
+        reference.Init(data, windowLen);
+        uint32_t A, B;
+        InitState(data, windowLen, A, B);
+        if (reference.Get() != ((B << 16) | A)) {
+            return false;
+        }
+        uint32_t hashes[rollLen];
+        GetRollBlockKernel()(A, B, windowLen % AdlerMod, data + windowLen, data, rollLen, hashes);
+        for (uint32_t i = 0; i < rollLen; i++) {
+            reference.Roll(data[windowLen + i], data[i]);
+            if (reference.Get() != hashes[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+bool FBlockRollingAdler32::IsCompatible()
+{
+    static const bool bCompatible = CheckRollingAdler32Compatible();
+    return bCompatible;
+}
+
+const char* FBlockRollingAdler32::GetKernelName()
+{
+    if (!IsCompatible()) {
+        return "byte";
+    }
+    auto kernel = GetRollBlockKernel();
+#ifdef OFB_X86
+    if (kernel == RollBlockAVX2) {
+        return "avx2";
+    }
+    if (kernel == RollBlockSSE41) {
+        return "sse4.1";
+    }
+#endif
+    return "scalar";
+}
+
+WeakHash_t FBlockRollingAdler32::Hash(const uint8_t* data, uint32_t len)
+{
+    FBlockRollingAdler32 hasher;
+    hasher.Init(data, len);
+    return hasher.Get();
+}
+
+void FBlockRollingAdler32::Init(const uint8_t* data, uint32_t len)
+{
+    bInited = true;
+    if (!IsCompatible()) {
+        Fallback.Init(data, len);
+        return;
+    }
+    WindowMod = len % AdlerMod;
+    InitState(data, len, A, B);
+}
+
+WeakHash_t FBlockRollingAdler32::Get()
+{
+    if (!IsCompatible()) {
+        return Fallback.Get();
+    }
+    return (B << 16) | A;
+}
+
+void FBlockRollingAdler32::RollBlock(const uint8_t* in, const uint8_t* out, uint32_t len, WeakHash_t* hashes)
+{
+    assert(len <= MaxBlockLen);
+    if (!IsCompatible()) {
+        for (uint32_t i = 0; i < len; i++) {
+            Fallback.Roll(in[i], out[i]);
+            hashes[i] = Fallback.Get();
+        }
+        return;
+    }
+    uint32_t adlerHashes[MaxBlockLen];
+    GetRollBlockKernel()(A, B, WindowMod, in, out, len, adlerHashes);
+    for (uint32_t i = 0; i < len; i++) {
+        hashes[i] = adlerHashes[i];
+    }
+}
+
+namespace {
+    constexpr uint64_t RabinKarpBase = 0xC6A4A7935BD1E995ULL;
+
+    constexpr std::array<uint64_t, 256> GenerateRabinKarpTable() {
+        std::array<uint64_t, 256> table{};
+        uint64_t state = 0x5EEDFA11BAC4ULL;
+        for (auto& v : table) {
+            //splitmix64
+            state += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            v = z ^ (z >> 31);
+        }
+        return table;
+    }
+    constexpr auto RabinKarpTable = GenerateRabinKarpTable();
+}
+
+WeakHash_t FBlockRollingRabinKarp64::Hash(const uint8_t* data, uint32_t len)
+{
+    FBlockRollingRabinKarp64 hasher;
+    hasher.Init(data, len);
+    return hasher.Get();
+}
+
+void FBlockRollingRabinKarp64::Init(const uint8_t* data, uint32_t len)
+{
+    bInited = true;
+    H = 0;
+    OutFactor = 1;
+    for (uint32_t i = 0; i < len; i++) {
+        H = H * RabinKarpBase + RabinKarpTable[data[i]];
+        OutFactor *= RabinKarpBase;
+    }
+}
+
+void FBlockRollingRabinKarp64::RollBlock(const uint8_t* in, const uint8_t* out, uint32_t len, WeakHash_t* hashes)
+{
+    auto h = H;
+    for (uint32_t i = 0; i < len; i++) {
+        h = h * RabinKarpBase + RabinKarpTable[in[i]] - RabinKarpTable[out[i]] * OutFactor;
+        hashes[i] = h;
+    }
+    H = h;
+}
@@ -74,10 +74,17 @@ rapidjson::Document to_json(const FolderManifest_t& FolderManifest) {
             auto& chunk = *pChunk;
             fileChunkNode.AddMember("hexName", rapidjson::StringRef(chunk.HexName), a);
             fileChunkNode.AddMember("startPos", chunk.StartPos, a);
+            fileChunkNode.AddMember("size", chunk.Size, a);
+            if (chunk.bPacked) {
+                fileChunkNode.AddMember("offset", chunk.ChunkOffset, a);
+            }
             fileChunksNode.PushBack(fileChunkNode, a);
         }
         fileNode.AddMember("fileHash", rapidjson::StringRef(fileData->FileHash), a);
         fileNode.AddMember("fileSize", fileData->FileSize, a);
+        if (fileData->FileHashKind != EFileHashKind::Sequential) {
+            fileNode.AddMember("fileHashKind", uint32_t(fileData->FileHashKind), a);
+        }
         if (fileData->Chunks.size() > 0) {
             fileNode.AddMember("chunks", fileChunksNode, a);
         }
@@ -86,6 +93,8 @@ rapidjson::Document to_json(const FolderManifest_t& FolderManifest) {
     doc.AddMember("id", rapidjson::StringRef(FolderManifest.ID, bin_to_hex_length(UUID_128_BYTES)), a);
     doc.AddMember("chunkFileMaxSize",FolderManifest.ChunkFileMaxSize,a);
     doc.AddMember("hexNameLen", FolderManifest.HexNameLen, a);
+    doc.AddMember("weakHashKind", uint32_t(FolderManifest.WeakHashKind), a);
+    doc.AddMember("chunkSize", FolderManifest.ChunkSize, a);
     doc.AddMember("files", filesNode, a);
     return doc;
 }
@@ -140,6 +149,34 @@ std::shared_ptr<const FolderManifest_t> FolderManifest_t::from_string(FCharBuffe
     }
     manifest.HexNameLen = u64Res.value_unsafe();
 
+    //manifests written before the weak hash kind was recorded are adler32
+    u64Res = rootRes["weakHashKind"].get_uint64();
+    if (u64Res.error() == simdjson::error_code::SUCCESS) {
+        if (u64Res.value_unsafe() > uint64_t(EWeakHashKind::RabinKarp64)) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        manifest.WeakHashKind = EWeakHashKind(u64Res.value_unsafe());
+    }
+    else if (u64Res.error() != simdjson::error_code::NO_SUCH_FIELD) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return nullptr;
+    }
+
+    //manifests written before the chunk size was configurable use the default size
+    u64Res = rootRes["chunkSize"].get_uint64();
+    if (u64Res.error() == simdjson::error_code::SUCCESS) {
+        if (u64Res.value_unsafe() > UINT32_MAX || !IsValidFileChunkSize(uint32_t(u64Res.value_unsafe()))) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        manifest.ChunkSize = uint32_t(u64Res.value_unsafe());
+    }
+    else if (u64Res.error() != simdjson::error_code::NO_SUCH_FIELD) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return nullptr;
+    }
+
     auto filesRes = rootRes["files"].get_object();
     if (filesRes.error() != simdjson::error_code::SUCCESS) {
         ec = std::make_error_code(std::errc::invalid_argument);
@@ -185,6 +222,19 @@ std::shared_ptr<const FolderManifest_t> FolderManifest_t::from_string(FCharBuffe
         }
         FileChunksData.FileSize = u64Res.value_unsafe();
 
+        u64Res = fileRes["fileHashKind"].get_uint64();
+        if (u64Res.error() == simdjson::error_code::SUCCESS) {
+            if (u64Res.value_unsafe() > uint64_t(EFileHashKind::SplitRanges)) {
+                ec = std::make_error_code(std::errc::invalid_argument);
+                return nullptr;
+            }
+            FileChunksData.FileHashKind = EFileHashKind(u64Res.value_unsafe());
+        }
+        else if (u64Res.error() != simdjson::error_code::NO_SUCH_FIELD) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+
         auto chunksRes = fileRes["chunks"].get_array();
         if (chunksRes.error() == simdjson::error_code::SUCCESS) {
             for (auto chunkRes : chunksRes) {
@@ -200,6 +250,10 @@ std::shared_ptr<const FolderManifest_t> FolderManifest_t::from_string(FCharBuffe
                     ec = std::make_error_code(std::errc::invalid_argument);
                     return nullptr;
                 }
+                if (strRes.value_unsafe().size() > HexNameStrLen) {
+                    ec = std::make_error_code(std::errc::invalid_argument);
+                    return nullptr;
+                }
                 memcpy(chunkData.HexName, strRes.value_unsafe().data(), strRes.value_unsafe().size());
                 chunkData.HexName[strRes.value_unsafe().size()] = '\0';
 
@@ -209,6 +263,38 @@ std::shared_ptr<const FolderManifest_t> FolderManifest_t::from_string(FCharBuffe
                     return nullptr;
                 }
                 chunkData.StartPos = u64Res.value_unsafe();
+
+                //manifests written before variable sized chunks have no size
+                chunkData.Size = manifest.ChunkSize;
+                //size and offset drive reads into buffers of the max chunk size when recovering
+                auto maxChunkSize = GetMaxFileChunkSize(manifest.ChunkSize);
+                u64Res = chunkRes["size"].get_uint64();
+                if (u64Res.error() == simdjson::error_code::SUCCESS) {
+                    if (u64Res.value_unsafe() == 0 || u64Res.value_unsafe() > maxChunkSize) {
+                        ec = std::make_error_code(std::errc::invalid_argument);
+                        return nullptr;
+                    }
+                    chunkData.Size = uint32_t(u64Res.value_unsafe());
+                }
+                else if (u64Res.error() != simdjson::error_code::NO_SUCH_FIELD) {
+                    ec = std::make_error_code(std::errc::invalid_argument);
+                    return nullptr;
+                }
+
+                //only pack chunks record an offset
+                u64Res = chunkRes["offset"].get_uint64();
+                if (u64Res.error() == simdjson::error_code::SUCCESS) {
+                    if (u64Res.value_unsafe() > maxChunkSize - chunkData.Size) {
+                        ec = std::make_error_code(std::errc::invalid_argument);
+                        return nullptr;
+                    }
+                    chunkData.ChunkOffset = uint32_t(u64Res.value_unsafe());
+                    chunkData.bPacked = true;
+                }
+                else if (u64Res.error() != simdjson::error_code::NO_SUCH_FIELD) {
+                    ec = std::make_error_code(std::errc::invalid_argument);
+                    return nullptr;
+                }
                 FileChunksData.Chunks.emplace(pChunkData);
             }
         }
@@ -222,6 +308,127 @@ int32_t FolderManifest_t::get_string_extra_space()
     return simdjson::SIMDJSON_PADDING;
 }
 
+void FileStatCache_t::to_string(FCharBuffer& charBuf, std::error_code& ec) const
+{
+    ec.clear();
+    rapidjson::Document doc{ rapidjson::kObjectType };
+    rapidjson::Value filesNode{ rapidjson::kObjectType };
+    auto& a = doc.GetAllocator();
+    for (auto& [fileName, fileData] : Files) {
+        rapidjson::Value fileNode{ rapidjson::kObjectType };
+        fileNode.AddMember("size", fileData->Stat.Size, a);
+        fileNode.AddMember("mtime", fileData->Stat.MTime, a);
+        fileNode.AddMember("ctime", fileData->Stat.CTime, a);
+        fileNode.AddMember("inode", fileData->Stat.Inode, a);
+        filesNode.AddMember(rapidjson::StringRef(fileData->FileName.c_str()), fileNode, a);
+    }
+    doc.AddMember("scanTime", ScanTime, a);
+    doc.AddMember("manifestId", rapidjson::StringRef(ManifestID, strlen(ManifestID)), a);
+    doc.AddMember("files", filesNode, a);
+    rapidjson::Writer<FCharBuffer> writer(charBuf);
+    if (!doc.Accept(writer)) {
+        ec = utilpp::make_common_used_error(utilpp::ECommonUsedError::CUE_UNKNOW);
+    }
+}
+
+std::shared_ptr<const FileStatCache_t> FileStatCache_t::from_string(FCharBuffer& str, std::error_code& ec)
+{
+    ec.clear();
+    str.Reserve(str.Size() + simdjson::SIMDJSON_PADDING);
+    auto out = std::make_shared<FileStatCache_t>();
+    auto& cache = *out;
+    simdjson::ondemand::parser parser;
+    auto doc = parser.iterate(str.Data(), str.Size(), str.Capacity());
+    auto rootRes = doc.get_object();
+    if (rootRes.error() != simdjson::error_code::SUCCESS) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return nullptr;
+    }
+
+    auto i64Res = rootRes["scanTime"].get_int64();
+    if (i64Res.error() != simdjson::error_code::SUCCESS) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return nullptr;
+    }
+    cache.ScanTime = i64Res.value_unsafe();
+
+    //a cache without it is never matched to a manifest
+    auto strRes = rootRes["manifestId"].get_string();
+    if (strRes.error() == simdjson::error_code::SUCCESS) {
+        if (strRes.value_unsafe().size() >= sizeof(cache.ManifestID)) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        memcpy(cache.ManifestID, strRes.value_unsafe().data(), strRes.value_unsafe().size());
+        cache.ManifestID[strRes.value_unsafe().size()] = '\0';
+    }
+    else if (strRes.error() != simdjson::error_code::NO_SUCH_FIELD) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return nullptr;
+    }
+
+    auto filesRes = rootRes["files"].get_object();
+    if (filesRes.error() != simdjson::error_code::SUCCESS) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return nullptr;
+    }
+    for (auto field : filesRes) {
+        if (field.error() != simdjson::error_code::SUCCESS) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        auto pFileStatData = std::make_shared<FileStatData_t>();
+        auto& fileStatData = *pFileStatData;
+        strRes = field.unescaped_key();
+        if (strRes.error() != simdjson::error_code::SUCCESS) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        fileStatData.FileName = strRes.value_unsafe();
+        auto insertRes = cache.Files.try_emplace(ConvertViewToU8View(fileStatData.FileName), pFileStatData);
+        if (!insertRes.second) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+
+        auto fileRes = field.value().get_object();
+        if (fileRes.error() != simdjson::error_code::SUCCESS) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        auto u64Res = fileRes["size"].get_uint64();
+        if (u64Res.error() != simdjson::error_code::SUCCESS) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        fileStatData.Stat.Size = u64Res.value_unsafe();
+        i64Res = fileRes["mtime"].get_int64();
+        if (i64Res.error() != simdjson::error_code::SUCCESS) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        fileStatData.Stat.MTime = i64Res.value_unsafe();
+        i64Res = fileRes["ctime"].get_int64();
+        if (i64Res.error() != simdjson::error_code::SUCCESS) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        fileStatData.Stat.CTime = i64Res.value_unsafe();
+        u64Res = fileRes["inode"].get_uint64();
+        if (u64Res.error() != simdjson::error_code::SUCCESS) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return nullptr;
+        }
+        fileStatData.Stat.Inode = u64Res.value_unsafe();
+    }
+    return out;
+}
+
+int32_t FileStatCache_t::get_string_extra_space()
+{
+    return simdjson::SIMDJSON_PADDING;
+}
+
 std::shared_ptr<const FolderManifestCompareResult_t> CompareFolderManifest(const FolderManifest_t& target, std::shared_ptr<const FolderManifest_t> source) {
 
     auto out = std::make_shared<FolderManifestCompareResult_t>();
@@ -235,6 +442,10 @@ std::shared_ptr<const FolderManifestCompareResult_t> CompareFolderManifest(const
             out->FilesNeedDelete.emplace(pathstr);
             for (auto& pFileChunk : FileChunksData->Chunks) {
                 auto& FileChunk = *pFileChunk;
+                //a source file only holds its own part of a pack chunk, the pack comes from the chunk dir
+                if (FileChunk.bPacked) {
+                    continue;
+                }
 
                 auto res=out->SourceChunkReverseIndex.try_emplace(GetHexNameView(FileChunk.HexName));
                 auto fileEmplaceRes =res.first->second.try_emplace(pathstr);
@@ -248,7 +459,7 @@ std::shared_ptr<const FolderManifestCompareResult_t> CompareFolderManifest(const
         if (source) {
             out->FilesNeedDelete.erase(target_filename);
             auto itr=source->Files.find(target_filename);
-            if (itr!=source->Files.end()&&memcmp(itr->second->FileHash, target_file_data->FileHash, FileHashLen) == 0) {
+            if (itr!=source->Files.end()&&itr->second->IsSameFileHash(*target_file_data)) {
                 continue;
             }
         }
@@ -269,7 +480,7 @@ std::shared_ptr<const FolderManifestCompareResult_t> CompareFolderManifest(const
 
         // 整个文件区间
         uint64_t file_start = all_target_chunks.front()->StartPos;
-        uint64_t file_end = all_target_chunks.back()->StartPos + FileChunkSize;
+        uint64_t file_end = all_target_chunks.back()->StartPos + all_target_chunks.back()->Size;
 
         // 使用贪心算法选择最优的chunk组合来覆盖整个文件
         std::set<std::shared_ptr<FileConstructChunkData_t>, FileConstructChunkDataLess_t,
@@ -283,7 +494,7 @@ std::shared_ptr<const FolderManifestCompareResult_t> CompareFolderManifest(const
 
             for (const auto& chunk_ptr : all_target_chunks) {
                 uint64_t chunk_start = chunk_ptr->StartPos;
-                uint64_t chunk_end = chunk_start + FileChunkSize;
+                uint64_t chunk_end = chunk_start + chunk_ptr->Size;
 
                 if (chunk_start <= current_pos && chunk_end > current_pos) {
                     // 这个chunk能覆盖当前位置
@@ -307,7 +518,7 @@ std::shared_ptr<const FolderManifestCompareResult_t> CompareFolderManifest(const
             bool best_from_source = false;
 
             for (const auto& chunk_ptr : candidates) {
-                uint64_t chunk_end = chunk_ptr->StartPos + FileChunkSize;
+                uint64_t chunk_end = chunk_ptr->StartPos + chunk_ptr->Size;
                 bool is_from_source = out->SourceChunkReverseIndex.count(GetHexNameView(chunk_ptr->HexName));
 
                 // 优先选择源中存在的，如果都是同类型则选择覆盖范围更广的
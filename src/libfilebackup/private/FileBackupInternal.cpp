@@ -1,5 +1,14 @@
 #include "FileBackupInternal.h"
 
+#include <cmath>
+
+namespace {
+    constexpr size_t IncompressibleSampleSize = 4096;
+    constexpr size_t IncompressibleSampleNum = 4;
+    //zstd gains about a percent at this entropy, not worth its time both ways
+    constexpr double IncompressibleEntropyBits = 7.9;
+}
+
 
 FChunkConverter::FChunkConverter()
 {
@@ -27,7 +36,7 @@ void FChunkConverter::UpdateConvertDirection(EConvertDirection newDirection)
 {
     Direction = newDirection;
     if (!ZSTDBuf) {
-        ZSTDBufSize = ZSTD_compressBound(FileChunkSize);
+        ZSTDBufSize = ZSTD_compressBound(MaxFileChunkSize);
         ZSTDBuf = malloc(ZSTDBufSize);
     }
     switch (Direction)
@@ -46,6 +55,7 @@ void FChunkConverter::UpdateConvertDirection(EConvertDirection newDirection)
             return;
         }
         CCtx = ZSTD_createCCtx();
+        ApplyCompressionProfile();
         break;
     }
     default:
@@ -53,18 +63,65 @@ void FChunkConverter::UpdateConvertDirection(EConvertDirection newDirection)
     }
 }
 
-void FChunkConverter::Convert(const uint8_t* FileChunk)
+void FChunkConverter::UpdateMaxFileChunkSize(size_t newSize)
+{
+    MaxFileChunkSize = newSize;
+    if (!ZSTDBuf || ZSTD_compressBound(MaxFileChunkSize) == ZSTDBufSize) {
+        return;
+    }
+    free(ZSTDBuf);
+    ZSTDBufSize = ZSTD_compressBound(MaxFileChunkSize);
+    ZSTDBuf = malloc(ZSTDBufSize);
+    ZSTDBufContentSize = 0;
+}
+
+void FChunkConverter::UpdateCompressionProfile(const ChunkCompressionProfile_t& profile)
+{
+    CompressionProfile = profile;
+    if (CCtx) {
+        ApplyCompressionProfile();
+    }
+}
+
+void FChunkConverter::ApplyCompressionProfile()
+{
+    ZSTD_CCtx_reset(CCtx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(CCtx, ZSTD_c_compressionLevel, CompressionProfile.Level);
+    ZSTD_CCtx_setParameter(CCtx, ZSTD_c_strategy, CompressionProfile.Strategy);
+    //ZSTD_ps_enable, the default leaves it to the strategy
+    ZSTD_CCtx_setParameter(CCtx, ZSTD_c_enableLongDistanceMatching, CompressionProfile.bLongDistanceMatching ? 1 : 0);
+    //fails without ZSTD_MULTITHREAD, the chunk is then compressed on the calling thread
+    ZSTD_CCtx_setParameter(CCtx, ZSTD_c_nbWorkers, CompressionProfile.WorkerNum);
+}
+
+void FChunkConverter::Convert(const uint8_t* FileChunk, size_t FileChunkLen)
 {
     switch (Direction)
     {
     case EConvertDirection::ToFileChunk:
     {
-        size_t const dSize = ZSTD_decompressDCtx(DCtx, (void*)FileChunk, FileChunkSize, ZSTDBuf, ZSTDBufContentSize);
+        auto rawContent = GetRawChunkFileContent(ZSTDBuf, ZSTDBufContentSize);
+        if (!rawContent.empty()) {
+            FileChunkContentSize = rawContent.size() > FileChunkLen ? 0 : rawContent.size();
+            memcpy((void*)FileChunk, rawContent.data(), FileChunkContentSize);
+            break;
+        }
+        size_t const dSize = ZSTD_decompressDCtx(DCtx, (void*)FileChunk, FileChunkLen, ZSTDBuf, ZSTDBufContentSize);
+        FileChunkContentSize = ZSTD_isError(dSize) ? 0 : dSize;
         break;
     }
     case EConvertDirection::ToChunkFile:
     {
-        ZSTDBufContentSize = ZSTD_compressCCtx(CCtx, ZSTDBuf, ZSTDBufSize, FileChunk, FileChunkSize, 1);
+        if (CompressionProfile.bStoreIncompressibleRaw && IsLikelyIncompressible(FileChunk, FileChunkLen)) {
+            StoreRaw(FileChunk, FileChunkLen);
+            break;
+        }
+        size_t const cSize = ZSTD_compress2(CCtx, ZSTDBuf, ZSTDBufSize, FileChunk, FileChunkLen);
+        ZSTDBufContentSize = ZSTD_isError(cSize) ? 0 : cSize;
+        //missed by the probe, a raw chunk still saves the decompression
+        if (CompressionProfile.bStoreIncompressibleRaw && ZSTDBufContentSize >= FileChunkLen) {
+            StoreRaw(FileChunk, FileChunkLen);
+        }
         break;
     }
     default:
@@ -72,6 +129,180 @@ void FChunkConverter::Convert(const uint8_t* FileChunk)
     }
 }
 
+void FChunkConverter::StoreRaw(const uint8_t* FileChunk, size_t FileChunkLen)
+{
+    //the compress bound leaves more room than the header
+    if (sizeof(RawChunkFileMagic) + FileChunkLen > ZSTDBufSize) {
+        ZSTDBufContentSize = 0;
+        return;
+    }
+    memcpy(ZSTDBuf, RawChunkFileMagic, sizeof(RawChunkFileMagic));
+    memcpy((char*)ZSTDBuf + sizeof(RawChunkFileMagic), FileChunk, FileChunkLen);
+    ZSTDBufContentSize = sizeof(RawChunkFileMagic) + FileChunkLen;
+}
+
+bool IsLikelyIncompressible(const uint8_t* data, size_t len)
+{
+    //too few bytes for the estimate, and small chunks are cheap to compress anyway
+    if (len < IncompressibleSampleSize * IncompressibleSampleNum) {
+        return false;
+    }
+    uint32_t counts[256]{};
+    auto stride = (len - IncompressibleSampleSize) / (IncompressibleSampleNum - 1);
+    for (size_t i = 0; i < IncompressibleSampleNum; i++) {
+        auto sample = data + i * stride;
+        for (size_t j = 0; j < IncompressibleSampleSize; j++) {
+            counts[sample[j]]++;
+        }
+    }
+    double total = double(IncompressibleSampleSize * IncompressibleSampleNum);
+    double entropy{ 0 };
+    for (auto count : counts) {
+        if (count) {
+            double p = count / total;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy >= IncompressibleEntropyBits;
+}
+
 std::shared_ptr<IChunkConverter> NewChunkConverter() {
     return std::make_shared<FChunkConverter>();
-}
\ No newline at end of file
+}
+std::shared_ptr<IChunkConverter> NewChunkConverter(const ChunkCompressionProfile_t& profile) {
+    auto pConverter = std::make_shared<FChunkConverter>();
+    pConverter->UpdateCompressionProfile(profile);
+    return pConverter;
+}
+int GetMinCompressionLevel()
+{
+    return ZSTD_minCLevel();
+}
+int GetMaxCompressionLevel()
+{
+    return ZSTD_maxCLevel();
+}
+bool IsZeroBuf(const void* data, size_t len)
+{
+    auto p = (const uint8_t*)data;
+    for (; len >= 64; p += 64, len -= 64) {
+        uint64_t words[8];
+        memcpy(words, p, sizeof(words));
+        uint64_t acc{ 0 };
+        for (auto word : words) {
+            acc |= word;
+        }
+        if (acc) {
+            return false;
+        }
+    }
+    for (; len > 0; p++, len--) {
+        if (*p) {
+            return false;
+        }
+    }
+    return true;
+}
+
+namespace {
+    constexpr char ChunkIDIndexMagic[8] = { 'O','F','B','C','I','D','X','1' };
+    typedef struct ChunkIDIndexHeader_t {
+        char Magic[8];
+        uint32_t KeySize;
+        uint32_t WeakHashKind;
+        uint64_t KeyNum;
+        uint64_t FilterBlockNum;//the weak hash filter after the keys, 0 if none
+    }ChunkIDIndexHeader_t;
+}
+
+template<typename TKey>
+bool TChunkIndex<TKey>::LoadBase(const std::filesystem::path& path, EWeakHashKind weakHashKind)
+{
+    std::error_code ec;
+    if (!std::filesystem::exists(path, ec)) {
+        return false;
+    }
+    auto pFile = std::make_shared<FMappedFile>();
+    if (!pFile->Open(path) || pFile->GetSize() < sizeof(ChunkIDIndexHeader_t)) {
+        return false;
+    }
+    auto pData = pFile->Map(0, size_t(pFile->GetSize()));
+    if (!pData) {
+        return false;
+    }
+    ChunkIDIndexHeader_t header;
+    memcpy(&header, pData, sizeof(header));
+    if (memcmp(header.Magic, ChunkIDIndexMagic, sizeof(ChunkIDIndexMagic)) != 0 || header.KeySize != sizeof(TKey)
+        || header.WeakHashKind != uint32_t(weakHashKind) || (header.FilterBlockNum && !std::has_single_bit(header.FilterBlockNum))
+        || sizeof(header) + header.KeyNum * sizeof(TKey) + header.FilterBlockNum * FWeakHashFilter::BlockSize != pFile->GetSize()) {
+        return false;
+    }
+    BaseKeys = { (const TKey*)(pData + sizeof(header)), size_t(header.KeyNum) };
+    BaseFilterData = header.FilterBlockNum ? pData + sizeof(header) + header.KeyNum * sizeof(TKey) : nullptr;
+    BaseFilterBlockNum = size_t(header.FilterBlockNum);
+    BaseFile = pFile;
+    return true;
+}
+
+template<typename TKey>
+bool TChunkIndex<TKey>::SaveMerged(const std::filesystem::path& path, EWeakHashKind weakHashKind)
+{
+    std::vector<TKey> newKeys;
+    for (auto& shard : Shards) {
+        std::shared_lock lock(shard.Mtx);
+        newKeys.insert(newKeys.end(), shard.Keys.begin(), shard.Keys.end());
+        newKeys.insert(newKeys.end(), shard.ClaimedKeys.begin(), shard.ClaimedKeys.end());
+    }
+    std::sort(newKeys.begin(), newKeys.end());
+    newKeys.erase(std::unique(newKeys.begin(), newKeys.end()), newKeys.end());
+    //room for as many new chunks again before a later run rebuilds the filter from the keys
+    FWeakHashFilter filter;
+    filter.Init((BaseKeys.size() + newKeys.size()) * 2);
+    ChunkIDIndexHeader_t header{};
+    memcpy(header.Magic, ChunkIDIndexMagic, sizeof(ChunkIDIndexMagic));
+    header.KeySize = sizeof(TKey);
+    header.WeakHashKind = uint32_t(weakHashKind);
+    header.FilterBlockNum = filter.GetBlockNum();
+    {
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        if (!ofs.is_open()) {
+            return false;
+        }
+        ofs.write((const char*)&header, sizeof(header));
+        auto writeKey = [&](const TKey& key) {
+            ofs.write((const char*)&key, sizeof(key));
+            filter.Insert(key.WeakHash);
+            header.KeyNum++;
+            };
+        auto baseItr = BaseKeys.begin();
+        auto newItr = newKeys.begin();
+        while (baseItr != BaseKeys.end() || newItr != newKeys.end()) {
+            if (newItr == newKeys.end() || (baseItr != BaseKeys.end() && *baseItr < *newItr)) {
+                writeKey(*baseItr++);
+            }
+            else {
+                //a key inserted before the base was loaded may be in both
+                if (baseItr != BaseKeys.end() && *baseItr == *newItr) {
+                    baseItr++;
+                }
+                writeKey(*newItr++);
+            }
+        }
+        filter.Save(ofs);
+        ofs.seekp(0);
+        ofs.write((const char*)&header, sizeof(header));
+        ofs.close();
+        if (!ofs) {
+            return false;
+        }
+    }
+    //the caller may now replace the mapped file
+    BaseKeys = {};
+    BaseFilterData = nullptr;
+    BaseFilterBlockNum = 0;
+    BaseFile.reset();
+    return true;
+}
+
+template class TChunkIndex<NarrowChunkKey_t>;
+template class TChunkIndex<ChunkKey_t>;
@@ -7,26 +7,570 @@
 #include <xxhash.h>
 #include <zstd.h>
 #ifdef BOOST_FOUND
-#include <boost/unordered/unordered_flat_map.hpp>
 #include <boost/unordered/unordered_flat_set.hpp>
 #else
-#include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
 #endif
 
 #include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <climits>
 #include <atomic>
 #include <span>
+#include <array>
+#include <vector>
+#include <bit>
+#include <algorithm>
+#include <shared_mutex>
+#include <mutex>
+#include <deque>
+#include <unordered_set>
+#include <type_traits>
+#include <functional>
+#include <moodycamel/concurrentqueue.h>
+
+#pragma pack(push, 1)
+///
+/// @brief binary chunk id, the weak hash followed by the xxh3 strong hash
+/// @detail TWeakHash is the width the key is stored at, ChunkKey_t holds every kind and is what callers pass
+///
+template<typename TWeakHash>
+struct TChunkKey {
+    TWeakHash WeakHash;
+    XXH128_hash_t StrongHash;
+
+    //bin is the hex decoded chunk name, weakHashSize bytes of little endian weak hash then the canonical strong hash
+    static TChunkKey FromBinary(const uint8_t* bin, uint32_t weakHashSize) {
+        TChunkKey key{ 0 };
+        for (uint32_t i = 0; i < weakHashSize; i++) {
+            key.WeakHash |= TWeakHash(bin[i]) << (i * CHAR_BIT);
+        }
+        key.StrongHash = XXH128_hashFromCanonical((const XXH128_canonical_t*)(bin + weakHashSize));
+        return key;
+    }
+    static TChunkKey FromCanonical(WeakHash_t weakHash, const unsigned char strongHash[16]) {
+        return { TWeakHash(weakHash), XXH128_hashFromCanonical((const XXH128_canonical_t*)strongHash) };
+    }
+    //the weak hash of the kind this width is used for always fits
+    template<typename TOtherWeakHash>
+    static TChunkKey From(const TChunkKey<TOtherWeakHash>& key) {
+        return { TWeakHash(key.WeakHash), key.StrongHash };
+    }
+    bool operator==(const TChunkKey& other) const {
+        return WeakHash == other.WeakHash && StrongHash.low64 == other.StrongHash.low64 && StrongHash.high64 == other.StrongHash.high64;
+    }
+    //order of the chunk id index file, by weak hash first so a weak hash alone finds its range
+    bool operator<(const TChunkKey& other) const {
+        if (WeakHash != other.WeakHash) {
+            return WeakHash < other.WeakHash;
+        }
+        if (StrongHash.high64 != other.StrongHash.high64) {
+            return StrongHash.high64 < other.StrongHash.high64;
+        }
+        return StrongHash.low64 < other.StrongHash.low64;
+    }
+};
+typedef TChunkKey<WeakHash_t> ChunkKey_t;
+typedef TChunkKey<uint32_t> NarrowChunkKey_t;//adler32 keys, stored at 20 bytes instead of 24
+#pragma pack(pop)
+static_assert(sizeof(ChunkKey_t) == sizeof(WeakHash_t) + StrongHashBit / CHAR_BIT);
+static_assert(sizeof(NarrowChunkKey_t) == sizeof(uint32_t) + StrongHashBit / CHAR_BIT);
+
+///the weak hash already is a hash, only spread it over size_t.
+///keys with the same weak hash share a slot hash, so a weak hash alone can be looked up heterogeneously
+template<typename TKey>
+struct TChunkKeyHash {
+    using is_transparent = void;
+    size_t operator()(WeakHash_t weakHash) const {
+        uint64_t h = weakHash * 0x9E3779B97F4A7C15ULL;
+        return size_t(h ^ (h >> 32));
+    }
+    size_t operator()(const TKey& key) const {
+        return operator()(WeakHash_t(key.WeakHash));
+    }
+};
+
+template<typename TKey>
+struct TChunkKeyEqual {
+    using is_transparent = void;
+    bool operator()(const TKey& L, const TKey& R) const {
+        return L == R;
+    }
+    bool operator()(const TKey& L, WeakHash_t R) const {
+        return L.WeakHash == R;
+    }
+    bool operator()(WeakHash_t L, const TKey& R) const {
+        return L == R.WeakHash;
+    }
+};
 
 #ifdef BOOST_FOUND
-typedef boost::unordered_flat_set<std::string> HashSetType;
-typedef boost::unordered_flat_map<WeakHash_t, HashSetType> HashMapType;
+template<typename TKey>
+using TChunkKeySet = boost::unordered_flat_set<TKey, TChunkKeyHash<TKey>, TChunkKeyEqual<TKey>>;
 #else
-typedef absl::flat_hash_set<std::string> HashSetType;
-typedef absl::flat_hash_map<WeakHash_t, HashSetType> HashMapType;
+template<typename TKey>
+using TChunkKeySet = absl::flat_hash_set<TKey, TChunkKeyHash<TKey>, TChunkKeyEqual<TKey>>;
 #endif
 
-inline thread_local FRollingAdler32 RollingAdler32;
+typedef struct WeakFilterStat_t {
+    uint64_t Queries{ 0 };
+    uint64_t Passes{ 0 };
+    uint64_t FalsePositives{ 0 };
+}WeakFilterStat_t;
+
+///
+/// @brief split block bloom filter of weak hashes
+/// @detail a key sets one bit in each word of a single 32 byte block, so a query touches one cache line.
+/// bits are only ever set, so workers insert without lock
+///
+class FWeakHashFilter {
+public:
+    static constexpr uint32_t BitsPerKey = 16;
+    static constexpr size_t BlockSize = 32;
+
+    static size_t GetBlockNum(size_t expectedNum) {
+        return std::bit_ceil(std::max<size_t>(expectedNum * BitsPerKey / (BlockSize * CHAR_BIT), 1));
+    }
+    void Init(size_t expectedNum) {
+        size_t blockNum = GetBlockNum(expectedNum);
+        Blocks = std::vector<Block_t>(blockNum);
+        BlockMask = blockNum - 1;
+    }
+    //blockNum blocks of BlockSize bytes written by Save, blockNum is a power of two
+    void Load(const char* data, size_t blockNum) {
+        Blocks = std::vector<Block_t>(blockNum);
+        BlockMask = blockNum - 1;
+        for (auto& block : Blocks) {
+            for (int i = 0; i < WordNum; i++) {
+                uint32_t word;
+                memcpy(&word, data, sizeof(word));
+                data += sizeof(word);
+                block.Words[i].store(word, std::memory_order_relaxed);
+            }
+        }
+    }
+    bool Save(std::ostream& os) const {
+        for (auto& block : Blocks) {
+            for (int i = 0; i < WordNum; i++) {
+                uint32_t word = block.Words[i].load(std::memory_order_relaxed);
+                os.write((const char*)&word, sizeof(word));
+            }
+        }
+        return bool(os);
+    }
+    size_t GetBlockNum() const {
+        return Blocks.size();
+    }
+    bool IsInited() const {
+        return !Blocks.empty();
+    }
+    void Insert(WeakHash_t weakHash) {
+        auto h = Mix(weakHash);
+        auto& block = Blocks[(h >> 32) & BlockMask];
+        for (int i = 0; i < WordNum; i++) {
+            block.Words[i].fetch_or(WordBit(uint32_t(h), i), std::memory_order_relaxed);
+        }
+    }
+    bool MayContain(WeakHash_t weakHash) const {
+        auto h = Mix(weakHash);
+        auto& block = Blocks[(h >> 32) & BlockMask];
+        for (int i = 0; i < WordNum; i++) {
+            if (!(block.Words[i].load(std::memory_order_relaxed) & WordBit(uint32_t(h), i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+private:
+    static constexpr int WordNum = 8;
+    static constexpr uint32_t Salts[WordNum] = { 0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U };
+    typedef struct alignas(32) Block_t {
+        std::atomic<uint32_t> Words[WordNum]{};
+    }Block_t;
+    static uint64_t Mix(WeakHash_t weakHash) {
+        return uint64_t(weakHash) * 0x9E3779B97F4A7C15ULL;
+    }
+    static uint32_t WordBit(uint32_t h, int i) {
+        return uint32_t(1) << ((h * Salts[i]) >> 27);
+    }
+    static_assert(sizeof(Block_t) == BlockSize);
+    std::vector<Block_t> Blocks;
+    size_t BlockMask{ 0 };
+};
+
+class FMappedFile;
+
+///
+/// @brief chunk hashes shared by every file task of one folder
+/// @detail sharded by weak hash, each shard guarded by its own shared_mutex, so workers read concurrently
+/// and a chunk inserted by one worker is visible to the others right away.
+/// the chunks of earlier runs may instead be a mapped chunk id index file, a read only base searched in place
+///
+template<typename TKey>
+class TChunkIndex {
+public:
+    static constexpr uint32_t ShardBits = 6;
+    static constexpr uint32_t ShardNum = 1 << ShardBits;
+
+    void Reserve(size_t num) {
+        for (auto& shard : Shards) {
+            std::unique_lock lock(shard.Mtx);
+            shard.Keys.reserve(num / ShardNum);
+        }
+    }
+    //map a chunk id index file written by SaveMerged as the base, call before any insert.
+    //false with nothing loaded if it is missing, broken or of another weak hash kind
+    bool LoadBase(const std::filesystem::path& path, EWeakHashKind weakHashKind);
+    //write the base, the inserted and the claimed keys as a new index file, not the loaded one, the caller renames it into place.
+    //the base is released once written, so call it after the workers are done
+    bool SaveMerged(const std::filesystem::path& path, EWeakHashKind weakHashKind);
+    //build the weak hash prefilter from the keys already known, call before workers start
+    //the filter saved with the base is taken as is when it is large enough
+    void InitFilter(size_t expectedNum) {
+        if (BaseFilterData && BaseFilterBlockNum >= FWeakHashFilter::GetBlockNum(expectedNum)) {
+            Filter.Load(BaseFilterData, BaseFilterBlockNum);
+        }
+        else {
+            Filter.Init(expectedNum);
+            for (auto& key : BaseKeys) {
+                Filter.Insert(key.WeakHash);
+            }
+        }
+        for (auto& shard : Shards) {
+            for (auto& key : shard.Keys) {
+                Filter.Insert(key.WeakHash);
+            }
+            for (auto& key : shard.ExternalKeys) {
+                Filter.Insert(key.WeakHash);
+            }
+        }
+    }
+    bool ContainsWeak(WeakHash_t weakHash) const {
+        {
+            auto& shard = GetShard(weakHash);
+            std::shared_lock lock(shard.Mtx);
+            if (shard.Keys.contains(weakHash) || shard.ExternalKeys.contains(weakHash)) {
+                return true;
+            }
+        }
+        return BaseContainsWeak(weakHash);
+    }
+    //batched filter probe, bit i is set if hashes[i] may be known, len <= 64
+    uint64_t MayContainWeakBlock(const WeakHash_t* hashes, uint32_t len, WeakFilterStat_t& stat) const {
+        stat.Queries += len;
+        uint64_t mask = len == 64 ? ~uint64_t(0) : (uint64_t(1) << len) - 1;
+        if (Filter.IsInited()) {
+            mask = 0;
+            for (uint32_t i = 0; i < len; i++) {
+                mask |= uint64_t(Filter.MayContain(hashes[i])) << i;
+            }
+        }
+        stat.Passes += std::popcount(mask);
+        return mask;
+    }
+    //lookup for a position MayContainWeakBlock let through
+    bool ContainsWeakPassed(WeakHash_t weakHash, WeakFilterStat_t& stat) const {
+        if (ContainsWeak(weakHash)) {
+            return true;
+        }
+        stat.FalsePositives++;
+        return false;
+    }
+    bool ContainsWeak(WeakHash_t weakHash, WeakFilterStat_t& stat) const {
+        stat.Queries++;
+        if (Filter.IsInited() && !Filter.MayContain(weakHash)) {
+            return false;
+        }
+        stat.Passes++;
+        if (ContainsWeak(weakHash)) {
+            return true;
+        }
+        stat.FalsePositives++;
+        return false;
+    }
+    bool Contains(const ChunkKey_t& chunkKey) const {
+        auto key = TKey::From(chunkKey);
+        {
+            auto& shard = GetShard(key.WeakHash);
+            std::shared_lock lock(shard.Mtx);
+            if (shard.Keys.contains(key) || shard.ExternalKeys.contains(key)) {
+                return true;
+            }
+        }
+        return BaseContains(key);
+    }
+    //return false if the chunk already exist
+    bool Insert(const ChunkKey_t& chunkKey) {
+        auto key = TKey::From(chunkKey);
+        //the base is never written, so the shards only hold keys it lacks
+        if (BaseContains(key)) {
+            return false;
+        }
+        if (Filter.IsInited()) {
+            Filter.Insert(key.WeakHash);
+        }
+        auto& shard = GetShard(key.WeakHash);
+        std::unique_lock lock(shard.Mtx);
+        if (shard.ExternalKeys.contains(key)) {
+            return false;
+        }
+        return shard.Keys.insert(key).second && !shard.ClaimedKeys.contains(key);
+    }
+    //a chunk that exists outside the chunk store, known like the others but never saved by SaveMerged
+    void InsertExternal(const ChunkKey_t& chunkKey) {
+        auto key = TKey::From(chunkKey);
+        if (BaseContains(key)) {
+            return;
+        }
+        if (Filter.IsInited()) {
+            Filter.Insert(key.WeakHash);
+        }
+        auto& shard = GetShard(key.WeakHash);
+        std::unique_lock lock(shard.Mtx);
+        if (!shard.Keys.contains(key)) {
+            shard.ExternalKeys.insert(key);
+        }
+    }
+    //true for exactly one caller of a chunk the index does not know, that one stores it while the others only name it.
+    //a claimed key is not seen by Contains, so where a strategy cuts does not depend on which task got there first
+    bool TryClaim(const ChunkKey_t& chunkKey) {
+        auto key = TKey::From(chunkKey);
+        if (BaseContains(key)) {
+            return false;
+        }
+        auto& shard = GetShard(key.WeakHash);
+        std::unique_lock lock(shard.Mtx);
+        if (shard.Keys.contains(key) || shard.ExternalKeys.contains(key)) {
+            return false;
+        }
+        return shard.ClaimedKeys.insert(key).second;
+    }
+    size_t Size() const {
+        size_t num{ BaseKeys.size() };
+        for (auto& shard : Shards) {
+            std::shared_lock lock(shard.Mtx);
+            num += shard.Keys.size() + shard.ExternalKeys.size();
+        }
+        return num;
+    }
+private:
+    typedef struct alignas(64) Shard_t {
+        mutable std::shared_mutex Mtx;
+        TChunkKeySet<TKey> Keys;
+        TChunkKeySet<TKey> ClaimedKeys;
+        TChunkKeySet<TKey> ExternalKeys;
+    }Shard_t;
+    const Shard_t& GetShard(WeakHash_t weakHash) const {
+        return Shards[(weakHash * 0x9E3779B97F4A7C15ULL) >> (64 - ShardBits)];
+    }
+    Shard_t& GetShard(WeakHash_t weakHash) {
+        return Shards[(weakHash * 0x9E3779B97F4A7C15ULL) >> (64 - ShardBits)];
+    }
+    bool BaseContainsWeak(WeakHash_t weakHash) const {
+        auto itr = std::partition_point(BaseKeys.begin(), BaseKeys.end(), [&](const TKey& key) {return key.WeakHash < weakHash; });
+        return itr != BaseKeys.end() && itr->WeakHash == weakHash;
+    }
+    bool BaseContains(const TKey& key) const {
+        return std::binary_search(BaseKeys.begin(), BaseKeys.end(), key);
+    }
+    std::array<Shard_t, ShardNum> Shards;
+    FWeakHashFilter Filter;
+    std::shared_ptr<FMappedFile> BaseFile;
+    std::span<const TKey> BaseKeys;
+    const char* BaseFilterData{ nullptr };
+    size_t BaseFilterBlockNum{ 0 };
+};
+
+///
+/// @brief the chunk index of the weak hash kind of one folder task
+/// @detail keys are stored at the width of the kind, so an adler32 index does not pay for 64 bit weak hashes
+///
+class FChunkIndex {
+public:
+    //call before anything else is added
+    void SetWeakHashKind(EWeakHashKind weakHashKind) {
+        bNarrow = GetWeakHashSize(weakHashKind) == sizeof(uint32_t);
+    }
+    void Reserve(size_t num) {
+        bNarrow ? Narrow.Reserve(num) : Wide.Reserve(num);
+    }
+    bool LoadBase(const std::filesystem::path& path, EWeakHashKind weakHashKind) {
+        return bNarrow ? Narrow.LoadBase(path, weakHashKind) : Wide.LoadBase(path, weakHashKind);
+    }
+    bool SaveMerged(const std::filesystem::path& path, EWeakHashKind weakHashKind) {
+        return bNarrow ? Narrow.SaveMerged(path, weakHashKind) : Wide.SaveMerged(path, weakHashKind);
+    }
+    void InitFilter(size_t expectedNum) {
+        bNarrow ? Narrow.InitFilter(expectedNum) : Wide.InitFilter(expectedNum);
+    }
+    bool ContainsWeak(WeakHash_t weakHash) const {
+        return bNarrow ? Narrow.ContainsWeak(weakHash) : Wide.ContainsWeak(weakHash);
+    }
+    uint64_t MayContainWeakBlock(const WeakHash_t* hashes, uint32_t len, WeakFilterStat_t& stat) const {
+        return bNarrow ? Narrow.MayContainWeakBlock(hashes, len, stat) : Wide.MayContainWeakBlock(hashes, len, stat);
+    }
+    bool ContainsWeakPassed(WeakHash_t weakHash, WeakFilterStat_t& stat) const {
+        return bNarrow ? Narrow.ContainsWeakPassed(weakHash, stat) : Wide.ContainsWeakPassed(weakHash, stat);
+    }
+    bool ContainsWeak(WeakHash_t weakHash, WeakFilterStat_t& stat) const {
+        return bNarrow ? Narrow.ContainsWeak(weakHash, stat) : Wide.ContainsWeak(weakHash, stat);
+    }
+    bool Contains(const ChunkKey_t& key) const {
+        return bNarrow ? Narrow.Contains(key) : Wide.Contains(key);
+    }
+    bool Insert(const ChunkKey_t& key) {
+        return bNarrow ? Narrow.Insert(key) : Wide.Insert(key);
+    }
+    void InsertExternal(const ChunkKey_t& key) {
+        bNarrow ? Narrow.InsertExternal(key) : Wide.InsertExternal(key);
+    }
+    bool TryClaim(const ChunkKey_t& key) {
+        return bNarrow ? Narrow.TryClaim(key) : Wide.TryClaim(key);
+    }
+    size_t Size() const {
+        return bNarrow ? Narrow.Size() : Wide.Size();
+    }
+private:
+    bool bNarrow{ true };
+    TChunkIndex<NarrowChunkKey_t> Narrow;
+    TChunkIndex<ChunkKey_t> Wide;
+};
+
+///
+/// @brief adler32 over a fixed window that rolls a block of consecutive positions per call
+/// @detail the block kernel is picked once at runtime (avx2, sse4.1 or scalar).
+/// values must equal FRollingAdler32 since they end up in chunk names, this is checked once and
+/// every call goes through FRollingAdler32 byte by byte if they differ
+///
+class FBlockRollingAdler32 {
+public:
+    static constexpr uint32_t MaxBlockLen = 64;
+    static constexpr EWeakHashKind Kind = EWeakHashKind::Adler32;
+
+    static bool IsCompatible();
+    //avx2, sse4.1, scalar, or byte when IsCompatible failed
+    static const char* GetKernelName();
+    static WeakHash_t Hash(const uint8_t* data, uint32_t len);
+
+    void Reset() {
+        bInited = false;
+    }
+    bool IsInited() const {
+        return bInited;
+    }
+    void Init(const uint8_t* data, uint32_t len);
+    WeakHash_t Get();
+    //hashes[i] is the window hash after appending in[i] and dropping out[i], len <= MaxBlockLen
+    void RollBlock(const uint8_t* in, const uint8_t* out, uint32_t len, WeakHash_t* hashes);
+private:
+    uint32_t A{ 1 };
+    uint32_t B{ 0 };
+    uint32_t WindowMod{ 0 };
+    bool bInited{ false };
+    FRollingAdler32 Fallback;
+};
+
+///
+/// @brief 64 bit rabin-karp over a fixed window, bytes are mapped through a random table first
+/// @detail h = sum(T[x_i] * Base^(n-1-i)) mod 2^64, same interface as FBlockRollingAdler32
+///
+class FBlockRollingRabinKarp64 {
+public:
+    static constexpr uint32_t MaxBlockLen = 64;
+    static constexpr EWeakHashKind Kind = EWeakHashKind::RabinKarp64;
+
+    static const char* GetKernelName() {
+        return "scalar";
+    }
+    static WeakHash_t Hash(const uint8_t* data, uint32_t len);
+
+    void Reset() {
+        bInited = false;
+    }
+    bool IsInited() const {
+        return bInited;
+    }
+    void Init(const uint8_t* data, uint32_t len);
+    WeakHash_t Get() {
+        return H;
+    }
+    void RollBlock(const uint8_t* in, const uint8_t* out, uint32_t len, WeakHash_t* hashes);
+private:
+    uint64_t H{ 0 };
+    uint64_t OutFactor{ 0 };//Base^n
+    bool bInited{ false };
+};
+
+inline thread_local FBlockRollingAdler32 BlockRollingAdler32;
+inline thread_local FBlockRollingRabinKarp64 BlockRollingRabinKarp64;
+
+//call func with the reset thread local rolling hasher of kind
+template<typename TFunc>
+decltype(auto) VisitWeakHasher(EWeakHashKind kind, TFunc&& func) {
+    switch (kind) {
+    case EWeakHashKind::RabinKarp64:
+        BlockRollingRabinKarp64.Reset();
+        return func(BlockRollingRabinKarp64);
+    default:
+        BlockRollingAdler32.Reset();
+        return func(BlockRollingAdler32);
+    }
+}
+
+template<uint32_t N>
+using ChunkSizeConst_t = std::integral_constant<uint32_t, N>;
+
+//call func with the chunk size as a constant for common sizes so hot loops fold it, ChunkSizeConst_t<0> means use the runtime size
+template<typename TFunc>
+decltype(auto) VisitChunkSize(uint32_t chunkSize, TFunc&& func) {
+    switch (chunkSize) {
+    case 1 << 18:
+        return func(ChunkSizeConst_t<1 << 18>{});
+    case 1 << 20:
+        return func(ChunkSizeConst_t<1 << 20>{});
+    case 1 << 22:
+        return func(ChunkSizeConst_t<1 << 22>{});
+    case 1 << 23:
+        return func(ChunkSizeConst_t<1 << 23>{});
+    default:
+        return func(ChunkSizeConst_t<0>{});
+    }
+}
+
+inline WeakHash_t ComputeWeakHash(EWeakHashKind kind, const uint8_t* data, uint32_t len) {
+    switch (kind) {
+    case EWeakHashKind::RabinKarp64:
+        return FBlockRollingRabinKarp64::Hash(data, len);
+    default:
+        return FBlockRollingAdler32::Hash(data, len);
+    }
+}
+
+//writes weakHashSize little endian bytes of the weak hash then the strong hash, returns the name length
+inline uint32_t WriteHexName(char* hexName, WeakHash_t weakHash, uint32_t weakHashSize, const unsigned char strongHash[16]) {
+    uint8_t weakBytes[sizeof(WeakHash_t)];
+    for (uint32_t i = 0; i < weakHashSize; i++) {
+        weakBytes[i] = uint8_t(weakHash >> (i * CHAR_BIT));
+    }
+    to_upper_hex(hexName, weakBytes, weakHashSize);
+    to_upper_hex(hexName + bin_to_hex_length(weakHashSize), strongHash, StrongHashBit / CHAR_BIT);
+    auto len = bin_to_hex_length(weakHashSize + StrongHashBit / CHAR_BIT);
+    hexName[len] = 0;
+    return len;
+}
+
+//a chunk file is a zstd frame, or this header and the chunk content as is. zstd frames never start with it
+constexpr char RawChunkFileMagic[8] = { 'O','F','B','R','A','W','0','1' };
+//the content of a raw chunk file, empty for a zstd frame
+inline std::span<const char> GetRawChunkFileContent(const void* chunkFile, size_t chunkFileLen) {
+    if (chunkFileLen < sizeof(RawChunkFileMagic) || memcmp(chunkFile, RawChunkFileMagic, sizeof(RawChunkFileMagic)) != 0) {
+        return {};
+    }
+    return { (const char*)chunkFile + sizeof(RawChunkFileMagic), chunkFileLen - sizeof(RawChunkFileMagic) };
+}
+//byte entropy of a few samples spread over the chunk, already compressed media comes close to 8 bits
+bool IsLikelyIncompressible(const uint8_t* data, size_t len);
 
 class FChunkConverter:public IChunkConverter {
 public:
@@ -45,70 +589,281 @@ public:
     size_t GetChunkFileMaxSize()const override {
         return ZSTDBufSize;
     }
+    size_t GetFileChunkSize()const override {
+        return FileChunkContentSize;
+    }
+    void UpdateMaxFileChunkSize(size_t newSize) override;
     void UpdateConvertDirection(EConvertDirection Direction) override;
-    void Convert(const uint8_t* FileChunk) override;
+    void UpdateCompressionProfile(const ChunkCompressionProfile_t& profile) override;
+    const ChunkCompressionProfile_t& GetCompressionProfile()const override {
+        return CompressionProfile;
+    }
+    void Convert(const uint8_t* FileChunk, size_t FileChunkLen) override;
+
+    //CCtx exists
+    void ApplyCompressionProfile();
+    void StoreRaw(const uint8_t* FileChunk, size_t FileChunkLen);
 
     EConvertDirection Direction{ EConvertDirection::None };
+    ChunkCompressionProfile_t CompressionProfile;
     ZSTD_CCtx* CCtx{ nullptr };
     ZSTD_DCtx* DCtx{ nullptr };
+    size_t MaxFileChunkSize{ GetMaxFileChunkSize(FileChunkSize) };
     size_t ZSTDBufSize{0};
     size_t ZSTDBufContentSize{0};
+    size_t FileChunkContentSize{ 0 };
     void* ZSTDBuf{ nullptr };
 };
 
+///
+/// @brief read only view of a window of a regular file
+/// @detail Map replaces the previous view, pointers into it stay valid until the next Map or Close
+///
+class FMappedFile {
+public:
+    FMappedFile() = default;
+    FMappedFile(const FMappedFile&) = delete;
+    FMappedFile& operator=(const FMappedFile&) = delete;
+    ~FMappedFile() {
+        Close();
+    }
+    //false for anything but a regular file, the caller falls back to the stream
+    bool Open(const std::filesystem::path& path);
+    bool IsOpen() const;
+    //size when opened
+    uint64_t GetSize() const {
+        return Size;
+    }
+    //size now, pages of a mapping past it fault when touched
+    uint64_t GetCurrentSize() const;
+    //a page of a view was cut from the file and read as zeros since Open, the content read is not the file
+    bool HasLostPages() const {
+        return bLostPages.load(std::memory_order_acquire);
+    }
+    //offset must be a multiple of GetMapAlignment, the view is hinted for sequential access
+    const char* Map(uint64_t offset, size_t len);
+    void Close();
+    static size_t GetMapAlignment();
+private:
+    void Unmap();
+#ifdef _WIN32
+    void* FileHandle{ nullptr };
+    void* MappingHandle{ nullptr };
+#else
+    int FD{ -1 };
+    size_t LiveViewIndex{ SIZE_MAX };//slot of the view in the bus error handler registry
+#endif
+    uint64_t Size{ 0 };
+    void* View{ nullptr };
+    size_t ViewLen{ 0 };
+    std::atomic_bool bLostPages{ false };
+};
+///
+/// @brief read only file read at explicit offsets
+/// @detail reads of several threads do not share a file position, so one open file serves them all
+///
+class FPositionalFile {
+public:
+    FPositionalFile() = default;
+    FPositionalFile(const FPositionalFile&) = delete;
+    FPositionalFile& operator=(const FPositionalFile&) = delete;
+    ~FPositionalFile() {
+        Close();
+    }
+    bool Open(const std::filesystem::path& path);
+    //false on an error or a short read
+    bool ReadAt(void* buf, size_t len, uint64_t offset) const;
+    void Close();
+private:
+#ifdef _WIN32
+    void* FileHandle{ nullptr };
+#else
+    int FD{ -1 };
+#endif
+};
+//st_dev or the volume serial number, 0 if unknown
+uint64_t GetFileDeviceID(const std::filesystem::path& path);
+//false if the file can not be queried
+bool GetFileStat(const std::filesystem::path& path, FileStat_t& outStat);
+
+typedef struct FileHole_t {
+    uint64_t Start;
+    uint64_t End;
+}FileHole_t;
+//holes of a sparse file in offset order, empty for a dense file or when the file system can not tell
+void GetFileHoles(const std::filesystem::path& path, std::vector<FileHole_t>& outHoles);
+//zeroes a range of an existing file and frees its blocks, false if the file system can not punch holes
+bool PunchFileHole(const std::filesystem::path& path, uint64_t offset, uint64_t len);
+//writes the file data through to the disk, before a rename makes it reachable
+bool SyncFile(const std::filesystem::path& path);
+//runs read over mapped file memory, false instead of a bus error when the file lost the pages it touches.
+//read is left halfway on false, it must not own anything that needs a destructor.
+//unguarded reads of a view of FMappedFile read zeros from a lost page and set HasLostPages instead
+bool GuardMappedRead(const std::function<void()>& read);
+//every byte is zero, 64 byte blocks are or-ed without an early exit so the loop vectorizes
+bool IsZeroBuf(const void* data, size_t len);
+
+//huge files are mapped one window at a time
+inline constexpr uint64_t MappedFileWindowSize = uint64_t(1) << 28;
+
+///
+/// @brief memory mapped twice back to back
+/// @detail any span of at most Size bytes starting in the first copy is continuous
+///
+class FMirroredBuf {
+public:
+    FMirroredBuf() = default;
+    FMirroredBuf(const FMirroredBuf&) = delete;
+    FMirroredBuf& operator=(const FMirroredBuf&) = delete;
+    ~FMirroredBuf() {
+        Free();
+    }
+    //size must be a multiple of FMappedFile::GetMapAlignment, memory is zeroed
+    bool Allocate(size_t size);
+    void Free();
+    char* Data() const {
+        return (char*)Base;
+    }
+    size_t Size() const {
+        return BufSize;
+    }
+private:
+    void* Base{ nullptr };
+    size_t BufSize{ 0 };
+};
+
+///
+/// @brief sleep until another thread changes what the sleeper waits for
+/// @detail the sleeper calls Prepare, checks its condition, then Wait or Cancel. a Wake after the state change
+/// is never lost between the check and the sleep, and costs a fence and a load while nobody is preparing
+///
+typedef struct WakeEvent_t {
+    std::atomic_uint32_t Seq{ 0 };
+    std::atomic_uint32_t WaiterNum{ 0 };
+    uint32_t Prepare() {
+        auto seq = Seq.load();
+        WaiterNum.fetch_add(1);
+        return seq;
+    }
+    void Wait(uint32_t seq) {
+        Seq.wait(seq);
+        WaiterNum.fetch_sub(1);
+    }
+    void Cancel() {
+        WaiterNum.fetch_sub(1);
+    }
+    void Wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (WaiterNum.load() > 0) {
+            Seq.fetch_add(1);
+            Seq.notify_all();
+        }
+    }
+}WakeEvent_t;
+
 typedef struct FileChunkBuf_t {
-    static constexpr uint32_t FileBufSize = FileChunkSize * 8; // 文件缓冲区总大小
-    static constexpr uint32_t ConsumedFileBufSize = FileChunkSize * 3; // 已消费缓冲区大小
-    char OutBuf[ConsumedFileBufSize] = {};
-    char Buf[ConsumedFileBufSize + FileBufSize] = {};
-    char* const BufEnd = Buf + ConsumedFileBufSize + FileBufSize;
-    char* ConsumePos = Buf;//读取位置
-    char* StreamPos = Buf;//写入位置
+    //sized by the chunk size of the manifest, the ring is only allocated once a streamed file needs it
+    FileChunkBuf_t(uint32_t chunkSize) :
+        FileBufSize(chunkSize * 8),
+        ConsumedFileBufSize(chunkSize * 3),
+        ContentWakeSize(chunkSize * 2),
+        ReadWakeContentSize(chunkSize * 6) {
+    }
+    FileChunkBuf_t(const FileChunkBuf_t&) = delete;
+    FileChunkBuf_t& operator=(const FileChunkBuf_t&) = delete;
+    const uint32_t FileBufSize; // 文件缓冲区总大小
+    const uint32_t ConsumedFileBufSize; // 已消费缓冲区大小
+    //low watermarks, a sleeping worker wakes once this much content is in, a sleeping reader once content drops to this
+    const uint32_t ContentWakeSize;
+    const uint32_t ReadWakeContentSize;
+    //mirrored, so content, free space and consumed data are continuous even across BufEnd
+    FMirroredBuf RingBuf;
+    //the ring or a mapped window of the file
+    char* Buf{ nullptr };
+    char* BufEnd{ nullptr };
+    char* ConsumePos{ nullptr };//读取位置
+    char* StreamPos{ nullptr };//写入位置
     std::atomic_uint32_t ContentSize{ 0 };
+    //the worker sleeps on it while the ring lacks content
+    WakeEvent_t ContentEvent;
+    //set while the io stage reads for the task, woken when the worker frees a quarter of the ring
+    WakeEvent_t* ReadEvent{ nullptr };
     void Clear() {
-        memset(Buf, 0, ConsumedFileBufSize + FileBufSize);
+        if (RingBuf.Data()) {
+            memset(RingBuf.Data(), 0, RingBuf.Size());
+        }
+        Buf = nullptr;
+        BufEnd = nullptr;
+        ConsumePos = nullptr;
+        StreamPos = nullptr;
+        ContentSize = 0;
+        ReadEvent = nullptr;
+    }
+    bool IsMapped() const {
+        return Buf && Buf != RingBuf.Data();
+    }
+    //the read tick copies the file into the ring, false if the ring can not be allocated
+    bool UseRing() {
+        if (!RingBuf.Data() && !RingBuf.Allocate(ConsumedFileBufSize + FileBufSize)) {
+            return false;
+        }
+        Buf = RingBuf.Data();
+        BufEnd = Buf + RingBuf.Size();
         ConsumePos = Buf;
         StreamPos = Buf;
         ContentSize = 0;
+        return true;
+    }
+    //the window is read in place, content only reaches the window end when the window is consumed up to there,
+    //so a position wrapped by AdvancePos is never read forward and consumed data stays continuous before BufEnd
+    void UseMapping(const char* view, size_t viewLen, size_t consumeOffset) {
+        Buf = const_cast<char*>(view);
+        BufEnd = Buf + viewLen;
+        ConsumePos = Buf + consumeOffset;
+        StreamPos = ConsumePos;
+        ContentSize = 0;
     }
 
     std::span<char> GetEmptyBuf() {
-        auto FreeSpaceSize = FileBufSize - ContentSize;
-        return { StreamPos,StreamPos + FreeSpaceSize > BufEnd ? uint32_t(BufEnd - StreamPos) : FreeSpaceSize };
+        return { StreamPos,FileBufSize - ContentSize };
     }
     std::span<char> GetContentBuf() {
-        auto contentSize = ContentSize.load();
-        return { ConsumePos,ConsumePos + contentSize > BufEnd ? uint32_t(BufEnd - ConsumePos) : contentSize };
+        return { ConsumePos,ContentSize.load() };
     }
-    std::tuple<std::span<char>, std::span<char>> GetConsumedBuf(uint32_t reverseStart, uint32_t reverseLen) {
-        auto PosAfterOffset = ConsumePos - reverseStart;
-        if (PosAfterOffset <= Buf) {
-            PosAfterOffset = BufEnd - (Buf - PosAfterOffset);
-        }
-        if (PosAfterOffset - reverseLen >= Buf) {
-            return { {PosAfterOffset - reverseLen,reverseLen},{} };
+    std::span<char> GetConsumedBuf(uint32_t reverseStart, uint32_t reverseLen) {
+        auto start = ConsumePos - reverseStart - reverseLen;
+        if (start < Buf) {
+            start += BufEnd - Buf;
         }
-        auto firstLen = reverseLen - uint32_t(PosAfterOffset - Buf);
-        return { {BufEnd - firstLen,firstLen},{Buf,uint32_t(PosAfterOffset - Buf)} };
+        return { start,reverseLen };
     }
     char* GetContinuousConsumedBuf(uint32_t reverseStart, uint32_t reverseLen) {
-        auto [ConsumedBufTupleL, ConsumedBufTupleR] = GetConsumedBuf(reverseStart, reverseLen);
-        auto ConsumedBufL = ConsumedBufTupleL;
-        auto ConsumedBufR = ConsumedBufTupleR;
-        if (ConsumedBufR.size() == 0) {
-            return ConsumedBufL.data();
-        }
-        memcpy(OutBuf, ConsumedBufL.data(), ConsumedBufL.size());
-        memcpy(OutBuf + ConsumedBufL.size(), ConsumedBufR.data(), ConsumedBufR.size());
-        return OutBuf;
+        return GetConsumedBuf(reverseStart, reverseLen).data();
     }
     void FillSize(uint32_t size) {
         AdvancePos(StreamPos, size);
-        ContentSize.fetch_add(size, std::memory_order::relaxed);
+        auto contentSize = ContentSize.fetch_add(size, std::memory_order::relaxed) + size;
+        if (contentSize >= ContentWakeSize) {
+            ContentEvent.Wake();
+        }
     }
     void EatSize(uint32_t size) {
         AdvancePos(ConsumePos, size);
-        ContentSize.fetch_sub(size, std::memory_order::relaxed);
+        auto contentSize = ContentSize.fetch_sub(size, std::memory_order::relaxed);
+        //only the crossing wakes, eating byte by byte stays a compare
+        if (contentSize > ReadWakeContentSize && contentSize - size <= ReadWakeContentSize && ReadEvent) {
+            ReadEvent->Wake();
+        }
+    }
+    //worker side, sleep until ContentWakeSize of content, eof or a wake from cancel
+    void WaitContent(const std::atomic_bool& bEOF, const std::atomic_bool& bRequestExit) {
+        auto seq = ContentEvent.Prepare();
+        if (ContentSize.load() < ContentWakeSize && !bEOF && !bRequestExit) {
+            ContentEvent.Wait(seq);
+        }
+        else {
+            ContentEvent.Cancel();
+        }
     }
 
     void AdvancePos(char*& Pos, uint32_t size) {
@@ -119,8 +874,33 @@ typedef struct FileChunkBuf_t {
     }
 }FileChunkBuf_t;
 
+//a large file scanned as several ranges by different file tasks, touched on tick thread except own digest slot
+typedef struct SplitFileData_t {
+    uint64_t RangeSize{ 0 };
+    uint32_t FinishedRangeNum{ 0 };
+    std::vector<XXH128_hash_t> RangeDigests;//written by each range task, file hash is hash of all digests
+}SplitFileData_t;
+
+//small files concatenated in name order into one chunk
+typedef struct PackData_t {
+    std::vector<std::shared_ptr<FileChunksData_t>> Files;
+    uint32_t Size{ 0 };
+    std::vector<std::shared_ptr<FileChunksData_t>> DroppedFiles;//not read at their listed size, queued on their own in post processing
+}PackData_t;
+
+typedef struct FileRange_t {
+    std::shared_ptr<FileChunksData_t> FileChunksData;
+    std::shared_ptr<SplitFileData_t> SplitFile;
+    uint32_t Index;
+    uint64_t ResumePos{ 0 };//appended file, only bytes from here are scanned
+}FileRange_t;
+
+//a file that only grew since the previous manifest, chunks ending before ResumePos are kept
+typedef struct AppendResume_t {
+    uint64_t ResumePos{ 0 };//start of the previous last chunk, a boundary every strategy that resumes can cut at
+}AppendResume_t;
+
 typedef struct GenFolderChunkDataFileTaskData_t {
-    HashMapType FileAllHashMap;
     XXH3_state_t* XXH3State;
     FChunkConverter ChunkConverter{};
     std::shared_ptr<FileChunksData_t> FileChunksData;
@@ -131,8 +911,45 @@ typedef struct GenFolderChunkDataFileTaskData_t {
     std::atomic_bool bEOF{ false };
     //read thread
     std::ifstream FileStream;
-    uint32_t WaitAppendDataLen{ 0 };
+    uint64_t ReadPos{ 0 };//file offset of next read
+    uint64_t ReadEnd{ UINT64_MAX };
+    uint64_t HashStart{ 0 };//bytes before it are overlap of previous range, not hashed
+    //appended file, [PrefixHashPos,PrefixHashEnd) is read for the file hash only before the first read that fills the ring
+    uint64_t PrefixHashPos{ 0 };
+    uint64_t PrefixHashEnd{ 0 };
+    //range task only, window ends in (RangeStart,RangeEnd] belong to this task
+    std::shared_ptr<SplitFileData_t> SplitFile;
+    uint32_t RangeIndex{ 0 };
+    uint64_t RangeStart{ 0 };
+    uint64_t RangeEnd{ 0 };
+    FileChunksData_t::TFileChunks RangeChunks;//merged into FileChunksData in post processing
+    //pack task only, FileChunksData is null
+    std::shared_ptr<PackData_t> Pack;
+    uint32_t PackFileIndex{ 0 };//next file the read tick appends
+    //mapped scan, the worker exposes the mapping through FileChunkBuf itself and the read tick does nothing
+    FMappedFile MappedFile;
+    bool bMapped{ false };
+    uint64_t MapOffset{ 0 };//file offset of FileChunkBuf->Buf
+    //worker, the file ended before the end the task was listed with
+    bool bShortRead{ false };
+    //io stage
+    std::atomic_bool bInReadQueue{ false };//the io stage holds the task until its last read, cleared by the first of io stage and post processing to let go, the other pools it
+    std::shared_ptr<std::atomic_uint32_t> DeviceReadNum;//reads in flight on the device of the file
+    std::filesystem::path FilePath;
+    std::vector<FileHole_t> Holes;//read as zeros without touching the device
 
+    //first hole ending after pos, null past the last one
+    const FileHole_t* FindHole(uint64_t pos) const {
+        auto itr = std::upper_bound(Holes.begin(), Holes.end(), pos, [](uint64_t pos, const FileHole_t& hole) {
+            return pos < hole.End;
+            });
+        return itr == Holes.end() ? nullptr : &*itr;
+    }
+    //producer side, a sleeping worker sees the end even if the ring never reaches its watermark
+    void SetEOF() {
+        bEOF = true;
+        FileChunkBuf->ContentEvent.Wake();
+    }
     ~GenFolderChunkDataFileTaskData_t() {
         XXH3_createState();
         if (XXH3State) {
@@ -144,14 +961,51 @@ typedef struct GenFolderChunkDataFileTaskData_t {
             FileStream.close();
         }
         bEOF = false;
-        WaitAppendDataLen = 0;
+        ReadPos = 0;
+        ReadEnd = UINT64_MAX;
+        HashStart = 0;
+        PrefixHashPos = 0;
+        PrefixHashEnd = 0;
+        SplitFile = nullptr;
+        RangeIndex = 0;
+        RangeStart = 0;
+        RangeEnd = 0;
+        RangeChunks.clear();
+        Pack = nullptr;
+        PackFileIndex = 0;
         FileChunkBuf->Clear();
+        MappedFile.Close();
+        bMapped = false;
+        MapOffset = 0;
+        bShortRead = false;
+        bInReadQueue = false;
+        DeviceReadNum = nullptr;
+        FilePath.clear();
+        Holes.clear();
         if (XXH3State) {
             XXH3_128bits_reset(XXH3State);
         }
     }
 }GenFolderChunkDataFileTaskData_t;
 
+//a file that takes the result of an identical one
+typedef struct DuplicateFile_t {
+    std::shared_ptr<FileChunksData_t> FileChunksData;
+    FileStat_t Stat;//before the content was compared, a file with another stat after the scan is scanned itself
+}DuplicateFile_t;
+
+typedef struct DuplicateFileSet_t {
+    FileStat_t Stat;//of the queued file before the content was compared
+    std::vector<DuplicateFile_t> Files;
+}DuplicateFileSet_t;
+
+//name parts of a chunk of Size zero bytes
+typedef struct ZeroChunk_t {
+    uint32_t Size{ 0 };
+    WeakHash_t WeakHash{ 0 };
+    XXH128_hash_t Hash{};
+}ZeroChunk_t;
+
 typedef struct GenFolderChunkDataWorkData_t {
     std::atomic<EGenFolderMetaDataStatus> Status{ EGenFolderMetaDataStatus::None };
     EGenFolderMetaDataStatus LastStatus{ EGenFolderMetaDataStatus::None };
@@ -165,17 +1019,43 @@ typedef struct GenFolderChunkDataWorkData_t {
     std::unordered_map<std::u8string_view, std::string> FileLocalPathMap; //Get local file path from file name
 
     //std::shared_mutex FileTaskMtx;
-    HashMapType AllHashMap;
-    //std::unordered_map<WeakHash_t, std::set<std::string>, hash_32bit> AllHashMap;
-    std::unordered_map<std::u8string_view, std::shared_ptr<GenFolderChunkDataFileTaskData_t>> FileTasks;
+    FChunkIndex ChunkIndex;//read and appended by all file tasks
+    std::array<ZeroChunk_t, 2> ZeroChunks;//the manifest chunk size and the max chunk size, set in InitTask
+    const ZeroChunk_t* FindZeroChunk(uint32_t size) const {
+        for (auto& zeroChunk : ZeroChunks) {
+            if (zeroChunk.Size == size) {
+                return &zeroChunk;
+            }
+        }
+        return nullptr;
+    }
+    std::atomic<uint64_t> WeakFilterQueries{ 0 };
+    std::atomic<uint64_t> WeakFilterPasses{ 0 };
+    std::atomic<uint64_t> WeakFilterFalsePositives{ 0 };
+    std::unordered_set<std::shared_ptr<GenFolderChunkDataFileTaskData_t>> FileTasks;//a split file has one task per range
+    std::deque<FileRange_t> PendingFileRanges;//ranges of split file wait for free task
+    std::deque<std::shared_ptr<PackData_t>> PendingPacks;//taken after all other files
     std::vector<std::shared_ptr<GenFolderChunkDataFileTaskData_t>> FileTaskPool;
+    moodycamel::ConcurrentQueue<std::shared_ptr<GenFolderChunkDataFileTaskData_t>> ReadQueue;//tasks the io stage reads for
+    moodycamel::ConcurrentQueue<std::shared_ptr<GenFolderChunkDataFileTaskData_t>> ReleasedFileTasks;//let go by the io stage after post processing, pooled on tick thread
+    std::unordered_map<uint64_t, std::shared_ptr<std::atomic_uint32_t>> DeviceReadNums;//touched on tick thread only
+    std::unordered_map<std::u8string_view, AppendResume_t> AppendResumes;//touched on tick thread only
+    std::unordered_map<std::u8string_view, DuplicateFileSet_t> DuplicateFiles;//queued file to identical files that take its result, touched on tick thread only
+    WakeEvent_t ReadEvent;//io stage threads sleep on it while no queued task can be read
 
     std::atomic_bool bRequestExit{ false };
     FolderManifest_t FolderManifest;
     std::shared_ptr<GenFolderMetaDataProcess_t> OutProcess;
     std::shared_ptr<FolderManifest_t> OutFolderManifest;
+    std::shared_ptr<FileStatCache_t> OutStatCache;
     std::error_code EC;
 
+    //file tasks count locally and add once when done
+    void AddWeakFilterStat(const WeakFilterStat_t& stat) {
+        WeakFilterQueries.fetch_add(stat.Queries, std::memory_order_relaxed);
+        WeakFilterPasses.fetch_add(stat.Passes, std::memory_order_relaxed);
+        WeakFilterFalsePositives.fetch_add(stat.FalsePositives, std::memory_order_relaxed);
+    }
 }GenFolderChunkDataWorkData_t;
 
 
@@ -1,6 +1,7 @@
 #include "FileBackupManager.h"
 #include "FileBackupManagerMinChunk.h"
 #include "FileBackupManagerGatherAll.h"
+#include "FileBackupManagerFastCDC.h"
 #include <singleton.h>
 
 
@@ -9,3 +10,16 @@ LIB_FILEBACKUP_EXPORT IFileBackupManagerInterface* GetFileBackupManagerSingleton
     return TClassSingletonHelper<FFileBackupManagerGatherAll>::GetClassSingleton().get();
 }
 
+LIB_FILEBACKUP_EXPORT IFileBackupManagerInterface* GetFileBackupManagerSingleton(EFileBackupChunkMode Mode)
+{
+    switch (Mode)
+    {
+    case EFileBackupChunkMode::MinChunk:
+        return TClassSingletonHelper<FFileBackupManagerMinChunk>::GetClassSingleton().get();
+    case EFileBackupChunkMode::FastCDC:
+        return TClassSingletonHelper<FFileBackupManagerFastCDC>::GetClassSingleton().get();
+    case EFileBackupChunkMode::GatherAll:
+    default:
+        return TClassSingletonHelper<FFileBackupManagerGatherAll>::GetClassSingleton().get();
+    }
+}
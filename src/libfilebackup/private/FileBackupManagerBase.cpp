@@ -1,4 +1,5 @@
 #include "FileBackupManagerBase.h"
+#include "FileBackupUringReader.h"
 
 #include <string_convert.h>
 #include <FunctionExitHelper.h>
@@ -17,8 +18,15 @@
 #include <mutex>
 #include <algorithm>
 #include <map>
+#include <chrono>
+#include <thread>
 
 CommonHandle32_t IFileBackupManagerBase::GenFolderChunkData(const char8_t* path, TGenFolderMetaDataStatusChangedDelegate Delegate)
+{
+    return GenFolderChunkData(path, GenFolderChunkOptions_t{}, Delegate);
+}
+
+CommonHandle32_t IFileBackupManagerBase::GenFolderChunkData(const char8_t* path, const GenFolderChunkOptions_t& options, TGenFolderMetaDataStatusChangedDelegate Delegate)
 {
     std::filesystem::path folderPath(path);
     if (!std::filesystem::exists(folderPath)) {
@@ -34,10 +42,12 @@ CommonHandle32_t IFileBackupManagerBase::GenFolderChunkData(const char8_t* path,
     fileMapping.RelativeGlobPath = "*";
     fileMapping.bRecursive = true;
     fileMapping.TargetRelativePath = ".";
+    GenFolderMetaDataWorkData->Params.Options = options;
     GenFolderMetaDataWorkData->StatusChangedDelegate = Delegate;
     GenFolderMetaDataWorkData->OutProcess = std::make_shared<GenFolderMetaDataProcess_t>();
     GenFolderMetaDataWorkData->OutFolderManifest = std::make_shared<FolderManifest_t>();
-    GenFolderMetaDataWorkData->AllHashMap.reserve(1 << 20);
+    GenFolderMetaDataWorkData->ChunkIndex.SetWeakHashKind(GenFolderMetaDataWorkData->Params.Options.WeakHashKind);
+    GenFolderMetaDataWorkData->ChunkIndex.Reserve(1 << 20);
     return pair->first;
 }
 
@@ -52,7 +62,8 @@ CommonHandle32_t IFileBackupManagerBase::GenFolderChunkData(GenFolderChunkParams
     GenFolderMetaDataWorkData->StatusChangedDelegate = Delegate;
     GenFolderMetaDataWorkData->OutProcess = std::make_shared<GenFolderMetaDataProcess_t>();
     GenFolderMetaDataWorkData->OutFolderManifest = std::make_shared<FolderManifest_t>();
-    GenFolderMetaDataWorkData->AllHashMap.reserve(1 << 20);
+    GenFolderMetaDataWorkData->ChunkIndex.SetWeakHashKind(GenFolderMetaDataWorkData->Params.Options.WeakHashKind);
+    GenFolderMetaDataWorkData->ChunkIndex.Reserve(1 << 20);
     return pair->first;
 }
 
@@ -64,9 +75,19 @@ void IFileBackupManagerBase::CancelTask(CommonHandle32_t handle)
     }
     auto& pFolderWorkData = itr->second;
     pFolderWorkData->StatusChangedDelegate = nullptr;
-    pFolderWorkData->Status= EGenFolderMetaDataStatus::Finished;
-    pFolderWorkData->bRequestExit = true;
-    pFolderWorkData->EC= utilpp::make_common_used_error(utilpp::ECommonUsedError::CUE_CANCELED);
+    FailFolderTask(*pFolderWorkData, utilpp::make_common_used_error(utilpp::ECommonUsedError::CUE_CANCELED));
+}
+
+void IFileBackupManagerBase::FailFolderTask(GenFolderChunkDataWorkData_t& folderWorkData, std::error_code ec)
+{
+    folderWorkData.Status = EGenFolderMetaDataStatus::Finished;
+    folderWorkData.bRequestExit = true;
+    folderWorkData.EC = ec;
+    //sleeping workers and io threads see the exit
+    for (auto& pFileTaskData : folderWorkData.FileTasks) {
+        pFileTaskData->FileChunkBuf->ContentEvent.Wake();
+    }
+    folderWorkData.ReadEvent.Wake();
 }
 
 void IFileBackupManagerBase::InitTask(CommonHandle32_t handle)
@@ -81,6 +102,15 @@ void IFileBackupManagerBase::InitTask(CommonHandle32_t handle)
         pFolderWorkData->EC = utilpp::make_common_used_error(utilpp::ECommonUsedError::CUE_DUPLICATE_CALL);
         return;
     }
+    //a manifest cut with another chunk size or weak hash names other chunks, nothing of it is reused
+    //nor are stats written along with another manifest
+    auto& params = pFolderWorkData->Params;
+    bool bReusePrevious = params.PreviousManifest && params.StatCache &&
+        params.StatCache->ManifestID[0] != '\0' && strcmp(params.StatCache->ManifestID, params.PreviousManifest->ID) == 0 &&
+        params.PreviousManifest->ChunkSize == params.Options.ChunkSize &&
+        params.PreviousManifest->WeakHashKind == params.Options.WeakHashKind;
+    pFolderWorkData->OutStatCache = std::make_shared<FileStatCache_t>();
+    pFolderWorkData->OutStatCache->ScanTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     std::vector<std::filesystem::path> paths;
     for (auto& FileMapping : pFolderWorkData->Params.FileMappings)
     {
@@ -111,7 +141,9 @@ void IFileBackupManagerBase::InitTask(CommonHandle32_t handle)
                 continue;
             }
             auto pFileChunksData = std::make_shared<FileChunksData_t>();
-            pFileChunksData->FileSize = std::filesystem::file_size(p);
+            FileStat_t fileStat;
+            bool bStat = GetFileStat(p, fileStat);
+            pFileChunksData->FileSize = bStat ? fileStat.Size : std::filesystem::file_size(p);
             pFileChunksData->FileName = ConvertU8ViewToView((std::filesystem::path(FileMapping.TargetRelativePath)/ p.lexically_relative(RootPath)).lexically_normal().u8string());
             auto [itr, res] = pFolderWorkData->FolderManifest.Files.try_emplace(ConvertViewToU8View(pFileChunksData->FileName), pFileChunksData);
             if (!res) {
@@ -120,48 +152,406 @@ void IFileBackupManagerBase::InitTask(CommonHandle32_t handle)
                 return;
             }
             pFolderWorkData->FileLocalPathMap.try_emplace(ConvertViewToU8View(pFileChunksData->FileName), ConvertU8ViewToView(p.u8string()));
+            pFolderWorkData->ToltalSize += pFileChunksData->FileSize;
+            if (!bStat) {
+                auto [fileListItr, _] = pFolderWorkData->FileItrList.try_emplace(pFileChunksData->FileSize);
+                fileListItr->second.insert(ConvertViewToU8View(pFileChunksData->FileName));
+                continue;
+            }
+            auto pFileStatData = std::make_shared<FileStatData_t>();
+            pFileStatData->FileName = pFileChunksData->FileName;
+            pFileStatData->Stat = fileStat;
+            pFolderWorkData->OutStatCache->Files.try_emplace(ConvertViewToU8View(pFileStatData->FileName), pFileStatData);
+            if (bReusePrevious && ReuseUnchangedFile(*pFolderWorkData, *pFileChunksData, fileStat)) {
+                pFolderWorkData->CompleteSize += pFileChunksData->FileSize;
+                continue;
+            }
+            if (bReusePrevious && ResumeAppendedFile(*pFolderWorkData, *pFileChunksData, fileStat, p)) {
+                pFolderWorkData->CompleteSize += pFolderWorkData->AppendResumes[ConvertViewToU8View(pFileChunksData->FileName)].ResumePos;
+            }
             auto [fileListItr, _] = pFolderWorkData->FileItrList.try_emplace(pFileChunksData->FileSize);
             fileListItr->second.insert(ConvertViewToU8View(pFileChunksData->FileName));
-            pFolderWorkData->ToltalSize += pFileChunksData->FileSize;
         }
     }
-    pFolderWorkData->FolderManifest.HexNameLen = HexNameStrLen;
+    if (!IsValidFileChunkSize(pFolderWorkData->Params.Options.ChunkSize)) {
+        pFolderWorkData->Status = EGenFolderMetaDataStatus::Finished;
+        pFolderWorkData->EC = std::make_error_code(std::errc::invalid_argument);
+        return;
+    }
+    pFolderWorkData->FolderManifest.WeakHashKind = pFolderWorkData->Params.Options.WeakHashKind;
+    pFolderWorkData->FolderManifest.HexNameLen = GetHexNameStrLen(pFolderWorkData->FolderManifest.WeakHashKind);
+    pFolderWorkData->FolderManifest.ChunkSize = pFolderWorkData->Params.Options.ChunkSize;
+    if (pFolderWorkData->Params.Options.IOThreadNum > 0 && pFolderWorkData->Params.Options.IOQueueDepth == 0) {
+        pFolderWorkData->Status = EGenFolderMetaDataStatus::Finished;
+        pFolderWorkData->EC = std::make_error_code(std::errc::invalid_argument);
+        return;
+    }
+    auto packThreshold = pFolderWorkData->Params.Options.PackFileSizeThreshold;
+    if (packThreshold > pFolderWorkData->FolderManifest.ChunkSize) {
+        pFolderWorkData->Status = EGenFolderMetaDataStatus::Finished;
+        pFolderWorkData->EC = std::make_error_code(std::errc::invalid_argument);
+        return;
+    }
+    if (packThreshold > 0) {
+        std::vector<std::shared_ptr<FileChunksData_t>> smallFiles;
+        for (auto fileListItr = pFolderWorkData->FileItrList.upper_bound(0); fileListItr != pFolderWorkData->FileItrList.end() && fileListItr->first < packThreshold;) {
+            for (auto& fileName : fileListItr->second) {
+                smallFiles.push_back(pFolderWorkData->FolderManifest.Files[fileName]);
+            }
+            fileListItr = pFolderWorkData->FileItrList.erase(fileListItr);
+        }
+        //name order keeps packs the same between runs of an unchanged tree
+        std::sort(smallFiles.begin(), smallFiles.end(), [](const std::shared_ptr<FileChunksData_t>& L, const std::shared_ptr<FileChunksData_t>& R) {
+            return L->FileName < R->FileName;
+            });
+        for (auto& pSmallFile : smallFiles) {
+            if (pFolderWorkData->PendingPacks.empty() || pFolderWorkData->PendingPacks.back()->Size + pSmallFile->FileSize > pFolderWorkData->FolderManifest.ChunkSize) {
+                pFolderWorkData->PendingPacks.push_back(std::make_shared<PackData_t>());
+            }
+            auto& pPack = pFolderWorkData->PendingPacks.back();
+            pPack->Files.push_back(pSmallFile);
+            pPack->Size += uint32_t(pSmallFile->FileSize);
+        }
+    }
+    if (pFolderWorkData->Params.Options.bDedupeFiles) {
+        DedupeIdenticalFiles(*pFolderWorkData);
+    }
+    //zero runs of VM images and preallocated files take these names instead of being hashed
+    {
+        auto chunkSize = pFolderWorkData->FolderManifest.ChunkSize;
+        std::vector<uint8_t> zeroBuf(GetMaxFileChunkSize(chunkSize));
+        uint32_t zeroChunkSizes[] = { chunkSize, GetMaxFileChunkSize(chunkSize) };
+        for (size_t i = 0; i < pFolderWorkData->ZeroChunks.size(); i++) {
+            auto& zeroChunk = pFolderWorkData->ZeroChunks[i];
+            zeroChunk.Size = zeroChunkSizes[i];
+            zeroChunk.WeakHash = ComputeWeakHash(pFolderWorkData->FolderManifest.WeakHashKind, zeroBuf.data(), zeroChunk.Size);
+            zeroChunk.Hash = XXH3_128bits(zeroBuf.data(), zeroChunk.Size);
+        }
+    }
     auto pConverter = NewChunkConverter();
+    pConverter->UpdateMaxFileChunkSize(GetMaxFileChunkSize(pFolderWorkData->FolderManifest.ChunkSize));
     pConverter->UpdateConvertDirection(EConvertDirection::ToChunkFile);
     pFolderWorkData->FolderManifest.ChunkFileMaxSize = pConverter->GetChunkFileMaxSize();
+    //room for the known chunks and every chunk this run may add
+    pFolderWorkData->ChunkIndex.InitFilter(pFolderWorkData->ChunkIndex.Size() + pFolderWorkData->ToltalSize / pFolderWorkData->FolderManifest.ChunkSize + 1);
     pFolderWorkData->Status = EGenFolderMetaDataStatus::Inited;
 }
 
+bool IFileBackupManagerBase::ReuseUnchangedFile(GenFolderChunkDataWorkData_t& folderWorkData, FileChunksData_t& fileChunksData, const FileStat_t& fileStat)
+{
+    auto& statCache = *folderWorkData.Params.StatCache;
+    auto statItr = statCache.Files.find(ConvertViewToU8View(fileChunksData.FileName));
+    if (statItr == statCache.Files.end() || statItr->second->Stat != fileStat) {
+        return false;
+    }
+    if (std::max(fileStat.MTime, fileStat.CTime) + RacyFileStatWindow >= statCache.ScanTime) {
+        return false;
+    }
+    auto& previousManifest = *folderWorkData.Params.PreviousManifest;
+    auto fileItr = previousManifest.Files.find(ConvertViewToU8View(fileChunksData.FileName));
+    if (fileItr == previousManifest.Files.end() || fileItr->second->FileSize != fileStat.Size || fileItr->second->FileHash[0] == '\0') {
+        return false;
+    }
+    auto& previousFileChunksData = *fileItr->second;
+    memcpy(fileChunksData.FileHash, previousFileChunksData.FileHash, sizeof(fileChunksData.FileHash));
+    fileChunksData.FileHashKind = previousFileChunksData.FileHashKind;
+    //chunk data is never changed once cut, both manifests share it
+    fileChunksData.Chunks = previousFileChunksData.Chunks;
+    //the chunks are in the chunk dir since the previous run, changed files may match them
+    AddChunksToIndex(folderWorkData, fileChunksData.Chunks, previousManifest.WeakHashKind);
+    return true;
+}
+
+bool IFileBackupManagerBase::ResumeAppendedFile(GenFolderChunkDataWorkData_t& folderWorkData, FileChunksData_t& fileChunksData, const FileStat_t& fileStat, const std::filesystem::path& filePath)
+{
+    auto lookBackChunkNum = GetAppendResumeLookBackChunkNum();
+    if (!lookBackChunkNum) {
+        return false;
+    }
+    auto& statCache = *folderWorkData.Params.StatCache;
+    auto statItr = statCache.Files.find(ConvertViewToU8View(fileChunksData.FileName));
+    if (statItr == statCache.Files.end() || statItr->second->Stat.Inode != fileStat.Inode || statItr->second->Stat.Size >= fileStat.Size) {
+        return false;
+    }
+    auto& previousManifest = *folderWorkData.Params.PreviousManifest;
+    auto fileItr = previousManifest.Files.find(ConvertViewToU8View(fileChunksData.FileName));
+    if (fileItr == previousManifest.Files.end() || fileItr->second->FileSize != statItr->second->Stat.Size ||
+        fileItr->second->FileHash[0] == '\0' || fileItr->second->Chunks.empty()) {
+        return false;
+    }
+    auto& previousFileChunksData = *fileItr->second;
+    //the last chunk was cut by the end of the file, scanning restarts where it began
+    auto resumePos = (*previousFileChunksData.Chunks.rbegin())->StartPos;
+    auto chunkSize = previousManifest.ChunkSize;
+    //a look back window continues a grid, the previous manifest may be cut by another strategy
+    if (resumePos == 0 || resumePos < uint64_t(*lookBackChunkNum) * chunkSize || (*lookBackChunkNum > 0 && resumePos % chunkSize != 0)) {
+        return false;
+    }
+    std::shared_ptr<FileChunkData_t> pBoundaryChunk;
+    for (auto& pChunkData : previousFileChunksData.Chunks) {
+        if (pChunkData->bPacked) {
+            return false;
+        }
+        if (pChunkData->StartPos + pChunkData->Size == resumePos) {
+            pBoundaryChunk = pChunkData;
+        }
+    }
+    if (!pBoundaryChunk) {
+        return false;
+    }
+    //the chunk before the resume point still hashing to its name is taken as nothing before it was rewritten
+    std::vector<char> boundaryBuf(pBoundaryChunk->Size);
+    std::ifstream fileStream(filePath, std::ios::binary);
+    fileStream.seekg(std::streamoff(pBoundaryChunk->StartPos));
+    fileStream.read(boundaryBuf.data(), boundaryBuf.size());
+    if (fileStream.gcount() != std::streamsize(boundaryBuf.size())) {
+        return false;
+    }
+    auto hash = XXH3_128bits(boundaryBuf.data(), boundaryBuf.size());
+    unsigned char output[16];
+    CopyxxHashToBuf(hash, output);
+    char strongHex[bin_to_hex_length(sizeof(output)) + 1];
+    to_upper_hex(strongHex, output, sizeof(output));
+    auto weakHexLen = bin_to_hex_length(GetWeakHashSize(previousManifest.WeakHashKind));
+    if (GetHexNameView(pBoundaryChunk->HexName).size() != GetHexNameStrLen(previousManifest.WeakHashKind) ||
+        memcmp(pBoundaryChunk->HexName + weakHexLen, strongHex, bin_to_hex_length(sizeof(output))) != 0) {
+        return false;
+    }
+    for (auto& pChunkData : previousFileChunksData.Chunks) {
+        if (pChunkData->StartPos + pChunkData->Size <= resumePos) {
+            fileChunksData.Chunks.emplace(pChunkData);
+        }
+    }
+    AddChunksToIndex(folderWorkData, fileChunksData.Chunks, previousManifest.WeakHashKind);
+    auto& appendResume = folderWorkData.AppendResumes[ConvertViewToU8View(fileChunksData.FileName)];
+    appendResume.ResumePos = resumePos;
+    return true;
+}
+
+namespace {
+    //same size files are told apart by their head before the whole content is hashed
+    constexpr uint64_t DedupeHeadHashSize = 1 << 16;
+
+    typedef struct DedupeCandidate_t {
+        std::u8string_view FileName;
+        std::filesystem::path FilePath;
+        uint64_t FileSize{ 0 };
+        XXH128_hash_t Hash{};
+        bool bHashed{ false };
+    }DedupeCandidate_t;
+
+    bool HashFileHead(const std::filesystem::path& filePath, uint64_t len, XXH128_hash_t& outHash)
+    {
+        std::ifstream fileStream(filePath, std::ios::binary);
+        if (!fileStream.is_open()) {
+            return false;
+        }
+        auto pState = XXH3_createState();
+        if (!pState) {
+            return false;
+        }
+        FunctionExitHelper_t helper([&]() {
+            XXH3_freeState(pState);
+            });
+        XXH3_128bits_reset(pState);
+        std::vector<char> buf(std::min<uint64_t>(len, FileChunkSize));
+        while (len > 0) {
+            fileStream.read(buf.data(), std::streamsize(std::min<uint64_t>(len, buf.size())));
+            auto readLen = fileStream.gcount();
+            if (readLen <= 0) {
+                return false;
+            }
+            XXH3_128bits_update(pState, buf.data(), size_t(readLen));
+            len -= uint64_t(readLen);
+        }
+        outHash = XXH3_128bits_digest(pState);
+        return true;
+    }
+
+    //the first len bytes of every candidate, spread over the hardware threads
+    void HashCandidates(std::vector<DedupeCandidate_t*>& candidates, uint64_t len)
+    {
+        std::atomic_size_t nextIndex{ 0 };
+        auto threadNum = std::min<size_t>(candidates.size(), std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::jthread> threads;
+        for (size_t i = 0; i < threadNum; i++) {
+            threads.emplace_back([&]() {
+                for (auto index = nextIndex++; index < candidates.size(); index = nextIndex++) {
+                    auto& candidate = *candidates[index];
+                    candidate.bHashed = HashFileHead(candidate.FilePath, std::min(len, candidate.FileSize), candidate.Hash);
+                }
+                });
+        }
+    }
+
+    //splits candidates by the hash of the last pass, sets of one are dropped
+    void SplitCandidatesByHash(std::vector<std::vector<DedupeCandidate_t*>>& sets)
+    {
+        std::vector<std::vector<DedupeCandidate_t*>> outSets;
+        for (auto& candidateSet : sets) {
+            std::map<std::pair<uint64_t, uint64_t>, std::vector<DedupeCandidate_t*>> hashSets;
+            for (auto pCandidate : candidateSet) {
+                if (pCandidate->bHashed) {
+                    hashSets[{ pCandidate->Hash.high64, pCandidate->Hash.low64 }].push_back(pCandidate);
+                }
+            }
+            for (auto& [_, hashSet] : hashSets) {
+                if (hashSet.size() > 1) {
+                    outSets.push_back(std::move(hashSet));
+                }
+            }
+        }
+        sets = std::move(outSets);
+    }
+}
+
+void IFileBackupManagerBase::DedupeIdenticalFiles(GenFolderChunkDataWorkData_t& folderWorkData)
+{
+    std::vector<std::unique_ptr<DedupeCandidate_t>> candidates;
+    std::vector<std::vector<DedupeCandidate_t*>> candidateSets;
+    std::vector<std::pair<std::u8string_view, std::u8string_view>> duplicates;//file, the file it takes the result of
+    std::unordered_map<std::u8string_view, FileStat_t> fileStats;//taken before anything is read, checked again in post processing
+    for (auto& [fileSize, fileList] : folderWorkData.FileItrList) {
+        if (fileSize == 0 || fileList.size() < 2) {
+            continue;
+        }
+        //hard links are the same file, nothing is read to know that
+        std::map<std::pair<uint64_t, uint64_t>, std::u8string_view> inodeFiles;
+        auto& candidateSet = candidateSets.emplace_back();
+        for (auto& fileName : fileList) {
+            //a resumed file is not read from the start
+            if (folderWorkData.AppendResumes.contains(fileName)) {
+                continue;
+            }
+            std::filesystem::path filePath = ConvertViewToU8View(folderWorkData.FileLocalPathMap[fileName]);
+            FileStat_t fileStat;
+            if (!GetFileStat(filePath, fileStat)) {
+                continue;
+            }
+            fileStats.try_emplace(fileName, fileStat);
+            auto statItr = folderWorkData.OutStatCache->Files.find(fileName);
+            if (statItr != folderWorkData.OutStatCache->Files.end() && statItr->second->Stat.Inode != 0) {
+                auto [inodeItr, bNewInode] = inodeFiles.try_emplace({ GetFileDeviceID(filePath), statItr->second->Stat.Inode }, fileName);
+                if (!bNewInode) {
+                    duplicates.emplace_back(fileName, inodeItr->second);
+                    continue;
+                }
+            }
+            auto& pCandidate = candidates.emplace_back(std::make_unique<DedupeCandidate_t>());
+            pCandidate->FileName = fileName;
+            pCandidate->FilePath = std::move(filePath);
+            pCandidate->FileSize = fileSize;
+            candidateSet.push_back(pCandidate.get());
+        }
+        if (candidateSet.size() < 2) {
+            candidateSets.pop_back();
+        }
+    }
+    //heads first, then whole files of the sets still alike
+    std::vector<DedupeCandidate_t*> hashList;
+    for (auto& candidateSet : candidateSets) {
+        hashList.insert(hashList.end(), candidateSet.begin(), candidateSet.end());
+    }
+    HashCandidates(hashList, DedupeHeadHashSize);
+    SplitCandidatesByHash(candidateSets);
+    hashList.clear();
+    for (auto& candidateSet : candidateSets) {
+        if (candidateSet.front()->FileSize > DedupeHeadHashSize) {
+            hashList.insert(hashList.end(), candidateSet.begin(), candidateSet.end());
+        }
+    }
+    HashCandidates(hashList, UINT64_MAX);
+    SplitCandidatesByHash(candidateSets);
+    //the file list is in name order, so the first of a set is chunked on every run
+    for (auto& candidateSet : candidateSets) {
+        for (size_t i = 1; i < candidateSet.size(); i++) {
+            duplicates.emplace_back(candidateSet[i]->FileName, candidateSet.front()->FileName);
+        }
+    }
+    //a hard link of a file that is itself a copy follows it to the file that stays
+    std::unordered_map<std::u8string_view, std::u8string_view> representatives(duplicates.begin(), duplicates.end());
+    for (auto& [fileName, representativeName] : duplicates) {
+        for (auto itr = representatives.find(representativeName); itr != representatives.end(); itr = representatives.find(representativeName)) {
+            representativeName = itr->second;
+        }
+        auto& pFileChunksData = folderWorkData.FolderManifest.Files[fileName];
+        auto& duplicateSet = folderWorkData.DuplicateFiles[representativeName];
+        duplicateSet.Stat = fileStats[representativeName];
+        duplicateSet.Files.push_back({ pFileChunksData, fileStats[fileName] });
+        folderWorkData.CompleteSize += pFileChunksData->FileSize;
+        auto fileListItr = folderWorkData.FileItrList.find(pFileChunksData->FileSize);
+        fileListItr->second.erase(fileName);
+    }
+}
+
+void IFileBackupManagerBase::AddChunksToIndex(GenFolderChunkDataWorkData_t& folderWorkData, const FileChunksData_t::TFileChunks& chunks, EWeakHashKind weakHashKind)
+{
+    uint8_t hexBin[HexNameStrLen / 2];
+    for (auto& pChunkData : chunks) {
+        auto hexName = GetHexNameView(pChunkData->HexName);
+        if (hexName.size() == GetHexNameStrLen(weakHashKind) && hex_to_bin(hexBin, pChunkData->HexName, hexName.size())) {
+            folderWorkData.ChunkIndex.Insert(ChunkKey_t::FromBinary(hexBin, GetWeakHashSize(weakHashKind)));
+        }
+    }
+}
+
 bool IFileBackupManagerBase::GenFolderChunkDataAddHash(CommonHandle32_t handle, TGetNextHashPairCB CB)
+{
+    return AddHashImpl(handle, CB, false);
+}
+
+bool IFileBackupManagerBase::GenFolderChunkDataAddExternalHash(CommonHandle32_t handle, TGetNextHashPairCB CB)
+{
+    return AddHashImpl(handle, CB, true);
+}
+
+bool IFileBackupManagerBase::AddHashImpl(CommonHandle32_t handle, TGetNextHashPairCB CB, bool bExternal)
 {
     auto itr = GenFolderMetaDataWorkDataList.find(handle);
     if (itr == GenFolderMetaDataWorkDataList.end()) {
         return false;
     }
     auto& pFolderWorkData = itr->second;
+    auto weakHashKind = pFolderWorkData->Params.Options.WeakHashKind;
     char hexName[HexNameStrLen + 1];
     uint32_t inHexNameStrLen{ HexNameStrLen };
     uint8_t hexBin[HexNameStrLen / 2];
-    const char* strongHashBytes = (char*)hexBin + sizeof(WeakHash_t);
     while (CB((char8_t*)hexName, inHexNameStrLen)) {
         FunctionExitHelper_t helper([&]() {
             inHexNameStrLen = HexNameStrLen;
             });
-        if (inHexNameStrLen != HexNameStrLen) {
+        //names of another weak hash kind never match
+        if (inHexNameStrLen != GetHexNameStrLen(weakHashKind)) {
             continue;
         }
         auto hexres = hex_to_bin(hexBin, hexName, inHexNameStrLen);
         if (!hexres) {
             continue;
         }
-        auto [pair, res] = pFolderWorkData->AllHashMap.try_emplace(*reinterpret_cast<const WeakHash_t*>(hexBin), HashSetType{ std::string(strongHashBytes, StrongHashBit / 8) });
-        if (!res) {
-            pair->second.emplace(std::string_view(strongHashBytes, StrongHashBit / 8));
+        auto key = ChunkKey_t::FromBinary(hexBin, GetWeakHashSize(weakHashKind));
+        if (bExternal) {
+            pFolderWorkData->ChunkIndex.InsertExternal(key);
+        }
+        else {
+            pFolderWorkData->ChunkIndex.Insert(key);
         }
     }
     return true;
 }
 
+bool IFileBackupManagerBase::GenFolderChunkDataLoadChunkIDIndex(CommonHandle32_t handle, std::u8string_view path)
+{
+    auto itr = GenFolderMetaDataWorkDataList.find(handle);
+    if (itr == GenFolderMetaDataWorkDataList.end()) {
+        return false;
+    }
+    auto& pFolderWorkData = itr->second;
+    if (pFolderWorkData->Status != EGenFolderMetaDataStatus::None) {
+        return false;
+    }
+    return pFolderWorkData->ChunkIndex.LoadBase(std::filesystem::path(path), pFolderWorkData->Params.Options.WeakHashKind);
+}
+
 std::shared_ptr<const GenFolderMetaDataProcess_t> IFileBackupManagerBase::GenFolderChunkDataGetProgress(CommonHandle32_t handle)
 {
     auto itr = GenFolderMetaDataWorkDataList.find(handle);
@@ -172,6 +562,10 @@ std::shared_ptr<const GenFolderMetaDataProcess_t> IFileBackupManagerBase::GenFol
     pFolderWorkData->OutProcess->CompleteSize = pFolderWorkData->CompleteSize;
     pFolderWorkData->OutProcess->TotalSize = pFolderWorkData->ToltalSize;
     pFolderWorkData->OutProcess->Status = pFolderWorkData->Status;
+    pFolderWorkData->OutProcess->WeakFilterQueries = pFolderWorkData->WeakFilterQueries;
+    pFolderWorkData->OutProcess->WeakFilterPasses = pFolderWorkData->WeakFilterPasses;
+    pFolderWorkData->OutProcess->WeakFilterFalsePositives = pFolderWorkData->WeakFilterFalsePositives;
+    pFolderWorkData->OutProcess->WeakHashKernel = pFolderWorkData->Params.Options.WeakHashKind == EWeakHashKind::RabinKarp64 ? FBlockRollingRabinKarp64::GetKernelName() : FBlockRollingAdler32::GetKernelName();
     return pFolderWorkData->OutProcess;
 }
 
@@ -189,6 +583,32 @@ std::shared_ptr<const FolderManifest_t> IFileBackupManagerBase::GetFolderChunkDa
     return pFolderWorkData->OutFolderManifest;
 }
 
+std::shared_ptr<const FileStatCache_t> IFileBackupManagerBase::GetFolderStatCache(CommonHandle32_t handle)
+{
+    auto itr = GenFolderMetaDataWorkDataList.find(handle);
+    if (itr == GenFolderMetaDataWorkDataList.end()) {
+        return nullptr;
+    }
+    auto& pFolderWorkData = itr->second;
+    if (pFolderWorkData->Status != EGenFolderMetaDataStatus::Finished) {
+        return nullptr;
+    }
+    return pFolderWorkData->OutStatCache;
+}
+
+bool IFileBackupManagerBase::SaveFolderChunkIDIndex(CommonHandle32_t handle, std::u8string_view path)
+{
+    auto itr = GenFolderMetaDataWorkDataList.find(handle);
+    if (itr == GenFolderMetaDataWorkDataList.end()) {
+        return false;
+    }
+    auto& pFolderWorkData = itr->second;
+    if (pFolderWorkData->Status != EGenFolderMetaDataStatus::Finished) {
+        return false;
+    }
+    return pFolderWorkData->ChunkIndex.SaveMerged(std::filesystem::path(path), pFolderWorkData->FolderManifest.WeakHashKind);
+}
+
 std::optional<std::reference_wrapper<std::unordered_map<std::u8string_view, std::string>>>  IFileBackupManagerBase::GetFolderChunkLocalFileMap(CommonHandle32_t handle)
 {
     auto itr = GenFolderMetaDataWorkDataList.find(handle);
@@ -214,15 +634,20 @@ void IFileBackupManagerBase::Tick(float delta)
         }
         case EGenFolderMetaDataStatus::Inited: {
             if (pFolderWorkData->FileItrList.empty() &&
+                pFolderWorkData->PendingFileRanges.empty() &&
+                pFolderWorkData->PendingPacks.empty() &&
                 pFolderWorkData->FileTasks.empty()) {
                 uint8_t uuid[UUID_128_BYTES];
                 generate_uuid_128(uuid);
                 to_upper_hex(pFolderWorkData->FolderManifest.ID, uuid, UUID_128_BYTES);
+                memcpy(pFolderWorkData->OutStatCache->ManifestID, pFolderWorkData->FolderManifest.ID, sizeof(pFolderWorkData->OutStatCache->ManifestID));
                 pFolderWorkData->Status= EGenFolderMetaDataStatus::Finished;
             }
             break;
         }
         case EGenFolderMetaDataStatus::Finished: {
+            //io threads stop sleeping so their workflows can be released
+            pFolderWorkData->ReadEvent.Wake();
             needDel.insert(handle);
         }
         }
@@ -232,62 +657,577 @@ void IFileBackupManagerBase::Tick(float delta)
     }
 }
 
+std::tuple<std::shared_ptr<GenFolderChunkDataWorkData_t>, std::shared_ptr<GenFolderChunkDataFileTaskData_t>> IFileBackupManagerBase::AcquireNextFileTaskData(CommonHandle32_t handle, TNewFileChunkDelegate NewFileChunkDelegate, uint32_t splitRangeChunkNum)
+{
+    auto itr = GenFolderMetaDataWorkDataList.find(handle);
+    if (itr == GenFolderMetaDataWorkDataList.end()) {
+        return { nullptr,nullptr };
+    }
+    auto& pFolderWorkData = itr->second;
+    if (pFolderWorkData->Status != EGenFolderMetaDataStatus::Inited) {
+        return { nullptr,nullptr };
+    }
+    auto chunkSize = pFolderWorkData->FolderManifest.ChunkSize;
+    uint64_t splitRangeSize = uint64_t(chunkSize) * splitRangeChunkNum;
+    FileRange_t fileRange{};
+    if (!pFolderWorkData->PendingFileRanges.empty()) {
+        fileRange = pFolderWorkData->PendingFileRanges.front();
+        pFolderWorkData->PendingFileRanges.pop_front();
+    }
+    else {
+        if (pFolderWorkData->FileItrList.empty()) {
+            return { nullptr,nullptr };
+        }
+        auto& fileList = pFolderWorkData->FileItrList.rbegin()->second;
+        auto& fileName = *fileList.begin();
+        auto filesItr = pFolderWorkData->FolderManifest.Files.find(fileName);
+        assert(filesItr != pFolderWorkData->FolderManifest.Files.end());
+        fileRange.FileChunksData = filesItr->second;
+        if (auto resumeItr = pFolderWorkData->AppendResumes.find(fileName); resumeItr != pFolderWorkData->AppendResumes.end()) {
+            fileRange.ResumePos = resumeItr->second.ResumePos;
+        }
+
+        if (fileList.size() > 1) {
+            fileList.erase(fileName);
+        }
+        else {
+            pFolderWorkData->FileItrList.erase(--pFolderWorkData->FileItrList.rbegin().base());
+        }
+
+        //split decision only depends on file size, so the merged chunk list and file hash are stable
+        if (fileRange.ResumePos == 0 && splitRangeSize > 0 && fileRange.FileChunksData->FileSize > splitRangeSize * 2) {
+            auto rangeNum = uint32_t((fileRange.FileChunksData->FileSize + splitRangeSize - 1) / splitRangeSize);
+            fileRange.SplitFile = std::make_shared<SplitFileData_t>();
+            fileRange.SplitFile->RangeSize = splitRangeSize;
+            fileRange.SplitFile->RangeDigests.resize(rangeNum);
+            for (uint32_t i = 1; i < rangeNum; i++) {
+                pFolderWorkData->PendingFileRanges.push_back({ fileRange.FileChunksData, fileRange.SplitFile, i });
+            }
+            fileRange.Index = 0;
+        }
+    }
+    auto& pFileChunksData = fileRange.FileChunksData;
+
+    auto pFileTaskData = AcquireFileTaskDataFromPool(*pFolderWorkData);
+    if (!pFileTaskData) {
+        FailFolderTask(*pFolderWorkData, std::make_error_code(std::errc::not_enough_memory));
+        return { nullptr,nullptr };
+    }
+    pFileTaskData->FileChunksData = pFileChunksData;
+    if (fileRange.SplitFile) {
+        //range reads one window ahead so its first window ends at RangeStart, the window is owned by previous range
+        pFileTaskData->SplitFile = fileRange.SplitFile;
+        pFileTaskData->RangeIndex = fileRange.Index;
+        pFileTaskData->RangeStart = fileRange.Index * fileRange.SplitFile->RangeSize;
+        pFileTaskData->RangeEnd = std::min(pFileTaskData->RangeStart + fileRange.SplitFile->RangeSize, pFileChunksData->FileSize);
+        pFileTaskData->ReadPos = pFileTaskData->RangeStart > 0 ? pFileTaskData->RangeStart - chunkSize : 0;
+        pFileTaskData->ReadEnd = pFileTaskData->RangeEnd;
+        pFileTaskData->HashStart = pFileTaskData->RangeStart;
+    }
+    else if (fileRange.ResumePos > 0) {
+        //a single range from the resume point to the end, the prefix is only read again for the file hash
+        pFileTaskData->RangeStart = fileRange.ResumePos;
+        pFileTaskData->RangeEnd = pFileChunksData->FileSize;
+        pFileTaskData->ReadPos = fileRange.ResumePos - uint64_t(GetAppendResumeLookBackChunkNum().value_or(0)) * chunkSize;
+        pFileTaskData->HashStart = fileRange.ResumePos;
+        pFileTaskData->PrefixHashEnd = fileRange.ResumePos;
+    }
+    pFileTaskData->NewFileChunkDelegate = NewFileChunkDelegate;
+
+    //the file is already taken from the queue, a task that can not read it fails the folder
+    //instead of leaving a file without chunks and a task that never finishes
+    auto failTask = [&](std::error_code ec) {
+        pFileTaskData->Clear();
+        pFolderWorkData->FileTaskPool.push_back(pFileTaskData);
+        FailFolderTask(*pFolderWorkData, ec);
+        return std::tuple<std::shared_ptr<GenFolderChunkDataWorkData_t>, std::shared_ptr<GenFolderChunkDataFileTaskData_t>>{ nullptr,nullptr };
+        };
+    std::filesystem::path filePath = ConvertViewToU8View(pFolderWorkData->FileLocalPathMap[ConvertViewToU8View(pFileTaskData->FileChunksData->FileName)]);
+    //special files and files that can not be mapped still go through the stream
+    if (pFolderWorkData->Params.Options.bMemoryMapFiles && pFileChunksData->FileSize > 0 && pFileTaskData->MappedFile.Open(filePath)) {
+        pFileTaskData->bMapped = true;
+    }
+    else {
+        if (!pFileTaskData->FileChunkBuf->UseRing()) {
+            return failTask(std::make_error_code(std::errc::not_enough_memory));
+        }
+        pFileTaskData->FileStream = std::ifstream(filePath, std::ios::binary);
+        if (!pFileTaskData->FileStream.is_open()) {
+            return failTask(std::make_error_code(std::errc::io_error));
+        }
+        if (pFileTaskData->ReadPos > 0) {
+            pFileTaskData->FileStream.seekg(std::streamoff(pFileTaskData->ReadPos));
+        }
+        //a file smaller than two chunks is not worth the lookup
+        if (pFileChunksData->FileSize >= uint64_t(chunkSize) * 2) {
+            GetFileHoles(filePath, pFileTaskData->Holes);
+        }
+    }
+    pFolderWorkData->FileTasks.emplace(pFileTaskData);
+    if (!pFileTaskData->bMapped && pFolderWorkData->Params.Options.IOThreadNum > 0) {
+        EnqueueRead(*pFolderWorkData, pFileTaskData, filePath);
+    }
+    return { pFolderWorkData, pFileTaskData };
+}
+
+std::shared_ptr<GenFolderChunkDataFileTaskData_t> IFileBackupManagerBase::AcquireFileTaskDataFromPool(GenFolderChunkDataWorkData_t& folderWorkData)
+{
+    auto chunkSize = folderWorkData.FolderManifest.ChunkSize;
+    std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData;
+    //std::scoped_lock lock(pFolderWorkData->FileTaskMtx);
+    while (folderWorkData.ReleasedFileTasks.try_dequeue(pFileTaskData)) {
+        folderWorkData.FileTaskPool.push_back(std::move(pFileTaskData));
+    }
+    if (folderWorkData.FileTaskPool.size() > 0) {
+        pFileTaskData = folderWorkData.FileTaskPool.back();
+        folderWorkData.FileTaskPool.pop_back();
+        pFileTaskData->Clear();
+    }
+    else {
+        pFileTaskData = std::make_shared<GenFolderChunkDataFileTaskData_t>();
+        pFileTaskData->FileChunkBuf = std::make_shared<FileChunkBuf_t>(chunkSize);
+        pFileTaskData->ChunkConverter.UpdateMaxFileChunkSize(GetMaxFileChunkSize(chunkSize));
+        pFileTaskData->ChunkConverter.UpdateConvertDirection(EConvertDirection::ToChunkFile);
+        pFileTaskData->XXH3State = XXH3_createState();
+        if (!pFileTaskData->XXH3State) {
+            return nullptr;
+        }
+        pFileTaskData->Clear();
+    }
+    return pFileTaskData;
+}
+
+std::tuple<IFileBackupManagerInterface::TOneFileChunkDataTask, IFileBackupManagerInterface::TOneFileChunkDataReadFileTick, IFileBackupManagerInterface::TOneFileChunkDataPostProcessingTask> IFileBackupManagerBase::GenFolderChunkDataGetNextPackTask(CommonHandle32_t handle, TNewFileChunkDelegate NewFileChunkDelegate)
+{
+    auto itr = GenFolderMetaDataWorkDataList.find(handle);
+    if (itr == GenFolderMetaDataWorkDataList.end()) {
+        return { nullptr,nullptr,nullptr };
+    }
+    auto pFolderWorkData = itr->second;
+    if (pFolderWorkData->Status != EGenFolderMetaDataStatus::Inited) {
+        return { nullptr,nullptr,nullptr };
+    }
+    if (!pFolderWorkData->FileItrList.empty() || !pFolderWorkData->PendingFileRanges.empty() || pFolderWorkData->PendingPacks.empty()) {
+        return { nullptr,nullptr,nullptr };
+    }
+    auto pFileTaskData = AcquireFileTaskDataFromPool(*pFolderWorkData);
+    if (!pFileTaskData) {
+        return { nullptr,nullptr,nullptr };
+    }
+    if (!pFileTaskData->FileChunkBuf->UseRing()) {
+        return { nullptr,nullptr,nullptr };
+    }
+    pFileTaskData->Pack = pFolderWorkData->PendingPacks.front();
+    pFolderWorkData->PendingPacks.pop_front();
+    pFileTaskData->NewFileChunkDelegate = NewFileChunkDelegate;
+    pFolderWorkData->FileTasks.emplace(pFileTaskData);
+
+    TOneFileChunkDataTask func = std::bind(&IFileBackupManagerBase::GenFolderChunkDataPackTask, pFolderWorkData, pFileTaskData);
+    TOneFileChunkDataPostProcessingTask postfunc = std::bind(&IFileBackupManagerBase::GenFolderChunkDataPostProcessingTask, std::ref(*this), pFolderWorkData, pFileTaskData);
+    if (pFolderWorkData->Params.Options.IOThreadNum > 0) {
+        //members are read from the first pack file, close enough for the device queue
+        std::filesystem::path filePath = ConvertViewToU8View(pFolderWorkData->FileLocalPathMap[ConvertViewToU8View(pFileTaskData->Pack->Files.front()->FileName)]);
+        EnqueueRead(*pFolderWorkData, pFileTaskData, filePath);
+        return { func,nullptr,postfunc };
+    }
+    TOneFileChunkDataReadFileTick readFileTick = std::bind(&IFileBackupManagerBase::GenFolderChunkDataReadPackTick, std::placeholders::_1, pFolderWorkData, pFileTaskData);
+    return { func,readFileTick,postfunc };
+}
+
+void IFileBackupManagerBase::EnqueueRead(GenFolderChunkDataWorkData_t& folderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData, const std::filesystem::path& filePath)
+{
+    auto [deviceItr, _] = folderWorkData.DeviceReadNums.try_emplace(GetFileDeviceID(filePath));
+    if (!deviceItr->second) {
+        deviceItr->second = std::make_shared<std::atomic_uint32_t>(0);
+    }
+    pFileTaskData->DeviceReadNum = deviceItr->second;
+    pFileTaskData->FilePath = filePath;
+    pFileTaskData->bInReadQueue = true;
+    pFileTaskData->FileChunkBuf->ReadEvent = &folderWorkData.ReadEvent;
+    folderWorkData.ReadQueue.enqueue(pFileTaskData);
+    folderWorkData.ReadEvent.Wake();
+}
+
+void IFileBackupManagerBase::GenFolderChunkDataReadPackTick(float delta, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    GenFolderChunkDataReadPackStep(*pFolderWorkData, *pFileTaskData);
+}
+
+bool IFileBackupManagerBase::GenFolderChunkDataReadPackStep(GenFolderChunkDataWorkData_t& folderWorkData, GenFolderChunkDataFileTaskData_t& fileTaskData)
+{
+    auto& pack = *fileTaskData.Pack;
+    if (fileTaskData.PackFileIndex >= pack.Files.size()) {
+        fileTaskData.SetEOF();
+        return false;
+    }
+    //one small file per tick, a pack never exceeds the free part of a cleared ring
+    FileChunkBuf_t& FileChunkBuf = *fileTaskData.FileChunkBuf;
+    auto& pFileChunksData = pack.Files[fileTaskData.PackFileIndex];
+    auto freeBuf = FileChunkBuf.GetEmptyBuf();
+    assert(freeBuf.size() >= pFileChunksData->FileSize);
+    std::filesystem::path filePath = ConvertViewToU8View(folderWorkData.FileLocalPathMap[ConvertViewToU8View(pFileChunksData->FileName)]);
+    std::ifstream fileStream(filePath, std::ios::binary);
+    auto readLen = size_t(0);
+    if (fileStream.is_open()) {
+        fileStream.read(freeBuf.data(), pFileChunksData->FileSize);
+        readLen = size_t(fileStream.gcount());
+    }
+    //a file that can not be opened or changed size since it was listed leaves the pack, its bytes are not filled
+    if (readLen != pFileChunksData->FileSize || fileStream.peek() != std::ifstream::traits_type::eof()) {
+        pack.Size -= uint32_t(pFileChunksData->FileSize);
+        pack.DroppedFiles.push_back(std::move(pFileChunksData));
+        pack.Files.erase(pack.Files.begin() + fileTaskData.PackFileIndex);
+        return true;
+    }
+    FileChunkBuf.FillSize(uint32_t(pFileChunksData->FileSize));
+    fileTaskData.PackFileIndex++;
+    return true;
+}
+
+void IFileBackupManagerBase::GenFolderChunkDataPackTask(std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    FileChunkBuf_t& FileChunkBuf = *pFileTaskData->FileChunkBuf;
+    auto& pack = *pFileTaskData->Pack;
+    auto weakHashKind = pFolderWorkData->FolderManifest.WeakHashKind;
+    while (!pFileTaskData->bEOF) {
+        if (pFolderWorkData->bRequestExit) {
+            return;
+        }
+        FileChunkBuf.WaitContent(pFileTaskData->bEOF, pFolderWorkData->bRequestExit);
+    }
+    if (pack.Files.empty()) {
+        return;
+    }
+    auto contentBuf = FileChunkBuf.GetContentBuf();
+    assert(contentBuf.size() == pack.Size);
+    auto rawData = contentBuf.data();
+
+    unsigned char output[16];
+    WeakHash_t WeakHash = ComputeWeakHash(weakHashKind, (const uint8_t*)rawData, pack.Size);
+    auto hash = XXH3_128bits(rawData, pack.Size);
+    CopyxxHashToBuf(hash, output);
+    bool bStrongExist = pFolderWorkData->ChunkIndex.ContainsWeak(WeakHash) && pFolderWorkData->ChunkIndex.Contains(ChunkKey_t{ WeakHash, hash });
+    char hexName[HexNameStrLen + 1];
+    auto hexNameLen = WriteHexName(hexName, WeakHash, GetWeakHashSize(weakHashKind), output);
+
+    uint32_t chunkOffset{ 0 };
+    for (auto& pFileChunksData : pack.Files) {
+        auto fileSize = uint32_t(pFileChunksData->FileSize);
+        auto fileHash = XXH3_128bits(rawData + chunkOffset, fileSize);
+        CopyxxHashToBuf(fileHash, output);
+        to_upper_hex(pFileChunksData->FileHash, output, sizeof(output));
+
+        auto pChunkData = std::make_shared<FileChunkData_t>();
+        auto& ChunkData = *pChunkData;
+        memcpy(ChunkData.HexName, hexName, hexNameLen + 1);
+        ChunkData.StartPos = 0;
+        ChunkData.Size = fileSize;
+        ChunkData.ChunkOffset = chunkOffset;
+        ChunkData.bPacked = true;
+        pFileChunksData->Chunks.emplace(pChunkData);
+        chunkOffset += fileSize;
+    }
+    if (!bStrongExist && pFolderWorkData->ChunkIndex.TryClaim(ChunkKey_t{ WeakHash, hash })) {
+        if (!pFolderWorkData->bRequestExit) {
+            pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)hexName, hexNameLen }, { (const char*)rawData, pack.Size });
+        }
+    }
+    pFolderWorkData->CompleteSize.fetch_add(pack.Size);
+    FileChunkBuf.EatSize(pack.Size);
+}
+
 void IFileBackupManagerBase::GenFolderChunkDataReadFileTick(this IFileBackupManagerBase& self, float delta, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    GenFolderChunkDataReadFileStep(*pFileTaskData);
+}
+
+bool IFileBackupManagerBase::GenFolderChunkDataReadFileStep(GenFolderChunkDataFileTaskData_t& fileTaskData)
 {
     auto caculateFileHash = [&](const unsigned char* content, uint32_t len) {
-        XXH3_128bits_update(pFileTaskData->XXH3State, content, len);
+        XXH3_128bits_update(fileTaskData.XXH3State, content, len);
         };
-    FileChunkBuf_t& FileChunkBuf = *pFileTaskData->FileChunkBuf;
-    if (!pFileTaskData->FileStream.eof()) {
+    if (fileTaskData.bMapped) {
+        return false;
+    }
+    FileChunkBuf_t& FileChunkBuf = *fileTaskData.FileChunkBuf;
+    if (fileTaskData.PrefixHashPos < fileTaskData.PrefixHashEnd) {
+        //the ring is still empty, its free part is the read buffer of the prefix
+        auto freeBuf = FileChunkBuf.GetEmptyBuf();
+        auto readLen = std::min<uint64_t>(freeBuf.size(), fileTaskData.PrefixHashEnd - fileTaskData.PrefixHashPos);
+        fileTaskData.FileStream.seekg(std::streamoff(fileTaskData.PrefixHashPos));
+        fileTaskData.FileStream.read(freeBuf.data(), std::streamsize(readLen));
+        auto extractLen = uint64_t(fileTaskData.FileStream.gcount());
+        caculateFileHash((const unsigned char*)freeBuf.data(), uint32_t(extractLen));
+        fileTaskData.PrefixHashPos += extractLen;
+        if (extractLen < readLen) {
+            //the file shrank, the scan that follows finds its end
+            fileTaskData.PrefixHashPos = fileTaskData.PrefixHashEnd;
+            fileTaskData.FileStream.clear();
+        }
+        if (fileTaskData.PrefixHashPos >= fileTaskData.PrefixHashEnd) {
+            fileTaskData.FileStream.seekg(std::streamoff(fileTaskData.ReadPos));
+        }
+        return true;
+    }
+    if (!fileTaskData.FileStream.eof() && fileTaskData.ReadPos < fileTaskData.ReadEnd) {
         //std::unique_lock lock(pFileTaskData->FileChunkBufMtx, std::defer_lock);
         //lock.lock();
         auto freeBuf = FileChunkBuf.GetEmptyBuf();
         //lock.unlock();
         if (freeBuf.size() == 0) {
-            return;
+            return true;
+        }
+        auto readLen = std::min<uint64_t>(freeBuf.size(), fileTaskData.ReadEnd - fileTaskData.ReadPos);
+        std::streamsize extractLen;
+        auto pHole = fileTaskData.FindHole(fileTaskData.ReadPos);
+        if (pHole && pHole->Start <= fileTaskData.ReadPos) {
+            extractLen = std::streamsize(std::min(readLen, pHole->End - fileTaskData.ReadPos));
+            memset(freeBuf.data(), 0, size_t(extractLen));
+            fileTaskData.FileStream.seekg(std::streamoff(fileTaskData.ReadPos + extractLen));
+        }
+        else {
+            if (pHole) {
+                readLen = std::min(readLen, pHole->Start - fileTaskData.ReadPos);
+            }
+            fileTaskData.FileStream.read(freeBuf.data(), std::streamsize(readLen));
+            extractLen = fileTaskData.FileStream.gcount();
         }
-        pFileTaskData->FileStream.read(freeBuf.data(), freeBuf.size());
-        auto extractLen = pFileTaskData->FileStream.gcount();
         if (extractLen == 0) {
-            return;
+            return true;
+        }
+        if (fileTaskData.ReadPos + extractLen > fileTaskData.HashStart) {
+            auto skipLen = fileTaskData.HashStart > fileTaskData.ReadPos ? fileTaskData.HashStart - fileTaskData.ReadPos : 0;
+            caculateFileHash((const unsigned char*)freeBuf.data() + skipLen, uint32_t(extractLen - skipLen));
         }
-        caculateFileHash((const unsigned char*)freeBuf.data(), extractLen);
+        fileTaskData.ReadPos += extractLen;
         //lock.lock();
         FileChunkBuf.FillSize(extractLen);
         //lock.unlock();
+        return true;
+    }
+    //tail chunks keep their real size, nothing is padded
+    fileTaskData.SetEOF();
+    return false;
+}
+
+IFileBackupManagerInterface::TGenFolderChunkDataIOTick IFileBackupManagerBase::GenFolderChunkDataGetIOTick(CommonHandle32_t handle)
+{
+    auto itr = GenFolderMetaDataWorkDataList.find(handle);
+    if (itr == GenFolderMetaDataWorkDataList.end()) {
+        return nullptr;
+    }
+    auto& options = itr->second->Params.Options;
+    if (options.IOThreadNum == 0) {
+        return nullptr;
+    }
+    std::shared_ptr<FUringReader> pUringReader;
+#ifdef IO_URING_FOUND
+    //kernels without io_uring keep the stream reads
+    if (options.bIOUring) {
+        pUringReader = std::make_shared<FUringReader>();
+        if (!pUringReader->Init(options.bDirectIO)) {
+            pUringReader = nullptr;
+        }
+    }
+#endif
+    return std::bind(&IFileBackupManagerBase::GenFolderChunkDataIOTick, std::placeholders::_1, itr->second, pUringReader);
+}
+
+void IFileBackupManagerBase::GenFolderChunkDataIOTick(float delta, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr<FUringReader> pUringReader)
+{
+#ifdef IO_URING_FOUND
+    if (pUringReader) {
+        pUringReader->Tick(*pFolderWorkData);
+        return;
+    }
+#endif
+    auto seq = pFolderWorkData->ReadEvent.Prepare();
+    bool bBusy{ false };
+    std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData;
+    //one read per dequeued task, so tasks share the threads and one big file does not hold them
+    for (auto num = pFolderWorkData->ReadQueue.size_approx(); num > 0 && pFolderWorkData->ReadQueue.try_dequeue(pFileTaskData); num--) {
+        if (GenFolderChunkDataReadQueuedTask(*pFolderWorkData, pFileTaskData)) {
+            bBusy = true;
+        }
+    }
+    if (bBusy || pFolderWorkData->bRequestExit || pFolderWorkData->Status == EGenFolderMetaDataStatus::Finished) {
+        pFolderWorkData->ReadEvent.Cancel();
     }
     else {
-        if (pFileTaskData->WaitAppendDataLen > 0) {
-            //std::unique_lock lock(pFileTaskData->FileChunkBufMtx, std::defer_lock);
-            //lock.lock();
-            auto freeBuf = FileChunkBuf.GetEmptyBuf();
-            //lock.unlock();
-            if (freeBuf.size() == 0) {
-                return;
-            }
-            auto fillSize = std::min(freeBuf.size(), size_t(pFileTaskData->WaitAppendDataLen));
-            memset(freeBuf.data(), 0, fillSize);
-            pFileTaskData->WaitAppendDataLen -= fillSize;
-            //lock.lock();
-            FileChunkBuf.FillSize(fillSize);
-            //lock.unlock();
+        pFolderWorkData->ReadEvent.Wait(seq);
+    }
+}
+
+bool IFileBackupManagerBase::GenFolderChunkDataReadQueuedTask(GenFolderChunkDataWorkData_t& folderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    if (folderWorkData.bRequestExit) {
+        ReleaseReadTask(folderWorkData, std::move(pFileTaskData));
+        return true;
+    }
+    //another thread reads the device, it is not idle
+    auto pDeviceReadNum = pFileTaskData->DeviceReadNum;
+    if (pDeviceReadNum->fetch_add(1) >= folderWorkData.Params.Options.IOQueueDepth) {
+        pDeviceReadNum->fetch_sub(1);
+        folderWorkData.ReadQueue.enqueue(pFileTaskData);
+        return true;
+    }
+    auto readPos = pFileTaskData->ReadPos;
+    auto packFileIndex = pFileTaskData->PackFileIndex;
+    auto packFileNum = pFileTaskData->Pack ? pFileTaskData->Pack->Files.size() : 0;
+    auto prefixHashPos = pFileTaskData->PrefixHashPos;
+    bool bMore = pFileTaskData->Pack ? GenFolderChunkDataReadPackStep(folderWorkData, *pFileTaskData) : GenFolderChunkDataReadFileStep(*pFileTaskData);
+    pDeviceReadNum->fetch_sub(1);
+    if (bMore) {
+        //a file dropped from a pack is progress too
+        bool bRead = pFileTaskData->ReadPos != readPos || pFileTaskData->PrefixHashPos != prefixHashPos || pFileTaskData->PackFileIndex != packFileIndex || (pFileTaskData->Pack && pFileTaskData->Pack->Files.size() != packFileNum);
+        folderWorkData.ReadQueue.enqueue(pFileTaskData);
+        return bRead;
+    }
+    ReleaseReadTask(folderWorkData, std::move(pFileTaskData));
+    return true;
+}
+
+void IFileBackupManagerBase::ReleaseReadTask(GenFolderChunkDataWorkData_t& folderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    //the worker may already be done, nothing of the task is touched after this unless post processing left it to us
+    if (!pFileTaskData->bInReadQueue.exchange(false)) {
+        folderWorkData.ReleasedFileTasks.enqueue(std::move(pFileTaskData));
+    }
+}
+
+void IFileBackupManagerBase::GenFolderChunkDataPumpMappedFile(GenFolderChunkDataFileTaskData_t& fileTaskData)
+{
+    FileChunkBuf_t& FileChunkBuf = *fileTaskData.FileChunkBuf;
+    if (!fileTaskData.bMapped || fileTaskData.bEOF || FileChunkBuf.ContentSize.load() > 0) {
+        return;
+    }
+    //the prefix goes through the hash window by window before the first window is exposed
+    while (fileTaskData.PrefixHashPos < fileTaskData.PrefixHashEnd) {
+        auto mapLen = size_t(std::min(MappedFileWindowSize, fileTaskData.PrefixHashEnd - fileTaskData.PrefixHashPos));
+        auto view = fileTaskData.MappedFile.Map(fileTaskData.PrefixHashPos, mapLen);
+        if (!view || !GuardMappedRead([&]() { XXH3_128bits_update(fileTaskData.XXH3State, view, mapLen); })) {
+            fileTaskData.PrefixHashPos = fileTaskData.PrefixHashEnd;
+            fileTaskData.bEOF = true;
+            return;
         }
-        else {
-            pFileTaskData->bEOF = true;
+        fileTaskData.PrefixHashPos += mapLen;
+    }
+    auto readEnd = std::min(fileTaskData.ReadEnd, fileTaskData.MappedFile.GetSize());
+    if (fileTaskData.ReadPos >= readEnd) {
+        fileTaskData.bEOF = true;
+        return;
+    }
+    auto mapEnd = fileTaskData.MapOffset + uint64_t(FileChunkBuf.BufEnd - FileChunkBuf.Buf);
+    if (!FileChunkBuf.IsMapped() || fileTaskData.ReadPos >= mapEnd) {
+        //pages past the end of a file that shrank since it was opened fault, the window stops there like a short read
+        readEnd = std::min(readEnd, fileTaskData.MappedFile.GetCurrentSize());
+        if (fileTaskData.ReadPos >= readEnd) {
+            fileTaskData.bEOF = true;
+            return;
+        }
+        //the new window starts early enough to keep the consumed part the scan may still look back at
+        auto alignment = FMappedFile::GetMapAlignment();
+        auto keepLen = std::min<uint64_t>(fileTaskData.ReadPos, FileChunkBuf.ConsumedFileBufSize);
+        auto mapOffset = (fileTaskData.ReadPos - keepLen) / alignment * alignment;
+        auto mapLen = size_t(std::min(MappedFileWindowSize, readEnd - mapOffset));
+        auto view = fileTaskData.MappedFile.Map(mapOffset, mapLen);
+        if (!view) {
+            //same as a failed read of the stream, the file ends here
+            fileTaskData.bEOF = true;
+            return;
+        }
+        FileChunkBuf.UseMapping(view, mapLen, size_t(fileTaskData.ReadPos - mapOffset));
+        fileTaskData.MapOffset = mapOffset;
+        mapEnd = mapOffset + mapLen;
+    }
+    //expose one ring worth at a time so the file hash runs just ahead of the scan over the same pages
+    auto fillLen = uint32_t(std::min<uint64_t>(FileChunkBuf.FileBufSize, mapEnd - fileTaskData.ReadPos));
+    //every page is touched here before the worker sees it, a file cut under the mapping ends like a failed read.
+    //the file hash is left halfway then, as the file changed during the scan
+    bool bRead = GuardMappedRead([&]() {
+        auto skipLen = uint32_t(std::min<uint64_t>(fillLen, fileTaskData.HashStart > fileTaskData.ReadPos ? fileTaskData.HashStart - fileTaskData.ReadPos : 0));
+        volatile char touch{ 0 };
+        for (uint32_t i = 0; i < skipLen; i += 4096) {
+            touch = touch ^ FileChunkBuf.StreamPos[i];
         }
+        if (skipLen < fillLen) {
+            XXH3_128bits_update(fileTaskData.XXH3State, FileChunkBuf.StreamPos + skipLen, fillLen - skipLen);
+        }
+        });
+    if (!bRead) {
+        fileTaskData.bEOF = true;
+        return;
+    }
+    fileTaskData.ReadPos += fillLen;
+    FileChunkBuf.FillSize(fillLen);
+    if (fileTaskData.ReadPos >= readEnd) {
+        fileTaskData.bEOF = true;
     }
 }
 
 void IFileBackupManagerBase::GenFolderChunkDataPostProcessingTask(this IFileBackupManagerBase& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData)
 {
-    for (auto& [weekHash, strongSet] : pFileTaskData->FileAllHashMap) {
-        auto [itr, res] = pFolderWorkData->AllHashMap.try_emplace(weekHash, strongSet);
-        if (res) {
-            continue;
+    //the file changed under the scan, its chunks and hash do not describe any version of it
+    if (!pFolderWorkData->bRequestExit && (pFileTaskData->bShortRead || (pFileTaskData->bMapped && pFileTaskData->MappedFile.HasLostPages()))) {
+        FailFolderTask(*pFolderWorkData, std::make_error_code(std::errc::io_error));
+    }
+    if (auto& pSplitFile = pFileTaskData->SplitFile) {
+        pFileTaskData->FileChunksData->Chunks.merge(pFileTaskData->RangeChunks);
+        if (++pSplitFile->FinishedRangeNum == pSplitFile->RangeDigests.size()) {
+            std::vector<unsigned char> digestsBuf(pSplitFile->RangeDigests.size() * 16);
+            for (size_t i = 0; i < pSplitFile->RangeDigests.size(); i++) {
+                CopyxxHashToBuf(pSplitFile->RangeDigests[i], digestsBuf.data() + i * 16);
+            }
+            auto xxhash = XXH3_128bits(digestsBuf.data(), digestsBuf.size());
+            unsigned char output[16];
+            CopyxxHashToBuf(xxhash, output);
+            to_upper_hex(pFileTaskData->FileChunksData->FileHash, output, sizeof(output));
+            pFileTaskData->FileChunksData->FileHashKind = EFileHashKind::SplitRanges;
         }
-        itr->second.merge(strongSet);
+    }
+    else if (pFileTaskData->RangeStart > 0) {
+        pFolderWorkData->AppendResumes.erase(ConvertViewToU8View(pFileTaskData->FileChunksData->FileName));
+    }
+    if (pFileTaskData->Pack) {
+        //scanned like any other file, a file that can not be read is handled there
+        for (auto& pDroppedFile : pFileTaskData->Pack->DroppedFiles) {
+            auto [fileListItr, _] = pFolderWorkData->FileItrList.try_emplace(pDroppedFile->FileSize);
+            fileListItr->second.insert(ConvertViewToU8View(pDroppedFile->FileName));
+        }
+        pFileTaskData->Pack->DroppedFiles.clear();
+    }
+    auto& pFileChunksData = pFileTaskData->FileChunksData;
+    bool bFileDone = !pFileTaskData->SplitFile || pFileTaskData->SplitFile->FinishedRangeNum == pFileTaskData->SplitFile->RangeDigests.size();
+    if (pFileChunksData && bFileDone && !pFolderWorkData->DuplicateFiles.empty()) {
+        auto duplicateItr = pFolderWorkData->DuplicateFiles.find(ConvertViewToU8View(pFileChunksData->FileName));
+        if (duplicateItr != pFolderWorkData->DuplicateFiles.end()) {
+            auto getStat = [&](const FileChunksData_t& fileChunksData, FileStat_t& outStat) {
+                std::filesystem::path filePath = ConvertViewToU8View(pFolderWorkData->FileLocalPathMap[ConvertViewToU8View(fileChunksData.FileName)]);
+                return GetFileStat(filePath, outStat);
+                };
+            //files changed since the content was compared are not known to be alike, each is scanned itself
+            FileStat_t fileStat;
+            bool bSame = getStat(*pFileChunksData, fileStat) && fileStat == duplicateItr->second.Stat;
+            for (auto& duplicateFile : duplicateItr->second.Files) {
+                auto& pDuplicateFile = duplicateFile.FileChunksData;
+                if (bSame && getStat(*pDuplicateFile, fileStat) && fileStat == duplicateFile.Stat) {
+                    pDuplicateFile->Chunks = pFileChunksData->Chunks;
+                    memcpy(pDuplicateFile->FileHash, pFileChunksData->FileHash, sizeof(pDuplicateFile->FileHash));
+                    pDuplicateFile->FileHashKind = pFileChunksData->FileHashKind;
+                    continue;
+                }
+                pFolderWorkData->CompleteSize -= pDuplicateFile->FileSize;
+                auto [fileListItr, _] = pFolderWorkData->FileItrList.try_emplace(pDuplicateFile->FileSize);
+                fileListItr->second.insert(ConvertViewToU8View(pDuplicateFile->FileName));
+            }
+            pFolderWorkData->DuplicateFiles.erase(duplicateItr);
+        }
+    }
+    pFolderWorkData->FileTasks.erase(pFileTaskData);
+    //still held by the io stage after a cancel or a late last read, it hands the task back once it lets go
+    if (pFileTaskData->bInReadQueue.exchange(false)) {
+        return;
     }
     pFileTaskData->Clear();
-    pFolderWorkData->FileTasks.erase(ConvertViewToU8View(pFileTaskData->FileChunksData->FileName));
     pFolderWorkData->FileTaskPool.push_back(pFileTaskData);
 }
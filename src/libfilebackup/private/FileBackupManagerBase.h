@@ -2,22 +2,72 @@
 #include "FileBackupManager.h"
 #include "FileBackupInternal.h"
 
+class FUringReader;
+
 class IFileBackupManagerBase :public IFileBackupManagerInterface {
 public:
     IFileBackupManagerBase() {}
 
     CommonHandle32_t GenFolderChunkData(const char8_t* path, TGenFolderMetaDataStatusChangedDelegate Delegate) override;
+    CommonHandle32_t GenFolderChunkData(const char8_t* path, const GenFolderChunkOptions_t& options, TGenFolderMetaDataStatusChangedDelegate Delegate) override;
     CommonHandle32_t GenFolderChunkData(GenFolderChunkParams_t& params, TGenFolderMetaDataStatusChangedDelegate Delegate) override;
     void CancelTask(CommonHandle32_t handle) override;
     void InitTask(CommonHandle32_t) override;
     bool GenFolderChunkDataAddHash(CommonHandle32_t handle, TGetNextHashPairCB CB) override;
+    bool GenFolderChunkDataAddExternalHash(CommonHandle32_t handle, TGetNextHashPairCB CB) override;
+    bool AddHashImpl(CommonHandle32_t handle, TGetNextHashPairCB CB, bool bExternal);
+    bool GenFolderChunkDataLoadChunkIDIndex(CommonHandle32_t handle, std::u8string_view path) override;
 
     std::shared_ptr<const GenFolderMetaDataProcess_t> GenFolderChunkDataGetProgress(CommonHandle32_t handle) override;
     std::shared_ptr<const FolderManifest_t> GetFolderChunkData(CommonHandle32_t handle) override;
     std::optional<std::reference_wrapper<std::unordered_map<std::u8string_view, std::string>>> GetFolderChunkLocalFileMap(CommonHandle32_t handle) override;
+    std::shared_ptr<const FileStatCache_t> GetFolderStatCache(CommonHandle32_t handle) override;
+    bool SaveFolderChunkIDIndex(CommonHandle32_t handle, std::u8string_view path) override;
     void Tick(float delta) override;
+    TGenFolderChunkDataIOTick GenFolderChunkDataGetIOTick(CommonHandle32_t handle) override;
+
+
+    //pop the largest pending file and bind it to a pooled task data, shared by all chunking strategies
+    //splitRangeChunkNum nonzero lets a file larger than two ranges of that many chunks be scanned as ranges by several tasks
+    std::tuple<std::shared_ptr<GenFolderChunkDataWorkData_t>, std::shared_ptr<GenFolderChunkDataFileTaskData_t>> AcquireNextFileTaskData(CommonHandle32_t handle, TNewFileChunkDelegate NewFileChunkDelegate, uint32_t splitRangeChunkNum = 0);
 
+    //next pack of small files, only after all other files are taken
+    std::tuple<TOneFileChunkDataTask, TOneFileChunkDataReadFileTick, TOneFileChunkDataPostProcessingTask> GenFolderChunkDataGetNextPackTask(CommonHandle32_t handle, TNewFileChunkDelegate NewFileChunkDelegate);
+    //takes hash and chunks of the previous manifest when the stat matches the cache, the file is then not read
+    static bool ReuseUnchangedFile(GenFolderChunkDataWorkData_t& folderWorkData, FileChunksData_t& fileChunksData, const FileStat_t& fileStat);
+    //a file that only grew keeps the chunks before the previous last chunk once the chunk before that still matches,
+    //then only the rest is scanned
+    bool ResumeAppendedFile(GenFolderChunkDataWorkData_t& folderWorkData, FileChunksData_t& fileChunksData, const FileStat_t& fileStat, const std::filesystem::path& filePath);
+    //hard links and files with the same content leave the queue, each takes the result of the one file of its set that stays
+    static void DedupeIdenticalFiles(GenFolderChunkDataWorkData_t& folderWorkData);
+    //chunks named by a manifest are known to the chunk dir
+    static void AddChunksToIndex(GenFolderChunkDataWorkData_t& folderWorkData, const FileChunksData_t::TFileChunks& chunks, EWeakHashKind weakHashKind);
+    //chunks a resumed scan reads again before the resume point to seed its state, nullopt when the strategy can not resume
+    virtual std::optional<uint32_t> GetAppendResumeLookBackChunkNum() const {
+        return std::nullopt;
+    }
+    //ends the folder task with ec, workers and io threads stop, tick thread only
+    static void FailFolderTask(GenFolderChunkDataWorkData_t& folderWorkData, std::error_code ec);
+    //pooled task data or a new one sized by the manifest chunk size
+    std::shared_ptr<GenFolderChunkDataFileTaskData_t> AcquireFileTaskDataFromPool(GenFolderChunkDataWorkData_t& folderWorkData);
 
+    //hand the task to the io stage, reads of one device are limited to IOQueueDepth at a time
+    static void EnqueueRead(GenFolderChunkDataWorkData_t& folderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData, const std::filesystem::path& filePath);
+    //one read of the io stage for each queued task, may run on several threads at once
+    //sleeps on ReadEvent when every queued ring is full, until a worker frees a quarter of one or a task is queued
+    //pUringReader is owned by one io thread, null reads through the streams
+    static void GenFolderChunkDataIOTick(float delta, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr<FUringReader> pUringReader);
+    //io stage is done with the task, hands it back to the pool if post processing already ran
+    static void ReleaseReadTask(GenFolderChunkDataWorkData_t& folderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData);
+    //one stream read of a task taken from ReadQueue, then requeue or release it, false if its ring was full
+    static bool GenFolderChunkDataReadQueuedTask(GenFolderChunkDataWorkData_t& folderWorkData, std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData);
+    //the steps return false once bEOF is set
+    static bool GenFolderChunkDataReadPackStep(GenFolderChunkDataWorkData_t& folderWorkData, GenFolderChunkDataFileTaskData_t& fileTaskData);
+    static bool GenFolderChunkDataReadFileStep(GenFolderChunkDataFileTaskData_t& fileTaskData);
+    static void GenFolderChunkDataReadPackTick(float delta, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData);
+    static void GenFolderChunkDataPackTask(std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData);
+    //mapped task only, called by the worker before it checks bEOF, exposes the next part of the mapping once the content is consumed
+    static void GenFolderChunkDataPumpMappedFile(GenFolderChunkDataFileTaskData_t& fileTaskData);
     void GenFolderChunkDataReadFileTick(this IFileBackupManagerBase& self, float delta, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData);
     void GenFolderChunkDataPostProcessingTask(this IFileBackupManagerBase& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData);
 
@@ -0,0 +1,171 @@
+#include "FileBackupManagerFastCDC.h"
+
+#include <string_convert.h>
+#include <FunctionExitHelper.h>
+#include <std_ext.h>
+
+#include <xxhash.h>
+#include <zstd.h>
+#include <filesystem>
+#include <algorithm>
+#include <array>
+#include <bit>
+
+namespace {
+    ///gear hash only mixes the last 64 bytes into the high bits, so the masks test the top bits
+    constexpr uint64_t GearMask(uint32_t bits) {
+        return bits == 0 ? 0 : ~uint64_t(0) << (64 - bits);
+    }
+
+    //the average size is the manifest chunk size, the max size stays inside the consumed part of the ring buffer
+    typedef struct CDCParams_t {
+        uint32_t MinSize;
+        uint32_t AvgSize;
+        uint32_t MaxSize;
+        //normalized chunking: harder to cut before the average size, easier after it
+        uint64_t MaskS;
+        uint64_t MaskL;
+    }CDCParams_t;
+    constexpr CDCParams_t GetCDCParams(uint32_t chunkSize) {
+        return { chunkSize / 4, chunkSize, GetMaxFileChunkSize(chunkSize), GearMask(std::countr_zero(chunkSize) + 2), GearMask(std::countr_zero(chunkSize) - 2) };
+    }
+
+    constexpr std::array<uint64_t, 256> GenerateGearTable() {
+        std::array<uint64_t, 256> table{};
+        uint64_t state = 0x0F11EBAC4B5EEDULL;
+        for (auto& value : table) {
+            //splitmix64, fixed seed so every build cuts at the same boundaries
+            state += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            value = z ^ (z >> 31);
+        }
+        return table;
+    }
+    constexpr std::array<uint64_t, 256> GearTable = GenerateGearTable();
+}
+
+std::tuple<IFileBackupManagerInterface::TOneFileChunkDataTask, IFileBackupManagerInterface::TOneFileChunkDataReadFileTick, IFileBackupManagerInterface::TOneFileChunkDataPostProcessingTask> FFileBackupManagerFastCDC::GenFolderChunkDataGetNextFileTask(CommonHandle32_t handle, TNewFileChunkDelegate NewFileChunkDelegate)
+{
+    auto [pFolderWorkData, pFileTaskData] = AcquireNextFileTaskData(handle, NewFileChunkDelegate);
+    if (!pFileTaskData) {
+        return GenFolderChunkDataGetNextPackTask(handle, NewFileChunkDelegate);
+    }
+    TOneFileChunkDataTask func = std::bind(&FFileBackupManagerFastCDC::GenFolderChunkDataTask, *this, pFolderWorkData, pFileTaskData);
+    TOneFileChunkDataPostProcessingTask postfunc = std::bind(&FFileBackupManagerFastCDC::GenFolderChunkDataPostProcessingTask, *this, pFolderWorkData, pFileTaskData);
+    TOneFileChunkDataReadFileTick readFileTick;
+    //the io stage, or the worker of a mapped file, reads it and the caller has nothing to tick
+    if (pFolderWorkData->Params.Options.IOThreadNum == 0 && !pFileTaskData->bMapped) {
+        readFileTick = std::bind(&FFileBackupManagerFastCDC::GenFolderChunkDataReadFileTick, *this, std::placeholders::_1, pFolderWorkData, pFileTaskData);
+    }
+    return { func,readFileTick,postfunc };
+}
+
+void FFileBackupManagerFastCDC::GenFolderChunkDataTask(this FFileBackupManagerFastCDC& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    VisitChunkSize(pFolderWorkData->FolderManifest.ChunkSize, [&](auto chunkSizeConst) {
+        self.GenFolderChunkDataTaskImpl<decltype(chunkSizeConst)::value>(pFolderWorkData, pFileTaskData);
+        });
+}
+
+template<uint32_t ChunkSizeT>
+void FFileBackupManagerFastCDC::GenFolderChunkDataTaskImpl(this FFileBackupManagerFastCDC& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    const CDCParams_t cdc = GetCDCParams(ChunkSizeT ? ChunkSizeT : pFolderWorkData->FolderManifest.ChunkSize);
+    FileChunkBuf_t& FileChunkBuf = *pFileTaskData->FileChunkBuf;
+    auto weakHashKind = pFolderWorkData->FolderManifest.WeakHashKind;
+
+    unsigned char output[16];
+    //a resumed file starts at a previous boundary
+    uint64_t chunkStartPos{ pFileTaskData->RangeStart };
+    uint32_t chunkLen{ 0 };
+    uint64_t fingerprint{ 0 };
+
+    //the chunk ends at ConsumePos
+    auto cutChunkFunc = [&]() {
+        auto rawData = FileChunkBuf.GetContinuousConsumedBuf(0, chunkLen);
+        WeakHash_t WeakHash;
+        XXH128_hash_t hash;
+        //the gear hash settles over zeros and usually misses both masks, zero runs are then cut at the max size whose name is known
+        auto pZeroChunk = pFolderWorkData->FindZeroChunk(chunkLen);
+        if (pZeroChunk && IsZeroBuf(rawData, chunkLen)) {
+            WeakHash = pZeroChunk->WeakHash;
+            hash = pZeroChunk->Hash;
+        }
+        else {
+            WeakHash = ComputeWeakHash(weakHashKind, (const uint8_t*)rawData, chunkLen);
+            hash = XXH3_128bits(rawData, chunkLen);
+        }
+        CopyxxHashToBuf(hash, output);
+
+        bool bStrongExist = !pFolderWorkData->ChunkIndex.Insert(ChunkKey_t{ WeakHash, hash });
+
+        auto pChunkData = std::make_shared<FileChunkData_t>();
+        auto& ChunkData = *pChunkData;
+        ChunkData.StartPos = chunkStartPos;
+        ChunkData.Size = chunkLen;
+        auto hexNameLen = WriteHexName(ChunkData.HexName, WeakHash, GetWeakHashSize(weakHashKind), output);
+        pFileTaskData->FileChunksData->Chunks.emplace(pChunkData);
+        if (!bStrongExist) {
+            if (!pFolderWorkData->bRequestExit) {
+                pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)ChunkData.HexName, hexNameLen }, { (const char*)rawData, chunkLen });
+            }
+        }
+        pFolderWorkData->CompleteSize.fetch_add(chunkLen);
+
+        chunkStartPos += chunkLen;
+        chunkLen = 0;
+        fingerprint = 0;
+        };
+
+    while (true) {
+        if (pFolderWorkData->bRequestExit) {
+            break;
+        }
+        GenFolderChunkDataPumpMappedFile(*pFileTaskData);
+        if (pFileTaskData->bEOF) {
+            auto contentSize = FileChunkBuf.ContentSize.load();
+            //the file got shorter while it was read, post processing fails the folder instead of keeping a short entry
+            if (chunkStartPos + chunkLen + contentSize < pFileTaskData->FileChunksData->FileSize) {
+                pFileTaskData->bShortRead = true;
+                break;
+            }
+            if (contentSize == 0) {
+                if (chunkLen > 0) {
+                    cutChunkFunc();
+                }
+                break;
+            }
+        }
+        auto contentBuf = FileChunkBuf.GetContentBuf();
+        if (contentBuf.empty()) {
+            //sleep until the reader fills the ring up to its watermark or ends the file
+            FileChunkBuf.WaitContent(pFileTaskData->bEOF, pFolderWorkData->bRequestExit);
+            continue;
+        }
+        uint32_t i = 0;
+        uint32_t eatenLen = 0;
+        while (i < contentBuf.size()) {
+            if (chunkLen < cdc.MinSize) {
+                //cut-point skipping, nothing before the min size can be a boundary
+                auto skipLen = std::min(cdc.MinSize - chunkLen, uint32_t(contentBuf.size()) - i);
+                i += skipLen;
+                chunkLen += skipLen;
+                continue;
+            }
+            fingerprint = (fingerprint << 1) + GearTable[(uint8_t)contentBuf[i]];
+            i++;
+            chunkLen++;
+            if (!(fingerprint & (chunkLen < cdc.AvgSize ? cdc.MaskS : cdc.MaskL)) || chunkLen >= cdc.MaxSize) {
+                FileChunkBuf.EatSize(i - eatenLen);
+                eatenLen = i;
+                cutChunkFunc();
+            }
+        }
+        FileChunkBuf.EatSize(i - eatenLen);
+    }
+    auto xxhash = XXH3_128bits_digest(pFileTaskData->XXH3State);
+    CopyxxHashToBuf(xxhash, output);
+    to_upper_hex(pFolderWorkData->FolderManifest.Files[ConvertViewToU8View(pFileTaskData->FileChunksData->FileName)]->FileHash, output, sizeof(output));
+}
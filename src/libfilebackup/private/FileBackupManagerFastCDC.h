@@ -0,0 +1,19 @@
+#include "FileBackupManager.h"
+#include "FileBackupManagerBase.h"
+#include "FileBackupInternal.h"
+
+class FFileBackupManagerFastCDC :public IFileBackupManagerBase {
+public:
+    FFileBackupManagerFastCDC() {}
+
+    std::tuple<TOneFileChunkDataTask, TOneFileChunkDataReadFileTick, TOneFileChunkDataPostProcessingTask> GenFolderChunkDataGetNextFileTask(CommonHandle32_t handle, TNewFileChunkDelegate) override;
+    //a cut resets the gear hash, scanning resumes right at a previous boundary
+    std::optional<uint32_t> GetAppendResumeLookBackChunkNum() const override {
+        return 0;
+    }
+
+    void GenFolderChunkDataTask(this FFileBackupManagerFastCDC& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData);
+    //ChunkSizeT is 0 when the manifest chunk size has no specialization
+    template<uint32_t ChunkSizeT>
+    void GenFolderChunkDataTaskImpl(this FFileBackupManagerFastCDC& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData);
+};
@@ -18,76 +18,38 @@
 
 std::tuple<IFileBackupManagerInterface::TOneFileChunkDataTask, IFileBackupManagerInterface::TOneFileChunkDataReadFileTick, IFileBackupManagerInterface::TOneFileChunkDataPostProcessingTask> FFileBackupManagerGatherAll::GenFolderChunkDataGetNextFileTask(CommonHandle32_t handle, TNewFileChunkDelegate NewFileChunkDelegate)
 {
-    auto itr = GenFolderMetaDataWorkDataList.find(handle);
-    if (itr == GenFolderMetaDataWorkDataList.end()) {
-        return { nullptr,nullptr,nullptr };
-    }
-    auto& pFolderWorkData = itr->second;
-    if (pFolderWorkData->Status != EGenFolderMetaDataStatus::Inited) {
-        return { nullptr,nullptr,nullptr };
-    }
-    if (pFolderWorkData->FileItrList.empty()) {
-        return { nullptr,nullptr,nullptr };
-    }
-    auto& fileList = pFolderWorkData->FileItrList.rbegin()->second;
-    auto& fileName = *fileList.begin();
-    auto filesItr = pFolderWorkData->FolderManifest.Files.find(fileName);
-    assert(filesItr != pFolderWorkData->FolderManifest.Files.end());
-    auto& pFileChunksData = filesItr->second;
-
-    if (fileList.size() > 1) {
-        fileList.erase(fileName);
-    }
-    else {
-        pFolderWorkData->FileItrList.erase(--pFolderWorkData->FileItrList.rbegin().base());
-    }
-
-    std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData;
-    {
-        //std::scoped_lock lock(pFolderWorkData->FileTaskMtx);
-        if (pFolderWorkData->FileTaskPool.size() > 0) {
-            pFileTaskData = pFolderWorkData->FileTaskPool.back();
-            pFolderWorkData->FileTaskPool.pop_back();
-            pFileTaskData->Clear();
-        }
-        else {
-            pFileTaskData = std::make_shared<GenFolderChunkDataFileTaskData_t>();
-            pFileTaskData->FileChunkBuf = std::make_shared<FileChunkBuf_t>();;
-            pFileTaskData->ChunkConverter.UpdateConvertDirection(EConvertDirection::ToChunkFile);
-            pFileTaskData->XXH3State = XXH3_createState();
-            if (!pFileTaskData->XXH3State) {
-                return { nullptr,nullptr,nullptr };
-            }
-            pFileTaskData->Clear();
-        }
-        pFileTaskData->FileChunksData = pFileChunksData;
-        auto [itr, res] = pFolderWorkData->FileTasks.try_emplace(ConvertViewToU8View(pFileTaskData->FileChunksData->FileName), pFileTaskData);
-        if (!res) {
-            return { nullptr,nullptr,nullptr };
-        }
-        pFileTaskData->NewFileChunkDelegate = NewFileChunkDelegate;
-
-        pFileTaskData->FileAllHashMap = pFolderWorkData->AllHashMap;
-        std::filesystem::path filePath = ConvertViewToU8View(pFolderWorkData->FileLocalPathMap[ConvertViewToU8View(pFileTaskData->FileChunksData->FileName)]);
-        pFileTaskData->FileStream = std::ifstream(filePath, std::ios::binary);
-        if (!pFileTaskData->FileStream.is_open()) {
-            return { nullptr,nullptr,nullptr };
-        }
-        auto remainder = pFileTaskData->FileChunksData->FileSize % FileChunkSize;
-        pFileTaskData->WaitAppendDataLen = remainder ? FileChunkSize - remainder : 0;
+    auto [pFolderWorkData, pFileTaskData] = AcquireNextFileTaskData(handle, NewFileChunkDelegate, GatherAllSplitRangeChunkNum);
+    if (!pFileTaskData) {
+        return GenFolderChunkDataGetNextPackTask(handle, NewFileChunkDelegate);
     }
     TOneFileChunkDataTask func = std::bind(&FFileBackupManagerGatherAll::GenFolderChunkDataTask, *this, pFolderWorkData, pFileTaskData);
     TOneFileChunkDataPostProcessingTask postfunc = std::bind(&FFileBackupManagerGatherAll::GenFolderChunkDataPostProcessingTask, *this, pFolderWorkData, pFileTaskData);
-    TOneFileChunkDataReadFileTick readFileTick = std::bind(&FFileBackupManagerGatherAll::GenFolderChunkDataReadFileTick, *this, std::placeholders::_1, pFolderWorkData, pFileTaskData);
+    TOneFileChunkDataReadFileTick readFileTick;
+    //the io stage, or the worker of a mapped file, reads it and the caller has nothing to tick
+    if (pFolderWorkData->Params.Options.IOThreadNum == 0 && !pFileTaskData->bMapped) {
+        readFileTick = std::bind(&FFileBackupManagerGatherAll::GenFolderChunkDataReadFileTick, *this, std::placeholders::_1, pFolderWorkData, pFileTaskData);
+    }
     return { func,readFileTick,postfunc };
 }
 
 
 void FFileBackupManagerGatherAll::GenFolderChunkDataTask(this FFileBackupManagerGatherAll& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData)
 {
+    VisitChunkSize(pFolderWorkData->FolderManifest.ChunkSize, [&](auto chunkSizeConst) {
+        VisitWeakHasher(pFolderWorkData->FolderManifest.WeakHashKind, [&](auto& hasher) {
+            self.GenFolderChunkDataTaskImpl<decltype(chunkSizeConst)::value>(pFolderWorkData, pFileTaskData, hasher);
+            });
+        });
+}
+
+template<uint32_t ChunkSizeT, typename THasher>
+void FFileBackupManagerGatherAll::GenFolderChunkDataTaskImpl(this FFileBackupManagerGatherAll& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData, THasher& hasher)
+{
+    constexpr uint32_t weakHashSize = GetWeakHashSize(THasher::Kind);
+    const uint32_t chunkSize = ChunkSizeT ? ChunkSizeT : pFolderWorkData->FolderManifest.ChunkSize;
     typedef struct FileChunkCache_t {
         uint64_t StartPos;
-        uint32_t WeakHash;
+        WeakHash_t WeakHash;
         unsigned char StrongHash[16]{};
         bool fStrongHash;
         bool fChunkAlreadyExist;
@@ -141,52 +103,55 @@ void FFileBackupManagerGatherAll::GenFolderChunkDataTask(this FFileBackupManager
     FileChunkCacheContainer_t fileChunkCacheContainer;
 
     unsigned char output[16];
-    uint64_t lastChunkEndPos{ 0 };
-    std::streamoff consumedBytes{ 0 };
+    //positions are file offsets, a range task starts one window before its range
+    auto& Chunks = pFileTaskData->SplitFile ? pFileTaskData->RangeChunks : pFileTaskData->FileChunksData->Chunks;
+    bool bSkipFirstWindow = pFileTaskData->RangeStart > 0;
+    uint64_t lastChunkEndPos{ pFileTaskData->RangeStart };
+    std::streamoff consumedBytes{ std::streamoff(bSkipFirstWindow ? pFileTaskData->RangeStart - chunkSize : 0) };
     bool bFlushAllChunkCache{ false };
     int bytesAfterLastChunk = 0;
+    //zero bytes just consumed, only counted over whole zero blocks so it may fall short but never over
+    uint32_t zeroRunLen{ 0 };
+    const ZeroChunk_t& zeroChunk = *pFolderWorkData->FindZeroChunk(chunkSize);
 
-    RollingAdler32.Reset();
-    auto& hasher = RollingAdler32;
+    WeakFilterStat_t filterStat;
+    WeakHash_t weakHashes[THasher::MaxBlockLen];
 
-    auto tryCacheFunc = [&]() {
-        auto WeakHash = hasher.Get();
-        bool bWeakExist{ false };
+    auto strongHashFunc = [&](const char* rawData) {
+        return zeroRunLen >= chunkSize ? zeroChunk.Hash : XXH3_128bits(rawData, chunkSize);
+        };
+    auto tryCacheFunc = [&](WeakHash_t WeakHash, bool bWeakExist) {
         bool bStrongExist{ false };
-        auto hashItr = pFileTaskData->FileAllHashMap.find(WeakHash);
         char* rawData;
-        if (hashItr != pFileTaskData->FileAllHashMap.end()) {
-            bWeakExist = true;
-            rawData = FileChunkBuf.GetContinuousConsumedBuf(0, FileChunkSize);
-            auto hash = XXH3_128bits(rawData, FileChunkSize);
+        XXH128_hash_t hash;
+        if (bWeakExist) {
+            rawData = FileChunkBuf.GetContinuousConsumedBuf(0, chunkSize);
+            hash = strongHashFunc(rawData);
             CopyxxHashToBuf(hash, output);
-            auto stronHashItr = hashItr->second.find(std::string_view((char*)output, sizeof(output)));
-            if (stronHashItr != hashItr->second.end()) {
-                bStrongExist = true;
-            }
+            bStrongExist = pFolderWorkData->ChunkIndex.Contains(ChunkKey_t{ WeakHash, hash });
         }
 
-        if (bytesAfterLastChunk >= FileChunkSize) {
-            assert(bytesAfterLastChunk == FileChunkSize);
+        if (bytesAfterLastChunk >= chunkSize) {
+            assert(bytesAfterLastChunk == chunkSize);
             if (!bWeakExist) {
-                rawData = FileChunkBuf.GetContinuousConsumedBuf(0, FileChunkSize);
-                auto hash = XXH3_128bits(FileChunkBuf.GetContinuousConsumedBuf(0, FileChunkSize), FileChunkSize);
+                rawData = FileChunkBuf.GetContinuousConsumedBuf(0, chunkSize);
+                hash = strongHashFunc(rawData);
                 CopyxxHashToBuf(hash, output);
             }
             auto pChunkData = std::make_shared<FileChunkData_t>();
             auto& ChunkData = *pChunkData;
-            ChunkData.StartPos = uint64_t(consumedBytes - FileChunkSize);
-            to_upper_hex(ChunkData.HexName, (uint8_t*)&WeakHash, sizeof(WeakHash));
-            to_upper_hex(ChunkData.HexName + bin_to_hex_length(sizeof(WeakHash_t)), output, sizeof(output));
-            ChunkData.HexName[bin_to_hex_length(sizeof(WeakHash_t)) + bin_to_hex_length(sizeof(output))] = 0;
-            pFileTaskData->FileChunksData->Chunks.emplace(pChunkData);
+            ChunkData.StartPos = uint64_t(consumedBytes - chunkSize);
+            ChunkData.Size = chunkSize;
+            auto hexNameLen = WriteHexName(ChunkData.HexName, WeakHash, weakHashSize, output);
+            Chunks.emplace(pChunkData);
 
-            if (!bStrongExist) {
+            //the same new content in another file is stored by whichever task claims it first
+            if (!bStrongExist && pFolderWorkData->ChunkIndex.TryClaim(ChunkKey_t{ WeakHash, hash })) {
                 if (!pFolderWorkData->bRequestExit) {
-                    pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)ChunkData.HexName, bin_to_hex_length(sizeof(WeakHash_t)) + bin_to_hex_length(sizeof(output)) }, { (const char*)rawData, FileChunkSize });
+                    pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)ChunkData.HexName, hexNameLen }, { (const char*)rawData, chunkSize });
                 }
             }
-            pFolderWorkData->CompleteSize.fetch_add(consumedBytes>pFileTaskData->FileChunksData->FileSize? pFileTaskData->FileChunksData->FileSize- lastChunkEndPos : FileChunkSize);
+            pFolderWorkData->CompleteSize.fetch_add(chunkSize);
 
             bytesAfterLastChunk = 0;
             lastChunkEndPos = consumedBytes;
@@ -196,25 +161,62 @@ void FFileBackupManagerGatherAll::GenFolderChunkDataTask(this FFileBackupManager
                 if (bStrongExist) {
                     auto pChunkData = std::make_shared<FileChunkData_t>();
                     auto& ChunkData = *pChunkData;
-                    ChunkData.StartPos = uint64_t(consumedBytes - FileChunkSize);
-                    to_upper_hex(ChunkData.HexName, (uint8_t*)&WeakHash, sizeof(WeakHash));
-                    to_upper_hex(ChunkData.HexName + bin_to_hex_length(sizeof(WeakHash_t)), output, sizeof(output));
-                    ChunkData.HexName[bin_to_hex_length(sizeof(WeakHash_t)) + bin_to_hex_length(sizeof(output))] = 0;
-                    pFileTaskData->FileChunksData->Chunks.emplace(pChunkData);
+                    ChunkData.StartPos = uint64_t(consumedBytes - chunkSize);
+                    ChunkData.Size = chunkSize;
+                    WriteHexName(ChunkData.HexName, WeakHash, weakHashSize, output);
+                    Chunks.emplace(pChunkData);
                 }
             }
         }
         };
+    //bytes after the last grid chunk form a chunk of their real size
+    auto cutTailFunc = [&]() {
+        auto tailLen = uint32_t(consumedBytes - lastChunkEndPos);
+        auto rawData = FileChunkBuf.GetContinuousConsumedBuf(0, tailLen);
+        WeakHash_t WeakHash = THasher::Hash((const uint8_t*)rawData, tailLen);
+        auto hash = XXH3_128bits(rawData, tailLen);
+        CopyxxHashToBuf(hash, output);
+        bool bStrongExist = pFolderWorkData->ChunkIndex.ContainsWeak(WeakHash, filterStat) && pFolderWorkData->ChunkIndex.Contains(ChunkKey_t{ WeakHash, hash });
+
+        auto pChunkData = std::make_shared<FileChunkData_t>();
+        auto& ChunkData = *pChunkData;
+        ChunkData.StartPos = lastChunkEndPos;
+        ChunkData.Size = tailLen;
+        auto hexNameLen = WriteHexName(ChunkData.HexName, WeakHash, weakHashSize, output);
+        Chunks.emplace(pChunkData);
+        if (!bStrongExist && pFolderWorkData->ChunkIndex.TryClaim(ChunkKey_t{ WeakHash, hash })) {
+            if (!pFolderWorkData->bRequestExit) {
+                pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)ChunkData.HexName, hexNameLen }, { (const char*)rawData, tailLen });
+            }
+        }
+        pFolderWorkData->CompleteSize.fetch_add(tailLen);
+        lastChunkEndPos = consumedBytes;
+        };
 
 
     while (true) {
         if (pFolderWorkData->bRequestExit) {
             break;
         }
+        GenFolderChunkDataPumpMappedFile(*pFileTaskData);
         if (pFileTaskData->bEOF) {
-            if (FileChunkBuf.ContentSize.load() == 0) {
-                assert(consumedBytes >= pFileTaskData->FileChunksData->FileSize);
-                assert((pFileTaskData->FileChunksData->FileSize > 0 && pFileTaskData->FileChunksData->Chunks.size() > 0) || pFileTaskData->FileChunksData->FileSize == 0);
+            auto contentSize = FileChunkBuf.ContentSize.load();
+            //the file got shorter while it was read, post processing fails the folder instead of keeping a short entry
+            if (uint64_t(consumedBytes) + contentSize < (pFileTaskData->SplitFile ? pFileTaskData->RangeEnd : pFileTaskData->FileChunksData->FileSize)) {
+                pFileTaskData->bShortRead = true;
+                break;
+            }
+            if (!hasher.IsInited() && contentSize > 0 && contentSize < chunkSize) {
+                //file shorter than a chunk never fills a window
+                consumedBytes += contentSize;
+                FileChunkBuf.EatSize(contentSize);
+                contentSize = 0;
+            }
+            if (contentSize == 0) {
+                if (uint64_t(consumedBytes) > lastChunkEndPos) {
+                    cutTailFunc();
+                }
+                assert((pFileTaskData->FileChunksData->FileSize > 0 && Chunks.size() > 0) || pFileTaskData->FileChunksData->FileSize == 0);
                 break;
             }
         }
@@ -222,29 +224,68 @@ void FFileBackupManagerGatherAll::GenFolderChunkDataTask(this FFileBackupManager
         //lock.lock();
         auto contentBuf = FileChunkBuf.GetContentBuf();
         //lock.unlock();
+        if (contentBuf.size() < (hasher.IsInited() ? 1 : chunkSize)) {
+            //nothing to scan yet, sleep until the reader fills the ring up to its watermark or ends the file
+            FileChunkBuf.WaitContent(pFileTaskData->bEOF, pFolderWorkData->bRequestExit);
+            continue;
+        }
         if (hasher.IsInited()) {
-            int i = 0;
-            for (; i < contentBuf.size() && !bFlushAllChunkCache; i++) {
-                auto [ConsumedBufL, ConsumedBufR] = FileChunkBuf.GetConsumedBuf(0, FileChunkSize);
-                auto inBytePtr = contentBuf.data() + i;
-                consumedBytes++;
-                bytesAfterLastChunk++;
-                FileChunkBuf.EatSize(1);
-                hasher.Roll(*inBytePtr, *ConsumedBufL.data());
-                tryCacheFunc();
+            size_t i = 0;
+            while (i < contentBuf.size() && !bFlushAllChunkCache) {
+                //a whole zero chunk on the grid is cut without rolling or hashing
+                bool bZeroSkipped{ false };
+                while (bytesAfterLastChunk == 0 && contentBuf.size() - i >= chunkSize && IsZeroBuf(contentBuf.data() + i, chunkSize)) {
+                    consumedBytes += chunkSize;
+                    bytesAfterLastChunk = chunkSize;
+                    zeroRunLen = chunkSize;
+                    FileChunkBuf.EatSize(chunkSize);
+                    i += chunkSize;
+                    tryCacheFunc(zeroChunk.WeakHash, pFolderWorkData->ChunkIndex.ContainsWeak(zeroChunk.WeakHash, filterStat));
+                    bZeroSkipped = true;
+                }
+                if (bZeroSkipped) {
+                    hasher.Init((const uint8_t*)FileChunkBuf.GetContinuousConsumedBuf(0, chunkSize), chunkSize);
+                    continue;
+                }
+                auto consumedBuf = FileChunkBuf.GetConsumedBuf(0, chunkSize);
+                //blocks stop at the grid so the zero check above sees every cut
+                auto blockLen = uint32_t(std::min<size_t>({ contentBuf.size() - i, THasher::MaxBlockLen, size_t(chunkSize - bytesAfterLastChunk) }));
+                hasher.RollBlock((const uint8_t*)contentBuf.data() + i, (const uint8_t*)consumedBuf.data(), blockLen, weakHashes);
+                auto mayExistMask = pFolderWorkData->ChunkIndex.MayContainWeakBlock(weakHashes, blockLen, filterStat);
+                bool bZeroBlock = IsZeroBuf(contentBuf.data() + i, blockLen);
+                for (uint32_t j = 0; j < blockLen; j++, i++) {
+                    consumedBytes++;
+                    bytesAfterLastChunk++;
+                    zeroRunLen = bZeroBlock ? std::min(zeroRunLen + 1, chunkSize) : 0;
+                    FileChunkBuf.EatSize(1);
+                    tryCacheFunc(weakHashes[j], ((mayExistMask >> j) & 1) && pFolderWorkData->ChunkIndex.ContainsWeakPassed(weakHashes[j], filterStat));
+                }
             }
             assert(!(bFlushAllChunkCache && i < contentBuf.size()));
         }
-        else if (contentBuf.size() >= FileChunkSize) {
-            hasher.Init((const uint8_t*)contentBuf.data(), FileChunkSize);
+        else if (contentBuf.size() >= chunkSize) {
+            zeroRunLen = IsZeroBuf(contentBuf.data(), chunkSize) ? chunkSize : 0;
+            hasher.Init((const uint8_t*)contentBuf.data(), chunkSize);
             auto WeakHash = hasher.Get();
-            consumedBytes += FileChunkSize;
-            bytesAfterLastChunk += FileChunkSize;
-            FileChunkBuf.EatSize(FileChunkSize);
-            tryCacheFunc();
+            consumedBytes += chunkSize;
+            bytesAfterLastChunk += chunkSize;
+            FileChunkBuf.EatSize(chunkSize);
+            if (bSkipFirstWindow) {
+                //RangeStart is on the grid, continue as if previous range just cut there
+                bytesAfterLastChunk = 0;
+            }
+            else {
+                tryCacheFunc(WeakHash, pFolderWorkData->ChunkIndex.ContainsWeak(WeakHash, filterStat));
+            }
         }
     }
+    pFolderWorkData->AddWeakFilterStat(filterStat);
     auto xxhash = XXH3_128bits_digest(pFileTaskData->XXH3State);
+    if (pFileTaskData->SplitFile) {
+        //file hash is finished in post processing once all ranges are done
+        pFileTaskData->SplitFile->RangeDigests[pFileTaskData->RangeIndex] = xxhash;
+        return;
+    }
     CopyxxHashToBuf(xxhash, output);
     to_upper_hex(pFolderWorkData->FolderManifest.Files[ConvertViewToU8View(pFileTaskData->FileChunksData->FileName)]->FileHash, output, sizeof(output));
 
@@ -2,11 +2,21 @@
 #include "FileBackupManagerBase.h"
 #include "FileBackupInternal.h"
 
+//files larger than two ranges are scanned by several tasks, grid chunks never cross a range so the merged result matches a single scan
+constexpr uint32_t GatherAllSplitRangeChunkNum = 64;
+
 class FFileBackupManagerGatherAll :public IFileBackupManagerBase {
 public:
     FFileBackupManagerGatherAll() {}
 
     std::tuple<TOneFileChunkDataTask, TOneFileChunkDataReadFileTick, TOneFileChunkDataPostProcessingTask> GenFolderChunkDataGetNextFileTask(CommonHandle32_t handle, TNewFileChunkDelegate) override;
+    //the grid chunk before the resume point only seeds the rolling hash, like the first window of a range
+    std::optional<uint32_t> GetAppendResumeLookBackChunkNum() const override {
+        return 1;
+    }
 
     void GenFolderChunkDataTask(this FFileBackupManagerGatherAll& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData);
+    //ChunkSizeT is 0 when the manifest chunk size has no specialization
+    template<uint32_t ChunkSizeT, typename THasher>
+    void GenFolderChunkDataTaskImpl(this FFileBackupManagerGatherAll& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData, THasher& hasher);
 };
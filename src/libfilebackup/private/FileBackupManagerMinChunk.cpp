@@ -17,73 +17,37 @@
 
 std::tuple<IFileBackupManagerInterface::TOneFileChunkDataTask, IFileBackupManagerInterface::TOneFileChunkDataReadFileTick, IFileBackupManagerInterface::TOneFileChunkDataPostProcessingTask> FFileBackupManagerMinChunk::GenFolderChunkDataGetNextFileTask(CommonHandle32_t handle, TNewFileChunkDelegate NewFileChunkDelegate)
 {
-    auto itr = GenFolderMetaDataWorkDataList.find(handle);
-    if (itr == GenFolderMetaDataWorkDataList.end()) {
-        return { nullptr,nullptr,nullptr };
-    }
-    auto& pFolderWorkData = itr->second;
-    if (pFolderWorkData->Status != EGenFolderMetaDataStatus::Inited) {
-        return { nullptr,nullptr,nullptr };
-    }
-    if (pFolderWorkData->FileItrList.empty()) {
-        return { nullptr,nullptr,nullptr };
-    }
-    auto& fileList = pFolderWorkData->FileItrList.rbegin()->second;
-    auto& fileName = *fileList.begin();
-    auto filesItr = pFolderWorkData->FolderManifest.Files.find(fileName);
-    assert(filesItr != pFolderWorkData->FolderManifest.Files.end());
-    auto& pFileChunksData = filesItr->second;
-
-    if (fileList.size() > 1) {
-        fileList.erase(fileName);
-    }
-    else {
-        pFolderWorkData->FileItrList.erase(--pFolderWorkData->FileItrList.rbegin().base());
-    }
-
-    std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData;
-    {
-        //std::scoped_lock lock(pFolderWorkData->FileTaskMtx);
-        if (pFolderWorkData->FileTaskPool.size() > 0) {
-            pFileTaskData = pFolderWorkData->FileTaskPool.back();
-            pFolderWorkData->FileTaskPool.pop_back();
-            pFileTaskData->Clear();
-        }
-        else {
-            pFileTaskData = std::make_shared<GenFolderChunkDataFileTaskData_t>();
-            pFileTaskData->FileChunkBuf = std::make_shared<FileChunkBuf_t>();;
-            pFileTaskData->ChunkConverter.UpdateConvertDirection(EConvertDirection::ToChunkFile);
-            pFileTaskData->XXH3State = XXH3_createState();
-            if (!pFileTaskData->XXH3State) {
-                return { nullptr,nullptr,nullptr };
-            }
-        }
-        pFileTaskData->FileChunksData = pFileChunksData;
-        auto [itr, res] = pFolderWorkData->FileTasks.try_emplace(ConvertViewToU8View(pFileTaskData->FileChunksData->FileName), pFileTaskData);
-        if (!res) {
-            return { nullptr,nullptr,nullptr };
-        }
-        pFileTaskData->NewFileChunkDelegate = NewFileChunkDelegate;
-
-        pFileTaskData->FileAllHashMap = pFolderWorkData->AllHashMap;
-        std::filesystem::path filePath = ConvertViewToU8View(pFolderWorkData->FileLocalPathMap[ConvertViewToU8View(pFileTaskData->FileChunksData->FileName)]);
-        pFileTaskData->FileStream = std::ifstream(filePath, std::ios::binary);
-        if (!pFileTaskData->FileStream.is_open()) {
-            return { nullptr,nullptr,nullptr };
-        }
-        pFileTaskData->WaitAppendDataLen = pFileTaskData->FileChunksData->FileSize > FileChunkSize ? 0 : (FileChunkSize - pFileTaskData->FileChunksData->FileSize % FileChunkSize) % FileChunkSize;
+    auto [pFolderWorkData, pFileTaskData] = AcquireNextFileTaskData(handle, NewFileChunkDelegate);
+    if (!pFileTaskData) {
+        return GenFolderChunkDataGetNextPackTask(handle, NewFileChunkDelegate);
     }
     TOneFileChunkDataTask func = std::bind(&FFileBackupManagerMinChunk::GenFolderChunkDataTask, *this, pFolderWorkData, pFileTaskData);
     TOneFileChunkDataPostProcessingTask postfunc = std::bind(&FFileBackupManagerMinChunk::GenFolderChunkDataPostProcessingTask, *this, pFolderWorkData, pFileTaskData);
-    TOneFileChunkDataReadFileTick readFileTick = std::bind(&FFileBackupManagerMinChunk::GenFolderChunkDataReadFileTick, *this, std::placeholders::_1, pFolderWorkData, pFileTaskData);
+    TOneFileChunkDataReadFileTick readFileTick;
+    //the io stage, or the worker of a mapped file, reads it and the caller has nothing to tick
+    if (pFolderWorkData->Params.Options.IOThreadNum == 0 && !pFileTaskData->bMapped) {
+        readFileTick = std::bind(&FFileBackupManagerMinChunk::GenFolderChunkDataReadFileTick, *this, std::placeholders::_1, pFolderWorkData, pFileTaskData);
+    }
     return { func,readFileTick,postfunc };
 }
 
 void FFileBackupManagerMinChunk::GenFolderChunkDataTask(this FFileBackupManagerMinChunk& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData)
 {
+    VisitChunkSize(pFolderWorkData->FolderManifest.ChunkSize, [&](auto chunkSizeConst) {
+        VisitWeakHasher(pFolderWorkData->FolderManifest.WeakHashKind, [&](auto& hasher) {
+            self.GenFolderChunkDataTaskImpl<decltype(chunkSizeConst)::value>(pFolderWorkData, pFileTaskData, hasher);
+            });
+        });
+}
+
+template<uint32_t ChunkSizeT, typename THasher>
+void FFileBackupManagerMinChunk::GenFolderChunkDataTaskImpl(this FFileBackupManagerMinChunk& self, std::shared_ptr<GenFolderChunkDataWorkData_t> pFolderWorkData, std::shared_ptr< GenFolderChunkDataFileTaskData_t> pFileTaskData, THasher& hasher)
+{
+    constexpr uint32_t weakHashSize = GetWeakHashSize(THasher::Kind);
+    const uint32_t chunkSize = ChunkSizeT ? ChunkSizeT : pFolderWorkData->FolderManifest.ChunkSize;
     typedef struct FileChunkCache_t {
         uint64_t StartPos;
-        uint32_t WeakHash;
+        WeakHash_t WeakHash;
         unsigned char StrongHash[16]{};
         bool fStrongHash;
         bool fChunkAlreadyExist;
@@ -141,31 +105,33 @@ void FFileBackupManagerMinChunk::GenFolderChunkDataTask(this FFileBackupManagerM
     std::streamoff consumedBytes{ 0 };
     bool bFlushAllChunkCache{ false };
     int bytesAfterLastChunk = 0;
+    //zero bytes just consumed, only counted over whole zero blocks so it may fall short but never over
+    uint32_t zeroRunLen{ 0 };
+    const ZeroChunk_t& zeroChunk = *pFolderWorkData->FindZeroChunk(chunkSize);
 
-    RollingAdler32.Reset();
-    auto& hasher = RollingAdler32;
+    WeakFilterStat_t filterStat;
+    WeakHash_t weakHashes[THasher::MaxBlockLen];
 
     auto internalCaculateHashInConsumedBuf = [&](const char* content, uint32_t reverseStart, unsigned char out[16]) {
-        auto hash = XXH3_128bits(content, FileChunkSize);
+        auto hash = XXH3_128bits(content, chunkSize);
         CopyxxHashToBuf(hash, out);
         };
     auto caculateHashInConsumedBuf = [&](uint32_t reverseStart, unsigned char out[16]) {
-        internalCaculateHashInConsumedBuf(FileChunkBuf.GetContinuousConsumedBuf(reverseStart, FileChunkSize), reverseStart, out);
+        internalCaculateHashInConsumedBuf(FileChunkBuf.GetContinuousConsumedBuf(reverseStart, chunkSize), reverseStart, out);
         };
     auto caculateAllHashInConsumedBuf = [&](uint32_t reverseStart, WeakHash_t& weakHash, unsigned char out[16]) {
-        FRollingAdler32 hasher2;
-        auto rawData = FileChunkBuf.GetContinuousConsumedBuf(reverseStart, FileChunkSize);
+        auto rawData = FileChunkBuf.GetContinuousConsumedBuf(reverseStart, chunkSize);
         internalCaculateHashInConsumedBuf(rawData, reverseStart, out);
-        weakHash = hasher2.Get();
+        weakHash = THasher::Hash((const uint8_t*)rawData, chunkSize);
         };
 
     auto processChunkChacheFunc = [&]() {
         while (!fileChunkCacheContainer.empty()) {
             auto& pChunkCache = fileChunkCacheContainer.front();
             auto& chunkCache = *pChunkCache;
-            auto ChunkEndPos = chunkCache.StartPos + FileChunkSize;
+            auto ChunkEndPos = chunkCache.StartPos + chunkSize;
             if (!bFlushAllChunkCache) {
-                if (consumedBytes - chunkCache.StartPos < FileChunkSize * 3) {
+                if (consumedBytes - chunkCache.StartPos < chunkSize * 3) {
                     return;
                 }
             }
@@ -177,41 +143,34 @@ void FFileBackupManagerMinChunk::GenFolderChunkDataTask(this FFileBackupManagerM
             fileChunkCacheContainer.pop_front();
             char* rawData;
             if (!chunkCache.fChunkAlreadyExist) {
-                rawData = FileChunkBuf.GetContinuousConsumedBuf(consumedBytes - chunkCache.StartPos - FileChunkSize, FileChunkSize);
+                rawData = FileChunkBuf.GetContinuousConsumedBuf(consumedBytes - chunkCache.StartPos - chunkSize, chunkSize);
                 if (!chunkCache.fStrongHash) {
-                    auto hash = XXH3_128bits(rawData, FileChunkSize);
+                    auto hash = XXH3_128bits(rawData, chunkSize);
                     CopyxxHashToBuf(hash, chunkCache.StrongHash);
                 }
-                auto strongHashStr = std::string((const char*)chunkCache.StrongHash);
-                {
-                    auto itr = pFileTaskData->FileAllHashMap.find(*(WeakHash_t*)&chunkCache.WeakHash);
-                    if (itr == pFileTaskData->FileAllHashMap.end()) {
-                        pFileTaskData->FileAllHashMap.try_emplace(*(WeakHash_t*)&chunkCache.WeakHash, HashSetType{ strongHashStr });
-                    }
-                    else {
-                        itr->second.insert(strongHashStr);
-                    }
+                //another task may have added the same content since this one looked it up, only the first stores it
+                if (!pFolderWorkData->ChunkIndex.Insert(ChunkKey_t::FromCanonical(chunkCache.WeakHash, chunkCache.StrongHash))) {
+                    chunkCache.fChunkAlreadyExist = true;
                 }
             }
             auto pChunkData = std::make_shared<FileChunkData_t>();
             auto& ChunkData = *pChunkData;
             ChunkData.StartPos = chunkCache.StartPos;
-            to_upper_hex(ChunkData.HexName, (uint8_t*)&chunkCache.WeakHash, sizeof(chunkCache.WeakHash));
-            to_upper_hex(ChunkData.HexName + sizeof(WeakHash_t) * 2, chunkCache.StrongHash, sizeof(chunkCache.StrongHash));
-            ChunkData.HexName[sizeof(WeakHash_t) * 2 + sizeof(chunkCache.StrongHash) * 2] = 0;
+            ChunkData.Size = chunkSize;
+            auto hexNameLen = WriteHexName(ChunkData.HexName, chunkCache.WeakHash, weakHashSize, chunkCache.StrongHash);
             pFileTaskData->FileChunksData->Chunks.emplace(pChunkData);
             if (!chunkCache.fChunkAlreadyExist) {
                 if (!pFolderWorkData->bRequestExit) {
-                    pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)ChunkData.HexName, uint32_t(sizeof(chunkCache.WeakHash) * 2 + sizeof(chunkCache.StrongHash) * 2) }, { (const char*)rawData, FileChunkSize });
+                    pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)ChunkData.HexName, hexNameLen }, { (const char*)rawData, chunkSize });
                 }
             }
 
         }
         };
-    auto internalCacheNewFunc = [&](std::streamoff posEnd, uint32_t weakhash, const unsigned char stronghash[16] = nullptr, bool fExist = false) {
+    auto internalCacheNewFunc = [&](std::streamoff posEnd, WeakHash_t weakhash, const unsigned char stronghash[16] = nullptr, bool fExist = false) {
         auto pChunkCache = fileChunkCacheContainer.get_available();
         pChunkCache->fChunkAlreadyExist = fExist;
-        pChunkCache->StartPos = uint64_t(posEnd - FileChunkSize);
+        pChunkCache->StartPos = uint64_t(posEnd - chunkSize);
         pChunkCache->WeakHash = weakhash;
         pChunkCache->fStrongHash = !!stronghash;
         if (pChunkCache->fStrongHash)
@@ -220,20 +179,20 @@ void FFileBackupManagerMinChunk::GenFolderChunkDataTask(this FFileBackupManagerM
         bytesAfterLastChunk = 0;
         };
     ///
-    /// @detail 1.保证块n不会跟块n+2重叠 2.保证块n距离块n+3大于FileChunkSize
+    /// @detail 1.保证块n不会跟块n+2重叠 2.保证块n距离块n+3大于chunkSize
     /// 当缓存已有两个块，如果新加入的块3仍旧与块1重叠，则块3取代块2
     /// 当缓存已有三个块，如果新加入的块4仍旧与块2重叠，则块4取代块3
     /// 当缓存已有三个块，块4成为第三个块，重新生成位于块4前与之不重叠的块作为第二个块
     /// 空间利用率最差时，每块有2/3的冗余数据
     /// 
-    auto cacheNewFunc = [&](uint32_t weakhash, const unsigned char stronghash[16] = nullptr, bool fExist = false) {
-        assert(bytesAfterLastChunk <= FileChunkSize);
+    auto cacheNewFunc = [&](WeakHash_t weakhash, const unsigned char stronghash[16] = nullptr, bool fExist = false) {
+        assert(bytesAfterLastChunk <= chunkSize);
         bFlushAllChunkCache = consumedBytes >= pFileTaskData->FileChunksData->FileSize;
         if (fExist || bFlushAllChunkCache) {
             switch (fileChunkCacheContainer.size()) {
             case 2: {
                 auto& firstCache = fileChunkCacheContainer.front();
-                if (firstCache->StartPos + FileChunkSize * 2 >= consumedBytes) {
+                if (firstCache->StartPos + chunkSize * 2 >= consumedBytes) {
                     fileChunkCacheContainer.pop_back();
                 }
                 internalCacheNewFunc(consumedBytes, weakhash, stronghash, fExist);
@@ -242,24 +201,20 @@ void FFileBackupManagerMinChunk::GenFolderChunkDataTask(this FFileBackupManagerM
             case 3: {
                 auto& firstCache = fileChunkCacheContainer.front();
                 auto& secondeCache = *(fileChunkCacheContainer.begin()++);
-                if (secondeCache->StartPos + FileChunkSize * 2 >= consumedBytes) {
+                if (secondeCache->StartPos + chunkSize * 2 >= consumedBytes) {
                     fileChunkCacheContainer.pop_back();
                 }
                 else {
                     fileChunkCacheContainer.pop_back();
                     fileChunkCacheContainer.pop_back();
                     WeakHash_t weakHash;
-                    auto endPos = firstCache->StartPos + FileChunkSize * 2;
+                    auto endPos = firstCache->StartPos + chunkSize * 2;
                     caculateAllHashInConsumedBuf(uint32_t(consumedBytes - endPos), weakHash, output);
                     bool bWeakExist{ false };
                     bool bStrongExist{ false };
-                    auto hashItr = pFileTaskData->FileAllHashMap.find(hasher.Get());
-                    if (hashItr != pFileTaskData->FileAllHashMap.end()) {
+                    if (pFolderWorkData->ChunkIndex.ContainsWeak(weakHash, filterStat)) {
                         bWeakExist = true;
-                        auto stronHashItr = hashItr->second.find(std::string((const char*)output));
-                        if (stronHashItr != hashItr->second.end()) {
-                            bStrongExist = true;
-                        }
+                        bStrongExist = pFolderWorkData->ChunkIndex.Contains(ChunkKey_t::FromCanonical(weakHash, output));
                     }
                     if (bStrongExist) {
                         internalCacheNewFunc(endPos, weakHash, output, true);
@@ -276,17 +231,68 @@ void FFileBackupManagerMinChunk::GenFolderChunkDataTask(this FFileBackupManagerM
             }
             }
         }
-        else if (bytesAfterLastChunk == FileChunkSize) {
+        else if (bytesAfterLastChunk == chunkSize) {
             internalCacheNewFunc(consumedBytes, weakhash, stronghash, fExist);
         }
         processChunkChacheFunc();
         };
+    auto probeFunc = [&](WeakHash_t weakHash, bool bWeakExist) {
+        bool bStrongExist{ false };
+        if (bWeakExist) {
+            //a zero window matches the zero chunk on every byte, its hash is known
+            if (zeroRunLen >= chunkSize) {
+                CopyxxHashToBuf(zeroChunk.Hash, output);
+            }
+            else {
+                caculateHashInConsumedBuf(0, output);
+            }
+            bStrongExist = pFolderWorkData->ChunkIndex.Contains(ChunkKey_t::FromCanonical(weakHash, output));
+            cacheNewFunc(weakHash, output, bStrongExist);
+        }
+        else {
+            cacheNewFunc(weakHash);
+        }
+        };
+    //a file shorter than a chunk is one chunk of its real size
+    auto cutSmallFileFunc = [&](uint32_t len) {
+        auto rawData = FileChunkBuf.GetContinuousConsumedBuf(0, len);
+        WeakHash_t weakHash = THasher::Hash((const uint8_t*)rawData, len);
+        auto hash = XXH3_128bits(rawData, len);
+        CopyxxHashToBuf(hash, output);
+        bool bStrongExist = !pFolderWorkData->ChunkIndex.Insert(ChunkKey_t{ weakHash, hash });
+
+        auto pChunkData = std::make_shared<FileChunkData_t>();
+        auto& ChunkData = *pChunkData;
+        ChunkData.StartPos = 0;
+        ChunkData.Size = len;
+        auto hexNameLen = WriteHexName(ChunkData.HexName, weakHash, weakHashSize, output);
+        pFileTaskData->FileChunksData->Chunks.emplace(pChunkData);
+        if (!bStrongExist) {
+            if (!pFolderWorkData->bRequestExit) {
+                pFileTaskData->NewFileChunkDelegate(&pFileTaskData->ChunkConverter, { (const char8_t*)ChunkData.HexName, hexNameLen }, { (const char*)rawData, len });
+            }
+        }
+        pFolderWorkData->CompleteSize += len;
+        };
     while (true) {
         if (pFolderWorkData->bRequestExit) {
             break;
         }
+        GenFolderChunkDataPumpMappedFile(*pFileTaskData);
         if (pFileTaskData->bEOF) {
-            if (FileChunkBuf.ContentSize.load() == 0) {
+            auto contentSize = FileChunkBuf.ContentSize.load();
+            //the file got shorter while it was read, post processing fails the folder instead of keeping a short entry
+            if (uint64_t(consumedBytes) + contentSize < pFileTaskData->FileChunksData->FileSize) {
+                pFileTaskData->bShortRead = true;
+                break;
+            }
+            if (!hasher.IsInited() && contentSize > 0 && contentSize < chunkSize) {
+                consumedBytes += contentSize;
+                FileChunkBuf.EatSize(contentSize);
+                cutSmallFileFunc(contentSize);
+                contentSize = 0;
+            }
+            if (contentSize == 0) {
                 assert((pFileTaskData->FileChunksData->FileSize > 0 && pFileTaskData->FileChunksData->Chunks.size() > 0) || pFileTaskData->FileChunksData->FileSize == 0);
                 break;
             }
@@ -295,63 +301,48 @@ void FFileBackupManagerMinChunk::GenFolderChunkDataTask(this FFileBackupManagerM
         //lock.lock();
         auto contentBuf = FileChunkBuf.GetContentBuf();
         //lock.unlock();
+        if (contentBuf.size() < (hasher.IsInited() ? 1 : chunkSize)) {
+            //nothing to scan yet, sleep until the reader fills the ring up to its watermark or ends the file
+            FileChunkBuf.WaitContent(pFileTaskData->bEOF, pFolderWorkData->bRequestExit);
+            continue;
+        }
 
 
-        int i = 0;
-        for (; i < contentBuf.size() && !bFlushAllChunkCache; ) {
+        size_t i = 0;
+        while (i < contentBuf.size() && !bFlushAllChunkCache) {
             if (!hasher.IsInited()) {
-                if (contentBuf.size() >= FileChunkSize) {
-                    hasher.Init((const uint8_t*)contentBuf.data(), FileChunkSize);
-                    consumedBytes += FileChunkSize;
-                    bytesAfterLastChunk += FileChunkSize;
-                    i += FileChunkSize;
-                    FileChunkBuf.EatSize(FileChunkSize);
-                }
-                else {
+                if (contentBuf.size() < chunkSize) {
                     break;
                 }
+                zeroRunLen = IsZeroBuf(contentBuf.data(), chunkSize) ? chunkSize : 0;
+                hasher.Init((const uint8_t*)contentBuf.data(), chunkSize);
+                consumedBytes += chunkSize;
+                bytesAfterLastChunk += chunkSize;
+                i += chunkSize;
+                FileChunkBuf.EatSize(chunkSize);
+                auto weakHash = hasher.Get();
+                probeFunc(weakHash, pFolderWorkData->ChunkIndex.ContainsWeak(weakHash, filterStat));
+                continue;
             }
-            else {
-                auto [ConsumedBufL, ConsumedBufR] = FileChunkBuf.GetConsumedBuf(0, FileChunkSize);
-                auto inBytePtr = contentBuf.data() + i;
+            auto consumedBuf = FileChunkBuf.GetConsumedBuf(0, chunkSize);
+            auto blockLen = uint32_t(std::min<size_t>({ contentBuf.size() - i, THasher::MaxBlockLen }));
+            hasher.RollBlock((const uint8_t*)contentBuf.data() + i, (const uint8_t*)consumedBuf.data(), blockLen, weakHashes);
+            auto mayExistMask = pFolderWorkData->ChunkIndex.MayContainWeakBlock(weakHashes, blockLen, filterStat);
+            bool bZeroBlock = IsZeroBuf(contentBuf.data() + i, blockLen);
+            for (uint32_t j = 0; j < blockLen && !bFlushAllChunkCache; j++, i++) {
                 consumedBytes++;
                 bytesAfterLastChunk++;
+                zeroRunLen = bZeroBlock ? std::min(zeroRunLen + 1, chunkSize) : 0;
                 FileChunkBuf.EatSize(1);
-                hasher.Roll(*ConsumedBufL.data(), *inBytePtr);
-                i++;
+                probeFunc(weakHashes[j], ((mayExistMask >> j) & 1) && pFolderWorkData->ChunkIndex.ContainsWeakPassed(weakHashes[j], filterStat));
             }
-
-
-            bool bWeakExist{ false };
-            bool bStrongExist{ false };
-            auto hashItr = pFileTaskData->FileAllHashMap.find(hasher.Get());
-            if (hashItr != pFileTaskData->FileAllHashMap.end()) {
-                bWeakExist = true;
-                caculateHashInConsumedBuf(0, output);
-                auto stronHashItr = hashItr->second.find(std::string((const char*)output));
-                if (stronHashItr != hashItr->second.end()) {
-                    bStrongExist = true;
-                }
-            }
-
-            if (bWeakExist) {
-                if (bStrongExist) {
-                    cacheNewFunc(hasher.Get(), output, true);
-                }
-                else {
-                    cacheNewFunc(hasher.Get(), output);
-                }
-            }
-            else {
-                cacheNewFunc(hasher.Get());
-            }
-
         }
         assert(!(bFlushAllChunkCache && i < contentBuf.size()));
         //lock.lock();
         //FileChunkBuf.EatSize(contentBufLen-i-1);
         //lock.unlock();
     }
+    pFolderWorkData->AddWeakFilterStat(filterStat);
     auto xxhash=XXH3_128bits_digest(pFileTaskData->XXH3State);
     CopyxxHashToBuf(xxhash, output);
     to_upper_hex(pFolderWorkData->FolderManifest.Files[ConvertViewToU8View(pFileTaskData->FileChunksData->FileName)]->FileHash, output, sizeof(output));
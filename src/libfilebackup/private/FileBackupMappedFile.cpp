@@ -0,0 +1,654 @@
+#include "FileBackupInternal.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <csignal>
+#include <csetjmp>
+#include <cstdio>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+#endif
+
+#ifdef _WIN32
+bool FMappedFile::Open(const std::filesystem::path& path)
+{
+    Close();
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+    FileHandle = file;
+    MappingHandle = mapping;
+    Size = uint64_t(size.QuadPart);
+    return true;
+}
+
+bool FMappedFile::IsOpen() const
+{
+    return MappingHandle != nullptr;
+}
+
+uint64_t FMappedFile::GetCurrentSize() const
+{
+    LARGE_INTEGER size;
+    if (!FileHandle || !GetFileSizeEx(FileHandle, &size)) {
+        return 0;
+    }
+    return uint64_t(size.QuadPart);
+}
+
+const char* FMappedFile::Map(uint64_t offset, size_t len)
+{
+    Unmap();
+    if (!IsOpen() || len == 0 || offset + len > Size) {
+        return nullptr;
+    }
+    View = MapViewOfFile(MappingHandle, FILE_MAP_READ, DWORD(offset >> 32), DWORD(offset), len);
+    if (!View) {
+        return nullptr;
+    }
+    ViewLen = len;
+    return (const char*)View;
+}
+
+void FMappedFile::Unmap()
+{
+    if (View) {
+        UnmapViewOfFile(View);
+        View = nullptr;
+        ViewLen = 0;
+    }
+}
+
+void FMappedFile::Close()
+{
+    Unmap();
+    if (MappingHandle) {
+        CloseHandle(MappingHandle);
+        MappingHandle = nullptr;
+    }
+    if (FileHandle) {
+        CloseHandle(FileHandle);
+        FileHandle = nullptr;
+    }
+    Size = 0;
+}
+
+size_t FMappedFile::GetMapAlignment()
+{
+    static const size_t alignment = []() {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return size_t(info.dwAllocationGranularity);
+        }();
+    return alignment;
+}
+
+bool FMirroredBuf::Allocate(size_t size)
+{
+    Free();
+    HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), nullptr);
+    if (!mapping) {
+        return false;
+    }
+    //another thread may take the reserved range between release and map, retry a few times
+    for (int retry = 0; retry < 8 && !Base; retry++) {
+        auto reserved = (char*)VirtualAlloc(nullptr, size * 2, MEM_RESERVE, PAGE_NOACCESS);
+        if (!reserved) {
+            break;
+        }
+        VirtualFree(reserved, 0, MEM_RELEASE);
+        auto first = MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, reserved);
+        auto second = first ? MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, reserved + size) : nullptr;
+        if (first && second) {
+            Base = first;
+        }
+        else if (first) {
+            UnmapViewOfFile(first);
+        }
+    }
+    //views keep the section alive
+    CloseHandle(mapping);
+    if (!Base) {
+        return false;
+    }
+    BufSize = size;
+    return true;
+}
+
+void FMirroredBuf::Free()
+{
+    if (Base) {
+        UnmapViewOfFile((char*)Base + BufSize);
+        UnmapViewOfFile(Base);
+        Base = nullptr;
+        BufSize = 0;
+    }
+}
+
+bool FPositionalFile::Open(const std::filesystem::path& path)
+{
+    Close();
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    FileHandle = file;
+    return true;
+}
+
+bool FPositionalFile::ReadAt(void* buf, size_t len, uint64_t offset) const
+{
+    auto p = (char*)buf;
+    while (len > 0) {
+        //the offset in OVERLAPPED makes a synchronous read positional
+        OVERLAPPED overlapped{};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD readLen{ 0 };
+        if (!ReadFile(FileHandle, p, DWORD(std::min<size_t>(len, 1 << 30)), &readLen, &overlapped) || readLen == 0) {
+            return false;
+        }
+        p += readLen;
+        len -= readLen;
+        offset += readLen;
+    }
+    return true;
+}
+
+void FPositionalFile::Close()
+{
+    if (FileHandle) {
+        CloseHandle(FileHandle);
+        FileHandle = nullptr;
+    }
+}
+
+uint64_t GetFileDeviceID(const std::filesystem::path& path)
+{
+    HANDLE file = CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    auto res = GetFileInformationByHandle(file, &info);
+    CloseHandle(file);
+    return res ? info.dwVolumeSerialNumber : 0;
+}
+
+//100ns ticks since 1601 to nanoseconds since 1970
+static int64_t FileTimeToUnixNano(int64_t fileTime)
+{
+    return (fileTime - 116444736000000000LL) * 100;
+}
+
+bool GetFileStat(const std::filesystem::path& path, FileStat_t& outStat)
+{
+    HANDLE file = CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    FILE_BASIC_INFO basicInfo;
+    auto res = GetFileInformationByHandle(file, &info) && GetFileInformationByHandleEx(file, FileBasicInfo, &basicInfo, sizeof(basicInfo));
+    CloseHandle(file);
+    if (!res) {
+        return false;
+    }
+    outStat.Size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    outStat.MTime = FileTimeToUnixNano(basicInfo.LastWriteTime.QuadPart);
+    outStat.CTime = FileTimeToUnixNano(basicInfo.ChangeTime.QuadPart);
+    outStat.Inode = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    return true;
+}
+
+void GetFileHoles(const std::filesystem::path& path, std::vector<FileHole_t>& outHoles)
+{
+    outHoles.clear();
+    auto attributes = GetFileAttributesW(path.c_str());
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+        return;
+    }
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return;
+    }
+    //holes are the gaps between the allocated ranges
+    FILE_ALLOCATED_RANGE_BUFFER query{};
+    FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+    query.Length.QuadPart = size.QuadPart;
+    uint64_t dataEnd{ 0 };
+    while (true) {
+        DWORD outLen{ 0 };
+        bool bMore = !DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &outLen, nullptr);
+        if (bMore && GetLastError() != ERROR_MORE_DATA) {
+            outHoles.clear();
+            CloseHandle(file);
+            return;
+        }
+        auto rangeNum = outLen / sizeof(ranges[0]);
+        for (size_t i = 0; i < rangeNum; i++) {
+            auto rangeStart = uint64_t(ranges[i].FileOffset.QuadPart);
+            if (rangeStart > dataEnd) {
+                outHoles.push_back({ dataEnd, rangeStart });
+            }
+            dataEnd = rangeStart + uint64_t(ranges[i].Length.QuadPart);
+        }
+        if (!bMore || rangeNum == 0) {
+            break;
+        }
+        query.FileOffset.QuadPart = LONGLONG(dataEnd);
+        query.Length.QuadPart = size.QuadPart - LONGLONG(dataEnd);
+    }
+    if (dataEnd < uint64_t(size.QuadPart)) {
+        outHoles.push_back({ dataEnd, uint64_t(size.QuadPart) });
+    }
+    CloseHandle(file);
+}
+
+bool PunchFileHole(const std::filesystem::path& path, uint64_t offset, uint64_t len)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    DWORD outLen;
+    FILE_ZERO_DATA_INFORMATION zeroData;
+    zeroData.FileOffset.QuadPart = LONGLONG(offset);
+    zeroData.BeyondFinalZero.QuadPart = LONGLONG(offset + len);
+    auto res = DeviceIoControl(file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &outLen, nullptr)
+        && DeviceIoControl(file, FSCTL_SET_ZERO_DATA, &zeroData, sizeof(zeroData), nullptr, 0, &outLen, nullptr);
+    CloseHandle(file);
+    return res;
+}
+
+bool SyncFile(const std::filesystem::path& path)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    auto res = FlushFileBuffers(file);
+    CloseHandle(file);
+    return res;
+}
+
+bool GuardMappedRead(const std::function<void()>& read)
+{
+#ifdef _MSC_VER
+    //a file with a mapped view can not be cut on windows, an in page error here is a failed read of the device
+    __try {
+        read();
+    }
+    __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        return false;
+    }
+#else
+    read();
+#endif
+    return true;
+}
+#else
+namespace {
+    thread_local sigjmp_buf* MappedReadJmpBuf{ nullptr };
+    struct sigaction PreviousBusAction {};
+    size_t BusPageSize{ 0 };
+
+    //views the bus error handler may patch, a slot is claimed through pLostPages and read lock free by the handler
+    typedef struct LiveView_t {
+        std::atomic<std::atomic_bool*> pLostPages{ nullptr };
+        std::atomic<uintptr_t> Start{ 0 };
+        std::atomic<uintptr_t> End{ 0 };
+    }LiveView_t;
+    constexpr size_t LiveViewNum = 1024;
+    LiveView_t LiveViews[LiveViewNum];
+
+    void OnBusError(int sig, siginfo_t* info, void* context)
+    {
+        if (MappedReadJmpBuf) {
+            siglongjmp(*MappedReadJmpBuf, 1);
+        }
+        //a page of a live view was cut from the file, a zero page takes its place so the faulting read goes on
+        //and the owner learns the content is not the file. mmap is a plain syscall here, though posix does not list it as signal safe
+        auto addr = uintptr_t(info->si_addr);
+        for (auto& liveView : LiveViews) {
+            auto pLostPages = liveView.pLostPages.load(std::memory_order_acquire);
+            if (!pLostPages || addr < liveView.Start.load(std::memory_order_acquire) || addr >= liveView.End.load(std::memory_order_acquire)) {
+                continue;
+            }
+            auto page = (void*)(addr / BusPageSize * BusPageSize);
+            if (mmap(page, BusPageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+                pLostPages->store(true, std::memory_order_release);
+                return;
+            }
+            break;
+        }
+        //not a mapped read, the handler before ours takes it once the signal is unblocked
+        sigaction(SIGBUS, &PreviousBusAction, nullptr);
+        raise(SIGBUS);
+    }
+
+    void InstallBusErrorHandler()
+    {
+        static std::once_flag installFlag;
+        std::call_once(installFlag, []() {
+            BusPageSize = FMappedFile::GetMapAlignment();
+            struct sigaction action {};
+            action.sa_sigaction = OnBusError;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGBUS, &action, &PreviousBusAction);
+            });
+    }
+}
+
+bool FMappedFile::Open(const std::filesystem::path& path)
+{
+    Close();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    FD = fd;
+    Size = uint64_t(st.st_size);
+    bLostPages = false;
+    return true;
+}
+
+bool FMappedFile::IsOpen() const
+{
+    return FD >= 0;
+}
+
+uint64_t FMappedFile::GetCurrentSize() const
+{
+    struct stat st;
+    if (FD < 0 || fstat(FD, &st) != 0) {
+        return 0;
+    }
+    return uint64_t(st.st_size);
+}
+
+const char* FMappedFile::Map(uint64_t offset, size_t len)
+{
+    Unmap();
+    if (!IsOpen() || len == 0 || offset + len > Size) {
+        return nullptr;
+    }
+    //a view the bus error handler does not know would kill the process when the file shrinks under it
+    InstallBusErrorHandler();
+    size_t liveViewIndex{ 0 };
+    for (; liveViewIndex < LiveViewNum; liveViewIndex++) {
+        std::atomic_bool* pExpected{ nullptr };
+        if (LiveViews[liveViewIndex].pLostPages.compare_exchange_strong(pExpected, &bLostPages)) {
+            break;
+        }
+    }
+    if (liveViewIndex == LiveViewNum) {
+        return nullptr;
+    }
+    auto view = mmap(nullptr, len, PROT_READ, MAP_SHARED, FD, off_t(offset));
+    if (view == MAP_FAILED) {
+        LiveViews[liveViewIndex].pLostPages.store(nullptr, std::memory_order_release);
+        return nullptr;
+    }
+    madvise(view, len, MADV_SEQUENTIAL);
+    LiveViews[liveViewIndex].Start.store(uintptr_t(view), std::memory_order_release);
+    LiveViews[liveViewIndex].End.store(uintptr_t(view) + len, std::memory_order_release);
+    LiveViewIndex = liveViewIndex;
+    View = view;
+    ViewLen = len;
+    return (const char*)View;
+}
+
+void FMappedFile::Unmap()
+{
+    if (View) {
+        auto& liveView = LiveViews[LiveViewIndex];
+        liveView.End.store(0, std::memory_order_release);
+        liveView.Start.store(0, std::memory_order_release);
+        liveView.pLostPages.store(nullptr, std::memory_order_release);
+        LiveViewIndex = SIZE_MAX;
+        munmap(View, ViewLen);
+        View = nullptr;
+        ViewLen = 0;
+    }
+}
+
+void FMappedFile::Close()
+{
+    Unmap();
+    if (FD >= 0) {
+        close(FD);
+        FD = -1;
+    }
+    Size = 0;
+}
+
+size_t FMappedFile::GetMapAlignment()
+{
+    static const size_t alignment = size_t(sysconf(_SC_PAGESIZE));
+    return alignment;
+}
+
+bool FMirroredBuf::Allocate(size_t size)
+{
+    Free();
+#ifdef __linux__
+    int fd = memfd_create("ofilebackup_ring", MFD_CLOEXEC);
+#else
+    char name[64];
+    static std::atomic_uint32_t counter{ 0 };
+    snprintf(name, sizeof(name), "/ofilebackup_ring_%d_%u", int(getpid()), counter.fetch_add(1));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+#endif
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, off_t(size)) != 0) {
+        close(fd);
+        return false;
+    }
+    //reserve both copies first so the two views land next to each other
+    auto reserved = (char*)mmap(nullptr, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    auto first = mmap(reserved, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    auto second = mmap(reserved + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    //mappings keep the memory alive
+    close(fd);
+    if (first == MAP_FAILED || second == MAP_FAILED) {
+        munmap(reserved, size * 2);
+        return false;
+    }
+    Base = reserved;
+    BufSize = size;
+    return true;
+}
+
+void FMirroredBuf::Free()
+{
+    if (Base) {
+        munmap(Base, BufSize * 2);
+        Base = nullptr;
+        BufSize = 0;
+    }
+}
+
+bool FPositionalFile::Open(const std::filesystem::path& path)
+{
+    Close();
+    FD = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    return FD >= 0;
+}
+
+bool FPositionalFile::ReadAt(void* buf, size_t len, uint64_t offset) const
+{
+    auto p = (char*)buf;
+    while (len > 0) {
+        auto readLen = pread(FD, p, len, off_t(offset));
+        if (readLen <= 0) {
+            if (readLen < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += readLen;
+        len -= size_t(readLen);
+        offset += uint64_t(readLen);
+    }
+    return true;
+}
+
+void FPositionalFile::Close()
+{
+    if (FD >= 0) {
+        close(FD);
+        FD = -1;
+    }
+}
+
+uint64_t GetFileDeviceID(const std::filesystem::path& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    return uint64_t(st.st_dev);
+}
+
+bool GetFileStat(const std::filesystem::path& path, FileStat_t& outStat)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#ifdef __APPLE__
+    auto& mtime = st.st_mtimespec;
+    auto& ctime = st.st_ctimespec;
+#else
+    auto& mtime = st.st_mtim;
+    auto& ctime = st.st_ctim;
+#endif
+    outStat.Size = uint64_t(st.st_size);
+    outStat.MTime = int64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+    outStat.CTime = int64_t(ctime.tv_sec) * 1000000000 + ctime.tv_nsec;
+    outStat.Inode = uint64_t(st.st_ino);
+    return true;
+}
+
+void GetFileHoles(const std::filesystem::path& path, std::vector<FileHole_t>& outHoles)
+{
+    outHoles.clear();
+#ifdef SEEK_HOLE
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    //as many blocks as bytes, nothing to seek for
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || uint64_t(st.st_blocks) * 512 >= uint64_t(st.st_size)) {
+        close(fd);
+        return;
+    }
+    off_t pos{ 0 };
+    while (pos < st.st_size) {
+        auto holeStart = lseek(fd, pos, SEEK_HOLE);
+        if (holeStart < 0 || holeStart >= st.st_size) {
+            break;
+        }
+        auto dataStart = lseek(fd, holeStart, SEEK_DATA);
+        if (dataStart < 0) {
+            if (errno != ENXIO) {
+                outHoles.clear();
+                break;
+            }
+            //the hole runs to the end of the file
+            dataStart = st.st_size;
+        }
+        outHoles.push_back({ uint64_t(holeStart), uint64_t(dataStart) });
+        pos = dataStart;
+    }
+    close(fd);
+#endif
+}
+
+bool PunchFileHole(const std::filesystem::path& path, uint64_t offset, uint64_t len)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    auto res = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(offset), off_t(len)) == 0;
+    close(fd);
+    return res;
+#else
+    return false;
+#endif
+}
+
+bool SyncFile(const std::filesystem::path& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    auto res = fsync(fd) == 0;
+    close(fd);
+    return res;
+}
+
+bool GuardMappedRead(const std::function<void()>& read)
+{
+    InstallBusErrorHandler();
+    sigjmp_buf jmpBuf;
+    if (sigsetjmp(jmpBuf, 1) != 0) {
+        MappedReadJmpBuf = nullptr;
+        return false;
+    }
+    MappedReadJmpBuf = &jmpBuf;
+    read();
+    MappedReadJmpBuf = nullptr;
+    return true;
+}
+#endif
@@ -0,0 +1,269 @@
+#include "FileBackupUringReader.h"
+#ifdef IO_URING_FOUND
+#include "FileBackupManagerBase.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+FUringReader::~FUringReader()
+{
+    if (!bInited) {
+        return;
+    }
+    //the kernel may still write into task rings, wait for every read before they can be freed
+    io_uring_cqe* cqe;
+    while (InFlightNum > 0 && io_uring_wait_cqe(&Ring, &cqe) == 0) {
+        Reap(cqe);
+    }
+    for (auto& slot : Slots) {
+        if (slot.FD >= 0) {
+            close(slot.FD);
+        }
+    }
+    io_uring_queue_exit(&Ring);
+}
+
+bool FUringReader::Init(bool bDirect)
+{
+    if (io_uring_queue_init(EntryNum, &Ring, 0) < 0) {
+        return false;
+    }
+    bInited = true;
+    bDirectIO = bDirect;
+    //registered buffers are optional, reads into unregistered memory work when the memlock limit is too low
+    bFixedBufs = io_uring_register_buffers_sparse(&Ring, TaskSlotNum) == 0;
+    return true;
+}
+
+void FUringReader::Tick(GenFolderChunkDataWorkData_t& folderWorkData)
+{
+    auto seq = folderWorkData.ReadEvent.Prepare();
+    bool bBusy{ false };
+    io_uring_cqe* cqe;
+    while (io_uring_peek_cqe(&Ring, &cqe) == 0) {
+        Reap(cqe);
+        bBusy = true;
+    }
+    uint32_t freeSlotNum{ 0 };
+    for (uint32_t i = 0; i < TaskSlotNum; i++) {
+        auto& slot = Slots[i];
+        if (!slot.pFileTaskData) {
+            freeSlotNum++;
+            continue;
+        }
+        Commit(slot);
+        if (folderWorkData.bRequestExit) {
+            slot.bSubmitEnd = true;
+        }
+        if (slot.bSubmitEnd && slot.Reads.empty()) {
+            Release(folderWorkData, i);
+            freeSlotNum++;
+            bBusy = true;
+        }
+    }
+    //tasks the reader can not take, packs and special files, go through the stream step
+    std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData;
+    for (auto num = folderWorkData.ReadQueue.size_approx(); num > 0 && freeSlotNum > 0 && folderWorkData.ReadQueue.try_dequeue(pFileTaskData); num--) {
+        if (!folderWorkData.bRequestExit && TakeTask(pFileTaskData)) {
+            freeSlotNum--;
+            bBusy = true;
+        }
+        else if (IFileBackupManagerBase::GenFolderChunkDataReadQueuedTask(folderWorkData, pFileTaskData)) {
+            bBusy = true;
+        }
+    }
+    for (uint32_t i = 0; i < TaskSlotNum; i++) {
+        if (Slots[i].pFileTaskData && Submit(folderWorkData, i)) {
+            bBusy = true;
+        }
+    }
+    io_uring_submit(&Ring);
+    if (bBusy || folderWorkData.bRequestExit || folderWorkData.Status == EGenFolderMetaDataStatus::Finished) {
+        folderWorkData.ReadEvent.Cancel();
+    }
+    else if (InFlightNum > 0) {
+        //every ring is full or waits for its reads, the next completion is the next thing to do
+        folderWorkData.ReadEvent.Cancel();
+        io_uring_wait_cqe(&Ring, &cqe);
+    }
+    else {
+        folderWorkData.ReadEvent.Wait(seq);
+    }
+}
+
+bool FUringReader::TakeTask(std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData)
+{
+    //the prefix of an appended file is hashed by the stream step first
+    if (pFileTaskData->Pack || pFileTaskData->PrefixHashPos < pFileTaskData->PrefixHashEnd) {
+        return false;
+    }
+    uint32_t slotIndex{ 0 };
+    while (slotIndex < TaskSlotNum && Slots[slotIndex].pFileTaskData) {
+        slotIndex++;
+    }
+    if (slotIndex == TaskSlotNum) {
+        return false;
+    }
+    int fd{ -1 };
+    bool bDirect{ false };
+    //direct reads need aligned file offsets, a range task starts on a chunk boundary so only odd sizes fail here
+    if (bDirectIO && pFileTaskData->ReadPos % DirectIOAlignment == 0) {
+        fd = open(pFileTaskData->FilePath.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+        bDirect = fd >= 0;
+    }
+    if (fd < 0) {
+        fd = open(pFileTaskData->FilePath.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    auto& slot = Slots[slotIndex];
+    slot.pFileTaskData = pFileTaskData;
+    slot.FD = fd;
+    slot.bDirect = bDirect;
+    slot.SubmitPos = pFileTaskData->ReadPos;
+    if (bFixedBufs) {
+        //both copies of the mirrored ring, a read may run past BufEnd
+        auto& ringBuf = pFileTaskData->FileChunkBuf->RingBuf;
+        iovec iov{ ringBuf.Data(), ringBuf.Size() * 2 };
+        slot.bFixedBuf = io_uring_register_buffers_update_tag(&Ring, slotIndex, &iov, nullptr, 1) == 1;
+    }
+    return true;
+}
+
+void FUringReader::Reap(io_uring_cqe* cqe)
+{
+    auto& read = *(Read_t*)io_uring_cqe_get_data(cqe);
+    read.Res = cqe->res;
+    read.bDone = true;
+    read.DeviceReadNum->fetch_sub(1);
+    io_uring_cqe_seen(&Ring, cqe);
+    InFlightNum--;
+}
+
+bool FUringReader::Submit(GenFolderChunkDataWorkData_t& folderWorkData, uint32_t slotIndex)
+{
+    bool bBusy{ false };
+    auto& slot = Slots[slotIndex];
+    auto& fileTaskData = *slot.pFileTaskData;
+    FileChunkBuf_t& FileChunkBuf = *fileTaskData.FileChunkBuf;
+    auto queueDepth = folderWorkData.Params.Options.IOQueueDepth;
+    auto maxReadLen = FileChunkBuf.FileBufSize / MaxReadNumPerTask;
+    while (!slot.bSubmitEnd && slot.Reads.size() < MaxReadNumPerTask && InFlightNum < EntryNum) {
+        if (slot.SubmitPos >= fileTaskData.ReadEnd) {
+            slot.bSubmitEnd = true;
+            break;
+        }
+        auto freeLen = FileChunkBuf.FileBufSize - FileChunkBuf.ContentSize.load() - slot.InFlightLen;
+        auto len = uint32_t(std::min<uint64_t>({ freeLen, maxReadLen, fileTaskData.ReadEnd - slot.SubmitPos }));
+        auto pHole = fileTaskData.FindHole(slot.SubmitPos);
+        if (pHole && slot.bDirect && (pHole->Start % DirectIOAlignment != 0 || pHole->End % DirectIOAlignment != 0)) {
+            pHole = nullptr;
+        }
+        bool bHole = pHole && pHole->Start <= slot.SubmitPos;
+        if (pHole) {
+            len = uint32_t(std::min<uint64_t>(len, (bHole ? pHole->End : pHole->Start) - slot.SubmitPos));
+        }
+        if (slot.bDirect && !bHole && len == fileTaskData.ReadEnd - slot.SubmitPos && len % DirectIOAlignment != 0) {
+            //the tail is read up to the alignment, a short read ends the file and commit drops what lies past ReadEnd
+            auto alignedLen = (len + DirectIOAlignment - 1) / DirectIOAlignment * DirectIOAlignment;
+            len = alignedLen <= std::min<uint64_t>(freeLen, maxReadLen + DirectIOAlignment) ? uint32_t(alignedLen) : 0;
+        }
+        else if (slot.bDirect) {
+            len = len / DirectIOAlignment * DirectIOAlignment;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (bHole) {
+            //a hole is zeros right away, it still commits in file order behind the reads before it
+            auto& read = slot.Reads.emplace_back();
+            read.Len = len;
+            read.Res = int32_t(len);
+            read.bDone = true;
+            memset(FileChunkBuf.StreamPos + slot.InFlightLen, 0, len);
+            slot.SubmitPos += len;
+            slot.InFlightLen += len;
+            bBusy = true;
+            continue;
+        }
+        if (fileTaskData.DeviceReadNum->fetch_add(1) >= queueDepth) {
+            fileTaskData.DeviceReadNum->fetch_sub(1);
+            bBusy = true;
+            break;
+        }
+        auto sqe = io_uring_get_sqe(&Ring);
+        if (!sqe) {
+            fileTaskData.DeviceReadNum->fetch_sub(1);
+            bBusy = true;
+            break;
+        }
+        auto dest = FileChunkBuf.StreamPos + slot.InFlightLen;
+        auto& read = slot.Reads.emplace_back();
+        read.Len = len;
+        read.DeviceReadNum = fileTaskData.DeviceReadNum.get();
+        if (slot.bFixedBuf) {
+            io_uring_prep_read_fixed(sqe, slot.FD, dest, len, slot.SubmitPos, int(slotIndex));
+        }
+        else {
+            io_uring_prep_read(sqe, slot.FD, dest, len, slot.SubmitPos);
+        }
+        io_uring_sqe_set_data(sqe, &read);
+        slot.SubmitPos += len;
+        slot.InFlightLen += len;
+        InFlightNum++;
+        bBusy = true;
+    }
+    return bBusy;
+}
+
+void FUringReader::Commit(TaskSlot_t& slot)
+{
+    auto& fileTaskData = *slot.pFileTaskData;
+    FileChunkBuf_t& FileChunkBuf = *fileTaskData.FileChunkBuf;
+    while (!slot.Reads.empty() && slot.Reads.front().bDone) {
+        auto read = slot.Reads.front();
+        slot.Reads.pop_front();
+        slot.InFlightLen -= read.Len;
+        if (slot.bDataEnd) {
+            continue;
+        }
+        //an error ends the file like a failed stream read, a short read is the end of file
+        auto len = uint32_t(std::min<uint64_t>(std::max(read.Res, 0), fileTaskData.ReadEnd - fileTaskData.ReadPos));
+        if (len > 0) {
+            if (fileTaskData.ReadPos + len > fileTaskData.HashStart) {
+                auto skipLen = fileTaskData.HashStart > fileTaskData.ReadPos ? fileTaskData.HashStart - fileTaskData.ReadPos : 0;
+                XXH3_128bits_update(fileTaskData.XXH3State, FileChunkBuf.StreamPos + skipLen, len - skipLen);
+            }
+            fileTaskData.ReadPos += len;
+            FileChunkBuf.FillSize(len);
+        }
+        if (read.Res < int32_t(read.Len) || fileTaskData.ReadPos >= fileTaskData.ReadEnd) {
+            slot.bDataEnd = true;
+            slot.bSubmitEnd = true;
+        }
+    }
+}
+
+void FUringReader::Release(GenFolderChunkDataWorkData_t& folderWorkData, uint32_t slotIndex)
+{
+    auto& slot = Slots[slotIndex];
+    if (slot.bFixedBuf) {
+        //drop the pin on the task ring
+        iovec iov{ nullptr, 0 };
+        io_uring_register_buffers_update_tag(&Ring, slotIndex, &iov, nullptr, 1);
+    }
+    close(slot.FD);
+    auto pFileTaskData = std::move(slot.pFileTaskData);
+    slot = TaskSlot_t{};
+    pFileTaskData->SetEOF();
+    IFileBackupManagerBase::ReleaseReadTask(folderWorkData, std::move(pFileTaskData));
+}
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+#ifdef IO_URING_FOUND
+#include "FileBackupInternal.h"
+
+#include <liburing.h>
+
+///
+/// @brief io_uring backend of one io stage thread
+/// @detail a file task taken by the reader stays with it until its last read completes. several reads per task are
+/// in flight at once, straight into the task ring through registered buffers, and are committed in file order
+///
+class FUringReader {
+public:
+    static constexpr uint32_t EntryNum = 64;
+    static constexpr uint32_t TaskSlotNum = 16;
+    static constexpr uint32_t MaxReadNumPerTask = 4;
+    static constexpr uint32_t DirectIOAlignment = 4096;
+
+    FUringReader() = default;
+    FUringReader(const FUringReader&) = delete;
+    FUringReader& operator=(const FUringReader&) = delete;
+    ~FUringReader();
+    bool Init(bool bDirect);
+    //sleeps when no task can be read for
+    void Tick(GenFolderChunkDataWorkData_t& folderWorkData);
+private:
+    typedef struct Read_t {
+        uint32_t Len{ 0 };
+        int32_t Res{ 0 };
+        bool bDone{ false };
+        std::atomic_uint32_t* DeviceReadNum{ nullptr };
+    }Read_t;
+    typedef struct TaskSlot_t {
+        std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData;
+        int FD{ -1 };
+        bool bDirect{ false };
+        bool bFixedBuf{ false };
+        bool bSubmitEnd{ false };//no more reads are submitted
+        bool bDataEnd{ false };//end of file or error committed, later reads are only reaped
+        uint64_t SubmitPos{ 0 };//file offset after the last submitted read
+        uint32_t InFlightLen{ 0 };//bytes submitted but not committed, they follow StreamPos
+        std::deque<Read_t> Reads;//in file order
+    }TaskSlot_t;
+    bool TakeTask(std::shared_ptr<GenFolderChunkDataFileTaskData_t> pFileTaskData);
+    void Reap(io_uring_cqe* cqe);
+    //false when the ring of the task is full, there is nothing to do for it until the worker eats
+    bool Submit(GenFolderChunkDataWorkData_t& folderWorkData, uint32_t slotIndex);
+    void Commit(TaskSlot_t& slot);
+    void Release(GenFolderChunkDataWorkData_t& folderWorkData, uint32_t slotIndex);
+
+    io_uring Ring{};
+    bool bInited{ false };
+    bool bDirectIO{ false };
+    bool bFixedBufs{ false };
+    uint32_t InFlightNum{ 0 };
+    std::array<TaskSlot_t, TaskSlotNum> Slots;
+};
+#endif
@@ -65,6 +65,12 @@ CommonHandle32_t FFolderRecoverHelper::AddTask(std::shared_ptr < const FolderMan
     FolderRecoverWorkData.WorkFolder= workDirStr;
     FolderRecoverWorkData.ChunkFolder=chunkDirStr;
     FolderRecoverWorkData.TempFolder=tempDirStr;
+    if (!chunkDirStr.empty()) {
+        FolderRecoverWorkData.ChunkStore = OpenChunkStore(chunkDirStr, EChunkStoreKind::Auto, ec);
+        if (ec) {
+            return NullHandle;
+        }
+    }
     FolderRecoverWorkData.RecoverProcess.Init(pFolderRecoverWorkData,manifest, sourceManifest,ec);
     if (ec) {
         return NullHandle;
@@ -241,6 +247,8 @@ void FFolderRecoverHelper::RecoverByChunkTask(this FFolderRecoverHelper& self, s
     auto& FileTaskData = *pFileTaskData;
     uint32_t readed;
     int32_t ires;
+    size_t chunkContentSize{ 0 };
+    const uint8_t* chunkContent{ FileTaskData.FileChunkBuf };
 
 
     auto itr=FolderRecoverWorkData.RecoverProcess.CompareResult->TargetChunkReverseIndex.find(chunkHexName);
@@ -261,6 +269,12 @@ void FFolderRecoverHelper::RecoverByChunkTask(this FFolderRecoverHelper& self, s
         std::filesystem::path filePath(FolderRecoverWorkData.WorkFolder);
         filePath /= fileName;
         auto& pChunData = *chunksData.begin();
+        //the chunk is read into a buffer of the max chunk size of the manifest
+        if (pChunData->Size == 0 || pChunData->Size > GetMaxFileChunkSize(pFolderWorkData->RecoverProcess.Manifest->ChunkSize)) {
+            auto expected = std::error_code();
+            FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::invalid_argument));
+            return;
+        }
         ires = FileTaskData.SourceFile.Open(filePath.u8string(), UTIL_OPEN_EXISTING);
         if (ires != ERR_SUCCESS) {
             auto expected = std::error_code();
@@ -273,33 +287,42 @@ void FFolderRecoverHelper::RecoverByChunkTask(this FFolderRecoverHelper& self, s
             FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::no_such_file_or_directory));
             return;
         }
-        ires = FileTaskData.SourceFile.Read(pFileTaskData->FileChunkBuf, FileChunkSize, readed);
+        ires = FileTaskData.SourceFile.Read(pFileTaskData->FileChunkBuf, pChunData->Size, readed);
         if (ires != ERR_SUCCESS) {
             auto expected = std::error_code();
             FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::no_such_file_or_directory));
             return;
         }
-        memset(pFileTaskData->FileChunkBuf + readed, 0, FileChunkSize - readed);
+        memset(pFileTaskData->FileChunkBuf + readed, 0, pChunData->Size - readed);
+        chunkContentSize = pChunData->Size;
     }
     else {
-        std::filesystem::path filePath(FolderRecoverWorkData.ChunkFolder);
-        filePath /= chunkHexName;
-        ires = FileTaskData.SourceFile.Open(filePath.u8string(), UTIL_OPEN_EXISTING);
-        if (ires != ERR_SUCCESS) {
+        auto ChunkFileBuf = FileTaskData.ChunkConverter->GetChunkFileBuf();
+        size_t chunkFileLen{ 0 };
+        if (!FolderRecoverWorkData.ChunkStore || !FolderRecoverWorkData.ChunkStore->Get(chunkHexName, ChunkFileBuf, pFolderWorkData->RecoverProcess.Manifest->ChunkFileMaxSize, chunkFileLen)) {
             auto expected = std::error_code();
             FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::no_such_file_or_directory));
             return;
         }
-        auto ChunkFileBuf = FileTaskData.ChunkConverter->GetChunkFileBuf();
-        ires = FileTaskData.SourceFile.Read(ChunkFileBuf, pFolderWorkData->RecoverProcess.Manifest->ChunkFileMaxSize, readed);
-        if (ires != ERR_SUCCESS) {
+        //a raw chunk is written straight from the chunk file
+        auto rawContent = GetRawChunkFileContent(ChunkFileBuf, chunkFileLen);
+        if (!rawContent.empty()) {
+            chunkContent = (const uint8_t*)rawContent.data();
+            chunkContentSize = rawContent.size();
+        }
+        else {
+            FileTaskData.ChunkConverter->UpdateChunkFileSize(chunkFileLen);
+            FileTaskData.ChunkConverter->Convert(FileTaskData.FileChunkBuf, GetMaxFileChunkSize(pFolderWorkData->RecoverProcess.Manifest->ChunkSize));
+            chunkContentSize = FileTaskData.ChunkConverter->GetFileChunkSize();
+        }
+        if (chunkContentSize == 0) {
             auto expected = std::error_code();
-            FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::no_such_file_or_directory));
+            FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::invalid_argument));
             return;
         }
-        FileTaskData.ChunkConverter->UpdateChunkFileSize(readed);
-        FileTaskData.ChunkConverter->Convert(FileTaskData.FileChunkBuf);
     }
+    //a zero chunk is not written, its ranges are punched so recovered images stay sparse
+    bool bZeroChunk = IsZeroBuf(chunkContent, chunkContentSize);
     for (auto& [fileName, FileChunksData] : itr->second) {
         auto fileItr=pFolderWorkData->RecoverProcess.Manifest->Files.find(fileName);
         if (fileItr == pFolderWorkData->RecoverProcess.Manifest->Files.end()) {
@@ -317,13 +340,23 @@ void FFolderRecoverHelper::RecoverByChunkTask(this FFolderRecoverHelper& self, s
         }
 
         for (auto& pFileChunkData : FileChunksData) {
-            auto writeSize = std::min(pFileData->FileSize - pFileChunkData->StartPos, (uint64_t)FileChunkSize);
-            ires = FileTaskData.TargetFile.Write(pFileTaskData->FileChunkBuf, writeSize, pFileChunkData->StartPos);
-            if (ires != ERR_SUCCESS) {
+            //chunks are written at their own size, old manifests may still list a padded tail
+            //files sharing a pack chunk are all written from this one decompressed chunk
+            auto writeSize = std::min(pFileData->FileSize - pFileChunkData->StartPos, (uint64_t)pFileChunkData->Size);
+            if (pFileChunkData->ChunkOffset + writeSize > chunkContentSize) {
                 auto expected = std::error_code();
-                FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::no_such_file_or_directory));
+                FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::invalid_argument));
                 return;
             }
+            //the target file is already sized, a punched range reads as zeros
+            if (!bZeroChunk || !PunchFileHole(FolderRecoverWorkData.TempFolder / pFileData->FileName, pFileChunkData->StartPos, writeSize)) {
+                ires = FileTaskData.TargetFile.Write(chunkContent + pFileChunkData->ChunkOffset, writeSize, pFileChunkData->StartPos);
+                if (ires != ERR_SUCCESS) {
+                    auto expected = std::error_code();
+                    FolderRecoverWorkData.ErrorCode.compare_exchange_strong(expected, std::make_error_code(std::errc::no_such_file_or_directory));
+                    return;
+                }
+            }
 
             auto fileItr = FileTaskData.FilesNeedRecover.find(ConvertViewToU8View(pFileData->FileName));
             auto pFileNeedRecoverData = fileItr->second;
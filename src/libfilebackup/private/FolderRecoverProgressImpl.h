@@ -1,5 +1,6 @@
 #include "FolderRecoverHelper.h"
 #include "FileBackupInternal.h"
+#include "ChunkStore.h"
 #include <RawFile.h>
 #include <moodycamel/concurrentqueue.h>
 struct FolderRecoverWorkData_t;
@@ -78,9 +79,13 @@ typedef struct FolderRecoverWorkData_t {
             pFileTaskData->Clear();
         }
         else {
+            //chunks of the manifest never exceed the max chunk size of its chunk size
+            auto maxFileChunkSize = GetMaxFileChunkSize(RecoverProcess.Manifest->ChunkSize);
             pFileTaskData = std::make_shared<RecoverFileTaskData_t>();
-            pFileTaskData->FileChunkBuf = new uint8_t[FileChunkSize];
-            pFileTaskData->ChunkConverter = new FChunkConverter(EConvertDirection::ToFileChunk);
+            pFileTaskData->FileChunkBuf = new uint8_t[maxFileChunkSize];
+            pFileTaskData->ChunkConverter = new FChunkConverter();
+            pFileTaskData->ChunkConverter->UpdateMaxFileChunkSize(maxFileChunkSize);
+            pFileTaskData->ChunkConverter->UpdateConvertDirection(EConvertDirection::ToFileChunk);
         }
         return pFileTaskData;
     }
@@ -95,6 +100,7 @@ typedef struct FolderRecoverWorkData_t {
     EFolderRecoverStatus LastStatus;;
     std::filesystem::path WorkFolder;
     std::filesystem::path ChunkFolder;
+    std::shared_ptr<IChunkStore> ChunkStore;//chunk files of ChunkFolder, dir or pack
     std::filesystem::path TempFolder;
 
 
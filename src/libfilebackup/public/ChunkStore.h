@@ -0,0 +1,39 @@
+#pragma once
+#include "FileBackupExportDef.h"
+#include "FileBackupCommon.h"
+#include <span>
+#include <string_view>
+#include <functional>
+#include <system_error>
+
+//binary index of the known chunks kept in the chunk dir by the backup, not a chunk of the store
+constexpr char ChunkIDIndexFileName[] = "chunk_ids.idx";
+
+enum class EChunkStoreKind
+{
+    Auto,//a pack index or pack files in the dir pick Pack, anything else, an empty or missing dir too, picks Dir
+    Dir,//one chunk file per chunk named by its hex name
+    Pack,//chunk files appended to large pack files, located by a sorted index
+};
+
+///
+/// @brief where chunk files are kept, by hex name
+/// @detail Put and Get are thread safe. chunks put into a Pack store are readable at once but only known to a later
+/// open after Flush
+///
+class IChunkStore {
+public:
+    virtual ~IChunkStore() = default;
+    virtual EChunkStoreKind GetKind() const = 0;
+    //a chunk the store already has may be skipped
+    virtual bool Put(std::u8string_view hexName, std::span<const char> chunkFile) = 0;
+    //outLen is the chunk file length, false when it is missing or longer than bufSize
+    virtual bool Get(std::u8string_view hexName, void* buf, size_t bufSize, size_t& outLen) = 0;
+    //names stay valid during the call only
+    virtual void ForEachName(const std::function<void(std::u8string_view)>& func) = 0;
+    //pack store writes its index, nothing to do for a dir store
+    virtual std::error_code Flush() = 0;
+};
+LIB_FILEBACKUP_EXPORT EChunkStoreKind DetectChunkStoreKind(std::u8string_view dirStr);
+//the dir is created if missing
+LIB_FILEBACKUP_EXPORT std::shared_ptr<IChunkStore> OpenChunkStore(std::u8string_view dirStr, EChunkStoreKind kind, std::error_code& ec);
@@ -0,0 +1,42 @@
+#pragma once
+#include "FileBackupExportDef.h"
+#include "FileBackupCommon.h"
+#include "ChunkStore.h"
+#include <span>
+#include <string_view>
+#include <system_error>
+
+typedef struct ChunkCompressionOptions_t {
+    ChunkCompressionProfile_t Profile;
+    //the level starts at Profile.Level and moves between MinLevel and MaxLevel:
+    //up while chunks wait for the writers, down while they wait for the compressors
+    bool bAdaptiveLevel{ false };
+    int MinLevel{ 1 };
+    int MaxLevel{ 9 };
+}ChunkCompressionOptions_t;
+
+typedef struct ChunkStorePipelineOptions_t {
+    uint32_t CompressThreadNum{ 2 };
+    uint32_t WriteThreadNum{ 1 };
+    uint32_t BufNum{ 16 };//pooled chunk buffers, bounds both the memory and the chunks in flight
+    uint32_t MaxFileChunkSize{ GetMaxFileChunkSize(FileChunkSize) };//largest chunk content it takes, GetMaxFileChunkSize of the manifest chunk size
+    ChunkCompressionOptions_t Compression;
+}ChunkStorePipelineOptions_t;
+
+///
+/// @brief stores new chunks off the scanning workers
+/// @detail Enqueue copies the chunk into a pooled buffer and returns, a compression pool converts it to a chunk file
+/// and a writer stage puts it into the chunk store. the caller only waits when every pooled buffer is in flight
+///
+class IChunkStorePipeline {
+public:
+    virtual ~IChunkStorePipeline() = default;
+    //thread safe, false once a chunk failed to store or after Finish
+    virtual bool Enqueue(std::span<const char8_t> name, std::span<const char> content) = 0;
+    //waits until every enqueued chunk is stored and stops the threads, the first error of any stage
+    //not to be called while an Enqueue is still running
+    virtual std::error_code Finish() = 0;
+    //level the compressors use now, moves over time with an adaptive level
+    virtual int GetCompressionLevel() const = 0;
+};
+LIB_FILEBACKUP_EXPORT std::shared_ptr<IChunkStorePipeline> NewChunkStorePipeline(std::shared_ptr<IChunkStore> pChunkStore, const ChunkStorePipelineOptions_t& options = {});
@@ -8,22 +8,48 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <cstring>
 #include <system_error>
+#include <bit>
 #include <CharBuffer.h>
 #include <std_ext.h>
 #include <simple_uuid.h>
 #include <hex.h>
 #include "FileBackupExportDef.h"
-typedef uint32_t WeakHash_t;
+typedef uint64_t WeakHash_t;//wide enough for every EWeakHashKind
+enum class EWeakHashKind : uint8_t
+{
+    Adler32,//32 bit, the only kind before weakHashKind was recorded
+    RabinKarp64,
+};
 constexpr uint8_t StrongHashBit = 1 << 7;
 constexpr uint8_t FileHashLen = bin_to_hex_length(StrongHashBit / CHAR_BIT);
-//constexpr uint8_t HexNameStrLen = (sizeof(WeakHash_t) * CHAR_BIT + StrongHashBit) / 4 ;
+constexpr uint8_t GetWeakHashSize(EWeakHashKind Kind) {
+    return Kind == EWeakHashKind::RabinKarp64 ? 8 : 4;
+}
+//hex name is the weak hash followed by the strong hash, its length depends on the weak hash kind
+constexpr uint8_t GetHexNameStrLen(EWeakHashKind Kind) {
+    return bin_to_hex_length(GetWeakHashSize(Kind) + StrongHashBit / CHAR_BIT);
+}
+//longest hex name of all kinds
 constexpr uint8_t HexNameStrLen = bin_to_hex_length(sizeof(WeakHash_t) + StrongHashBit/ CHAR_BIT);
-constexpr uint32_t FileChunkSize = 1 << 20;
+constexpr uint32_t FileChunkSize = 1 << 20;//default chunk size, a manifest records the size it was cut with
+constexpr uint32_t MinFileChunkSize = 1 << 16;
+constexpr uint32_t MaxConfigurableFileChunkSize = 1 << 23;
+constexpr bool IsValidFileChunkSize(uint32_t chunkSize) {
+    return std::has_single_bit(chunkSize) && chunkSize >= MinFileChunkSize && chunkSize <= MaxConfigurableFileChunkSize;
+}
+//largest chunk a content-defined chunker may cut
+constexpr uint32_t GetMaxFileChunkSize(uint32_t chunkSize) {
+    return chunkSize * 2;
+}
 
 typedef struct FileChunkData_t {
-    char HexName[HexNameStrLen + 1] ;
     uint64_t StartPos;
+    uint32_t Size{ FileChunkSize };
+    uint32_t ChunkOffset{ 0 };//where the file bytes start inside the chunk
+    bool bPacked{ false };//chunk is a pack of small files, other files own the rest of it
+    char HexName[HexNameStrLen + 1];//last, so the room of the longest kind fits the padding and a chunk stays 72 bytes
     bool operator < (const FileChunkData_t& other) const {
         return StartPos < other.StartPos;
     }
@@ -39,22 +65,35 @@ typedef struct FileChunkDataLess_t {
 }FileChunkDataLess_t;
 
 
+//how a FileHash was taken, hashes of different kinds never compare equal
+enum class EFileHashKind : uint8_t
+{
+    Sequential,//XXH3 of the whole content
+    SplitRanges,//XXH3 of the XXH3 digests of the ranges of a file scanned as several ranges
+};
+
 typedef struct FileChunksData_t {
     typedef std::set<std::shared_ptr<FileChunkData_t>, FileChunkDataLess_t, allocator_save_memory_operator<std::shared_ptr<FileChunkData_t>>> TFileChunks;
     save_memory_operator_string FileName;
     char FileHash[FileHashLen + 1]{0};
+    EFileHashKind FileHashKind{ EFileHashKind::Sequential };
+    bool IsSameFileHash(const FileChunksData_t& other) const {
+        return FileHashKind == other.FileHashKind && memcmp(FileHash, other.FileHash, FileHashLen) == 0;
+    }
     uint64_t FileSize;
     TFileChunks Chunks;
 }FileChunksData_t;
 
 inline std::u8string_view GetHexNameView(char* HexName) {
-    return std::u8string_view((const char8_t*)HexName, HexNameStrLen);
+    return std::u8string_view((const char8_t*)HexName, strnlen(HexName, HexNameStrLen));
 }
 
 typedef struct FolderManifest_t {
     typedef std::unordered_map<std::u8string_view, std::shared_ptr<FileChunksData_t>, string_hash, std::equal_to<>, allocator_save_memory_operator<std::pair<const std::u8string_view, std::shared_ptr<FileChunksData_t>>>> TFiles;
     TFiles Files;
-    uint8_t HexNameLen{ HexNameStrLen };
+    uint8_t HexNameLen{ GetHexNameStrLen(EWeakHashKind::Adler32) };
+    EWeakHashKind WeakHashKind{ EWeakHashKind::Adler32 };
+    uint32_t ChunkSize{ FileChunkSize };
     uint32_t ChunkFileMaxSize{ 0 };
     char ID[bin_to_hex_length(UUID_128_BYTES)+1]{ 0 };
     LIB_FILEBACKUP_EXPORT void to_string(FCharBuffer& charBuf ,std::error_code&ec) const;
@@ -62,22 +101,69 @@ typedef struct FolderManifest_t {
     LIB_FILEBACKUP_EXPORT static int32_t get_string_extra_space();
 }FolderManifest_t;
 
+//what a file looked like when it was chunked, times are nanoseconds since the unix epoch
+typedef struct FileStat_t {
+    uint64_t Size{ 0 };
+    int64_t MTime{ 0 };
+    int64_t CTime{ 0 };//inode change time, change time of the attributes on windows
+    uint64_t Inode{ 0 };//file index on windows
+    bool operator==(const FileStat_t& other) const = default;
+}FileStat_t;
+
+typedef struct FileStatData_t {
+    save_memory_operator_string FileName;
+    FileStat_t Stat;
+}FileStatData_t;
+
+//stats of the files of a manifest, a file with the same stat next time reuses its manifest entry without being read
+typedef struct FileStatCache_t {
+    typedef std::unordered_map<std::u8string_view, std::shared_ptr<FileStatData_t>, string_hash, std::equal_to<>, allocator_save_memory_operator<std::pair<const std::u8string_view, std::shared_ptr<FileStatData_t>>>> TFiles;
+    TFiles Files;
+    int64_t ScanTime{ 0 };//when the stats were taken
+    char ManifestID[bin_to_hex_length(UUID_128_BYTES) + 1]{ 0 };//manifest written with the stats, they are only reused along with it
+    LIB_FILEBACKUP_EXPORT void to_string(FCharBuffer& charBuf, std::error_code& ec) const;
+    LIB_FILEBACKUP_EXPORT static std::shared_ptr<const FileStatCache_t>from_string(FCharBuffer& str, std::error_code& ec);
+    LIB_FILEBACKUP_EXPORT static int32_t get_string_extra_space();
+}FileStatCache_t;
+//a file touched this close before the scan may change again within the timestamp granularity and keep its stat
+constexpr int64_t RacyFileStatWindow = int64_t(2) * 1000 * 1000 * 1000;
+
 enum class EConvertDirection
 {
     None,
     ToFileChunk,
     ToChunkFile
 };
+//zstd parameters of a converter compressing to chunk files
+typedef struct ChunkCompressionProfile_t {
+    int Level{ 1 };//negative levels trade ratio for speed
+    int Strategy{ 0 };//ZSTD_strategy, 0 takes the one of the level
+    bool bLongDistanceMatching{ false };//only finds anything with chunks larger than the level window
+    int WorkerNum{ 0 };//zstd threads per chunk, 0 compresses on the calling thread, ignored by a single thread zstd build
+    bool bStoreIncompressibleRaw{ false };//chunks that do not compress are stored as is behind a raw chunk header, skipping zstd both ways. off by default, readers without raw chunk support fail on them
+}ChunkCompressionProfile_t;
 class IChunkConverter {
 public:
     virtual void* GetChunkFileBuf() = 0;
     virtual void UpdateChunkFileSize(size_t) = 0;
     virtual size_t GetChunkFileSize()const = 0;
     virtual size_t GetChunkFileMaxSize()const = 0;
+    //length of the last decompressed file chunk, 0 when it failed
+    virtual size_t GetFileChunkSize()const = 0;
+    //largest file chunk it will convert, grows the chunk file buffer to fit
+    virtual void UpdateMaxFileChunkSize(size_t) = 0;
     virtual void UpdateConvertDirection(EConvertDirection Direction) = 0;
-    virtual void Convert(const uint8_t* FileChunk) = 0;
+    //takes effect from the next Convert, the chunk file size is 0 after a failed compression
+    virtual void UpdateCompressionProfile(const ChunkCompressionProfile_t& profile) = 0;
+    virtual const ChunkCompressionProfile_t& GetCompressionProfile()const = 0;
+    //FileChunkLen is the content length when compressing, the capacity of FileChunk when decompressing
+    virtual void Convert(const uint8_t* FileChunk, size_t FileChunkLen) = 0;
 };
 LIB_FILEBACKUP_EXPORT std::shared_ptr<IChunkConverter> NewChunkConverter();
+LIB_FILEBACKUP_EXPORT std::shared_ptr<IChunkConverter> NewChunkConverter(const ChunkCompressionProfile_t& profile);
+//levels zstd accepts, others are clamped
+LIB_FILEBACKUP_EXPORT int GetMinCompressionLevel();
+LIB_FILEBACKUP_EXPORT int GetMaxCompressionLevel();
 
 typedef struct ChunkWithFile_t {
     std::shared_ptr<FileChunksData_t> File;
@@ -16,6 +16,11 @@ typedef struct GenFolderMetaDataProcess_t {
     EGenFolderMetaDataStatus Status;
     uint64_t TotalSize;
     uint64_t CompleteSize;
+    //weak hash prefilter, false positive rate is FalsePositives / (Queries - Passes + FalsePositives)
+    uint64_t WeakFilterQueries;
+    uint64_t WeakFilterPasses;
+    uint64_t WeakFilterFalsePositives;
+    const char* WeakHashKernel;//block rolling kernel picked at runtime for the weak hash kind of the task
 }GenFolderMetaDataProcess_t;
 
 typedef struct GenFolderChunkFileMapping_t {
@@ -35,9 +40,26 @@ typedef struct GenFolderChunkFileAttributes_t {
     ERecoverFileAttributes Attributes;
 }GenFolderChunkFileAttributes_t;
 
+typedef struct GenFolderChunkOptions_t {
+    EWeakHashKind WeakHashKind{ EWeakHashKind::Adler32 };
+    uint32_t ChunkSize{ FileChunkSize };//must pass IsValidFileChunkSize, recorded in the manifest
+    uint32_t PackFileSizeThreshold{ 0 };//files smaller than it share pack chunks, 0 disables, at most ChunkSize
+    uint32_t IOThreadNum{ 0 };//threads ticking GenFolderChunkDataGetIOTick, 0 reads files in the returned readFileTick
+    uint32_t IOQueueDepth{ 2 };//reads in flight per device in the io stage
+    bool bIOUring{ true };//io stage reads through io_uring when built with it and the kernel supports it
+    bool bDirectIO{ false };//io_uring reads bypass the page cache where the file system allows it
+    bool bMemoryMapFiles{ false };//scan regular files in place through a memory mapping instead of copying them into the ring buffer
+    bool bDedupeFiles{ false };//files of the same size are hashed first in InitTask, only one of each set of identical files is chunked. reads every candidate before the scan starts
+}GenFolderChunkOptions_t;
+
 typedef struct GenFolderChunkParams_t {
     std::vector<GenFolderChunkFileMapping_t, allocator_save_memory_operator<GenFolderChunkFileMapping_t>> FileMappings;
     std::vector<GenFolderChunkFileAttributes_t, allocator_save_memory_operator<GenFolderChunkFileAttributes_t>> FileAttributes;
+    GenFolderChunkOptions_t Options;
+    //incremental scan, a file whose stat matches StatCache takes its chunks and hash from PreviousManifest instead of being read
+    //ignored unless the manifest was cut with the same chunk size and weak hash kind
+    std::shared_ptr<const FolderManifest_t> PreviousManifest;
+    std::shared_ptr<const FileStatCache_t> StatCache;
 }GenFolderChunkParams_t;
 
 class  IFileBackupManagerInterface {
@@ -45,6 +67,7 @@ public:
 
     typedef std::function<void(EGenFolderMetaDataStatus,std::error_code&)> TGenFolderMetaDataStatusChangedDelegate;
     virtual CommonHandle32_t GenFolderChunkData(const char8_t* path, TGenFolderMetaDataStatusChangedDelegate Delegate) = 0;
+    virtual CommonHandle32_t GenFolderChunkData(const char8_t* path, const GenFolderChunkOptions_t& options, TGenFolderMetaDataStatusChangedDelegate Delegate) = 0;
     virtual CommonHandle32_t GenFolderChunkData(GenFolderChunkParams_t& params, TGenFolderMetaDataStatusChangedDelegate Delegate) = 0;
 
     typedef std::function<void(std::error_code&)> TGenFolderMetaDataCanceledDelegate;
@@ -52,6 +75,11 @@ public:
     virtual void InitTask(CommonHandle32_t) = 0;
     typedef std::function<bool(char8_t*,uint32_t&)> TGetNextHashPairCB;
     virtual bool GenFolderChunkDataAddHash(CommonHandle32_t handle, TGetNextHashPairCB) = 0;
+    //chunks kept outside the chunk store, found like the others but left out of the saved chunk id index
+    virtual bool GenFolderChunkDataAddExternalHash(CommonHandle32_t handle, TGetNextHashPairCB) = 0;
+    //known chunks from a chunk id index file mapped in place instead of added one by one, call before InitTask
+    //false if it is missing or written for another weak hash kind, nothing is loaded then
+    virtual bool GenFolderChunkDataLoadChunkIDIndex(CommonHandle32_t handle, std::u8string_view path) = 0;
 
     //multithreading
     typedef std::function<void()> TOneFileChunkDataTask;
@@ -69,8 +97,24 @@ public:
     virtual std::shared_ptr<const GenFolderMetaDataProcess_t> GenFolderChunkDataGetProgress(CommonHandle32_t handle) = 0;
     virtual std::shared_ptr<const FolderManifest_t> GetFolderChunkData(CommonHandle32_t handle) = 0;
     virtual std::optional<std::reference_wrapper<std::unordered_map<std::u8string_view, std::string>>>  GetFolderChunkLocalFileMap(CommonHandle32_t handle) = 0;
+    //stats of every file taken when the task was inited, save it with the manifest as the next StatCache
+    virtual std::shared_ptr<const FileStatCache_t> GetFolderStatCache(CommonHandle32_t handle) = 0;
+    //once finished, write the loaded index and every chunk of the store the task knows to path as the next chunk id index.
+    //those are the added hashes, the chunks of reused files and the new chunks, not the external hashes
+    virtual bool SaveFolderChunkIDIndex(CommonHandle32_t handle, std::u8string_view path) = 0;
 
     virtual void Tick(float delta)=0;
+    //multithreading, with IOThreadNum set files are read here instead of readFileTick, get one per thread and tick each on its own thread
+    typedef std::function<void(float)> TGenFolderChunkDataIOTick;
+    virtual TGenFolderChunkDataIOTick GenFolderChunkDataGetIOTick(CommonHandle32_t handle) = 0;
+};
+
+enum class EFileBackupChunkMode
+{
+    GatherAll,//fixed size chunks, plus every window that matches a known chunk
+    MinChunk,//fixed size chunks that realign to known chunks
+    FastCDC,//content-defined chunks cut by a gear hash
 };
 
-LIB_FILEBACKUP_EXPORT IFileBackupManagerInterface* GetFileBackupManagerSingleton();
\ No newline at end of file
+LIB_FILEBACKUP_EXPORT IFileBackupManagerInterface* GetFileBackupManagerSingleton();
+LIB_FILEBACKUP_EXPORT IFileBackupManagerInterface* GetFileBackupManagerSingleton(EFileBackupChunkMode Mode);
\ No newline at end of file
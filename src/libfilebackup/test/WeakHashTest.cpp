@@ -0,0 +1,172 @@
+#include "FileBackupInternal.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+#include <iostream>
+
+namespace {
+    constexpr uint32_t WindowLen = 4096;
+    constexpr uint32_t DataLen = 1 << 20;
+    //every KnownStep-th window is a chunk of the index, the rest are mostly rejected by the filter
+    constexpr uint32_t KnownStep = 997;
+
+    std::vector<uint8_t> GenData() {
+        std::vector<uint8_t> data(DataLen);
+        uint64_t state = 0x5EEDDA7A5EEDULL;
+        for (auto& byte : data) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            byte = uint8_t(state >> 56);
+        }
+        return data;
+    }
+
+    //window hash of every position past the first window, one position per call
+    template<typename THasher>
+    std::vector<WeakHash_t> RollPerByte(const std::vector<uint8_t>& data) {
+        std::vector<WeakHash_t> hashes;
+        hashes.reserve(data.size() - WindowLen);
+        if constexpr (std::is_same_v<THasher, FBlockRollingAdler32>) {
+            FRollingAdler32 hasher;
+            hasher.Init(data.data(), WindowLen);
+            for (uint32_t i = 0; i + WindowLen < data.size(); i++) {
+                hasher.Roll(data[i + WindowLen], data[i]);
+                hashes.push_back(hasher.Get());
+            }
+        }
+        else {
+            THasher hasher;
+            hasher.Init(data.data(), WindowLen);
+            for (uint32_t i = 0; i + WindowLen < data.size(); i++) {
+                WeakHash_t hash;
+                hasher.RollBlock(data.data() + WindowLen + i, data.data() + i, 1, &hash);
+                hashes.push_back(hash);
+            }
+        }
+        return hashes;
+    }
+
+    template<typename THasher>
+    std::vector<WeakHash_t> RollBatched(const std::vector<uint8_t>& data) {
+        std::vector<WeakHash_t> hashes(data.size() - WindowLen);
+        THasher hasher;
+        hasher.Init(data.data(), WindowLen);
+        for (uint32_t i = 0; i < hashes.size(); i += THasher::MaxBlockLen) {
+            auto blockLen = std::min<uint32_t>(THasher::MaxBlockLen, uint32_t(hashes.size() - i));
+            hasher.RollBlock(data.data() + WindowLen + i, data.data() + i, blockLen, hashes.data() + i);
+        }
+        return hashes;
+    }
+
+    void FillIndex(FChunkIndex& index, EWeakHashKind kind, const std::vector<WeakHash_t>& hashes) {
+        index.SetWeakHashKind(kind);
+        index.Reserve(hashes.size() / KnownStep + 1);
+        for (uint32_t i = 0; i < hashes.size(); i += KnownStep) {
+            unsigned char strongHash[16]{};
+            memcpy(strongHash, &i, sizeof(i));
+            index.Insert(ChunkKey_t::FromCanonical(hashes[i], strongHash));
+        }
+        index.InitFilter(hashes.size() / KnownStep + 1);
+    }
+
+    //positions the batched filter lets through and that the index knows
+    uint64_t ScanBatched(const FChunkIndex& index, const std::vector<WeakHash_t>& hashes, WeakFilterStat_t& stat) {
+        uint64_t found{ 0 };
+        for (uint32_t i = 0; i < hashes.size(); i += 64) {
+            auto blockLen = std::min<uint32_t>(64, uint32_t(hashes.size() - i));
+            auto mask = index.MayContainWeakBlock(hashes.data() + i, blockLen, stat);
+            for (; mask; mask &= mask - 1) {
+                found += index.ContainsWeakPassed(hashes[i + std::countr_zero(mask)], stat);
+            }
+        }
+        return found;
+    }
+
+    //the scan loop of the strategies, one block is rolled and probed at a time
+    template<typename THasher>
+    uint64_t RollScanBatched(const FChunkIndex& index, const std::vector<uint8_t>& data, WeakFilterStat_t& stat) {
+        THasher hasher;
+        hasher.Init(data.data(), WindowLen);
+        WeakHash_t hashes[THasher::MaxBlockLen];
+        uint64_t found{ 0 };
+        for (uint32_t i = 0; i + WindowLen < data.size(); i += THasher::MaxBlockLen) {
+            auto blockLen = std::min<uint32_t>(THasher::MaxBlockLen, uint32_t(data.size() - WindowLen - i));
+            hasher.RollBlock(data.data() + WindowLen + i, data.data() + i, blockLen, hashes);
+            auto mask = index.MayContainWeakBlock(hashes, blockLen, stat);
+            for (; mask; mask &= mask - 1) {
+                found += index.ContainsWeakPassed(hashes[std::countr_zero(mask)], stat);
+            }
+        }
+        return found;
+    }
+
+    uint64_t ScanPerByte(const FChunkIndex& index, const std::vector<WeakHash_t>& hashes, WeakFilterStat_t& stat) {
+        uint64_t found{ 0 };
+        for (auto hash : hashes) {
+            found += index.ContainsWeak(hash, stat);
+        }
+        return found;
+    }
+
+    template<typename THasher>
+    void CheckBatchedMatchesPerByte() {
+        auto data = GenData();
+        auto perByte = RollPerByte<THasher>(data);
+        auto batched = RollBatched<THasher>(data);
+        REQUIRE(batched == perByte);
+        //a rolled hash is the hash of its window
+        for (uint32_t i = 0; i < batched.size(); i += KnownStep) {
+            REQUIRE(batched[i] == THasher::Hash(data.data() + i + 1, WindowLen));
+        }
+
+        FChunkIndex index;
+        FillIndex(index, THasher::Kind, perByte);
+        WeakFilterStat_t perByteStat, batchedStat;
+        auto perByteFound = ScanPerByte(index, perByte, perByteStat);
+        auto batchedFound = ScanBatched(index, batched, batchedStat);
+        WeakFilterStat_t rollStat;
+        CHECK(RollScanBatched<THasher>(index, data, rollStat) == perByteFound);
+        CHECK(perByteFound >= perByte.size() / KnownStep);
+        CHECK(batchedFound == perByteFound);
+        CHECK(batchedStat.Queries == perByteStat.Queries);
+        CHECK(batchedStat.Passes == perByteStat.Passes);
+        CHECK(batchedStat.FalsePositives == perByteStat.FalsePositives);
+    }
+}
+
+TEST_CASE("adler32 block rolling matches per byte rolling", "[weakhash]") {
+    std::cout << "adler32 rolling kernel: " << FBlockRollingAdler32::GetKernelName() << std::endl;
+    CHECK(FBlockRollingAdler32::IsCompatible());
+    CheckBatchedMatchesPerByte<FBlockRollingAdler32>();
+}
+
+TEST_CASE("rabin-karp block rolling matches per byte rolling", "[weakhash]") {
+    CheckBatchedMatchesPerByte<FBlockRollingRabinKarp64>();
+}
+
+TEST_CASE("weak hash scan", "[.][benchmark][weakhash]") {
+    auto data = GenData();
+    auto hashes = RollPerByte<FBlockRollingAdler32>(data);
+    FChunkIndex index;
+    FillIndex(index, EWeakHashKind::Adler32, hashes);
+
+    BENCHMARK("adler32 per byte roll + lookup") {
+        WeakFilterStat_t stat;
+        FRollingAdler32 hasher;
+        hasher.Init(data.data(), WindowLen);
+        uint64_t found{ 0 };
+        for (uint32_t i = 0; i + WindowLen < data.size(); i++) {
+            hasher.Roll(data[i + WindowLen], data[i]);
+            found += index.ContainsWeak(hasher.Get(), stat);
+        }
+        return found;
+    };
+    BENCHMARK("adler32 batched roll + filter") {
+        WeakFilterStat_t stat;
+        return RollScanBatched<FBlockRollingAdler32>(index, data, stat);
+    };
+    BENCHMARK("rabin-karp batched roll + filter") {
+        WeakFilterStat_t stat;
+        return RollScanBatched<FBlockRollingRabinKarp64>(index, data, stat);
+    };
+}
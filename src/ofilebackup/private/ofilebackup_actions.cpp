@@ -12,62 +12,172 @@
 #include <assert.h>
 #include <filesystem>
 #include <numeric>
+#include <algorithm>
 #include <queue>
 #include <fstream>
 #include <iostream>
 #include <cstring>
 
-std::tuple< bool, std::shared_ptr<const FolderManifest_t>> gen_folder_manifest_by_chunklist(std::u8string_view workPathStr, std::vector<std::string>& hexNameList, std::u8string_view chunkOutPathStr, TChunkCompleteDelegate Delegate) {
+bool parse_chunk_mode(std::string_view chunkModeStr, EFileBackupChunkMode& outChunkMode) {
+    if (chunkModeStr == "gather_all") {
+        outChunkMode = EFileBackupChunkMode::GatherAll;
+    }
+    else if (chunkModeStr == "min_chunk") {
+        outChunkMode = EFileBackupChunkMode::MinChunk;
+    }
+    else if (chunkModeStr == "fastcdc") {
+        outChunkMode = EFileBackupChunkMode::FastCDC;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_chunk_store_kind(std::string_view chunkStoreKindStr, EChunkStoreKind& outChunkStoreKind) {
+    if (chunkStoreKindStr == "auto") {
+        outChunkStoreKind = EChunkStoreKind::Auto;
+    }
+    else if (chunkStoreKindStr == "dir") {
+        outChunkStoreKind = EChunkStoreKind::Dir;
+    }
+    else if (chunkStoreKindStr == "pack") {
+        outChunkStoreKind = EChunkStoreKind::Pack;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_compression_strategy(std::string_view strategyStr, int& outStrategy) {
+    //ZSTD_strategy order, fast is 1
+    constexpr std::string_view strategyNames[] = { "default", "fast", "dfast", "greedy", "lazy", "lazy2", "btlazy2", "btopt", "btultra", "btultra2" };
+    auto itr = std::find(std::begin(strategyNames), std::end(strategyNames), strategyStr);
+    if (itr == std::end(strategyNames)) {
+        return false;
+    }
+    outStrategy = int(itr - std::begin(strategyNames));
+    return true;
+}
+
+bool parse_weak_hash_kind(std::string_view weakHashKindStr, EWeakHashKind& outWeakHashKind) {
+    if (weakHashKindStr == "adler32") {
+        outWeakHashKind = EWeakHashKind::Adler32;
+    }
+    else if (weakHashKindStr == "rabinkarp64") {
+        outWeakHashKind = EWeakHashKind::RabinKarp64;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+std::tuple< bool, std::shared_ptr<const FolderManifest_t>, std::shared_ptr<const FileStatCache_t>> gen_folder_manifest_by_chunklist(std::u8string_view workPathStr, std::vector<std::string>& hexNameList, std::u8string_view chunkOutPathStr, TChunkCompleteDelegate Delegate, EFileBackupChunkMode chunkMode, const GenFolderChunkOptions_t& chunkOptions, std::shared_ptr<const FolderManifest_t> previousManifest, std::shared_ptr<const FileStatCache_t> statCache, EChunkStoreKind chunkStoreKind, bool bChunkIDIndex, const ChunkCompressionOptions_t& compressionOptions) {
     bool bExit{ false };
     std::error_code ec;
     std::shared_ptr<const FolderManifest_t> out;
-    IFileBackupManagerInterface* FileBackupManager = GetFileBackupManagerSingleton();
-    CommonHandle32_t workHandle = FileBackupManager->GenFolderChunkData(workPathStr.data(),
+    std::shared_ptr<const FileStatCache_t> outStatCache;
+    //kept in the chunk dir so it only ever describes that store
+    bChunkIDIndex = bChunkIDIndex && !chunkOutPathStr.empty();
+    std::filesystem::path chunkIDIndexPath = std::filesystem::path(chunkOutPathStr) / ChunkIDIndexFileName;
+    //written next to the index when the task finishes, renamed over it once its chunks are stored
+    std::filesystem::path newChunkIDIndexPath(chunkIDIndexPath);
+    newChunkIDIndexPath += ".new";
+    bool bChunkIDIndexSaved{ false };
+    if (!std::filesystem::exists(std::filesystem::path(workPathStr), ec)) {
+        return { false ,nullptr, nullptr };
+    }
+    IFileBackupManagerInterface* FileBackupManager = GetFileBackupManagerSingleton(chunkMode);
+    GenFolderChunkParams_t params;
+    auto& fileMapping = params.FileMappings.emplace_back();
+    fileMapping.RootPath = ConvertU8ViewToView(workPathStr);
+    fileMapping.RelativeGlobPath = "*";
+    fileMapping.bRecursive = true;
+    fileMapping.TargetRelativePath = ".";
+    params.Options = chunkOptions;
+    params.PreviousManifest = previousManifest;
+    params.StatCache = statCache;
+    CommonHandle32_t workHandle = FileBackupManager->GenFolderChunkData(params,
         [&](EGenFolderMetaDataStatus status, std::error_code& ec) {
             switch (status) {
             case EGenFolderMetaDataStatus::Finished:
                 bExit = true;
                 if (!ec) {
-                    out=GetFileBackupManagerSingleton()->GetFolderChunkData(workHandle);
+                    out=FileBackupManager->GetFolderChunkData(workHandle);
+                    outStatCache = FileBackupManager->GetFolderStatCache(workHandle);
+                    if (bChunkIDIndex) {
+                        bChunkIDIndexSaved = FileBackupManager->SaveFolderChunkIDIndex(workHandle, newChunkIDIndexPath.u8string());
+                    }
+                }
+                //the work data is released by the tick that reported Finished, so the counters are only readable here
+                if (auto process = FileBackupManager->GenFolderChunkDataGetProgress(workHandle); process && process->WeakFilterQueries > 0) {
+                    auto negatives = process->WeakFilterQueries - process->WeakFilterPasses + process->WeakFilterFalsePositives;
+                    std::cerr << "\rweak filter: " << process->WeakFilterQueries << " queries, " << process->WeakFilterPasses << " passed, "
+                        << process->WeakFilterFalsePositives << " false positives (" << (negatives ? double(process->WeakFilterFalsePositives) / negatives : 0.0) << "), "
+                        << process->WeakHashKernel << " rolling kernel" << std::endl;
                 }
                 break;
             }
 
         }
     );
-    auto hexNameItr = hexNameList.begin();
-    bool bAddHashRes{ true };
-    bAddHashRes = FileBackupManager->GenFolderChunkDataAddHash(workHandle,
-        [&](char8_t* hexName, uint32_t& hexNameLen)->bool {
-            while (hexNameItr != hexNameList.end()) {
-                if (hexNameLen < (*hexNameItr).length()) {
-                    hexNameItr++;
-                    continue;
-                }
+    std::shared_ptr<IChunkStore> pChunkStore;
+    if (!chunkOutPathStr.empty()) {
+        pChunkStore = OpenChunkStore(chunkOutPathStr, chunkStoreKind, ec);
+        if (!pChunkStore) {
+            return { false ,nullptr, nullptr };
+        }
+    }
+    //the index of an earlier run stands for the chunks of the store, which is then not listed
+    bool bChunkIDIndexLoaded = bChunkIDIndex && FileBackupManager->GenFolderChunkDataLoadChunkIDIndex(workHandle, chunkIDIndexPath.u8string());
+    std::vector<std::string> storeNameList;
+    if (pChunkStore && !bChunkIDIndexLoaded) {
+        pChunkStore->ForEachName([&](std::u8string_view hexName) {
+            storeNameList.emplace_back((const char*)hexName.data(), hexName.size());
+            });
+    }
+    auto addNameList = [&](std::vector<std::string>& nameList, bool bExternal) {
+        auto hexNameItr = nameList.begin();
+        auto nextNameFunc = [&](char8_t* hexName, uint32_t& hexNameLen)->bool {
+            while (hexNameItr != nameList.end() && hexNameLen < (*hexNameItr).length()) {
+                hexNameItr++;
             }
-            if (hexNameItr == hexNameList.end()) {
+            if (hexNameItr == nameList.end()) {
                 return false;
             }
             hexNameLen = (*hexNameItr).length();
             memcpy(hexName, (*hexNameItr).c_str(), hexNameLen);
+            hexNameItr++;
             return true;
-        }
-    );
-    if (!bAddHashRes) {
-        return { false ,nullptr };
+            };
+        return bExternal ? FileBackupManager->GenFolderChunkDataAddExternalHash(workHandle, nextNameFunc)
+            : FileBackupManager->GenFolderChunkDataAddHash(workHandle, nextNameFunc);
+        };
+    //the chunk list names chunks kept elsewhere, they are not saved into the index of this store
+    if (!addNameList(storeNameList, false) || !addNameList(hexNameList, true)) {
+        return { false ,nullptr, nullptr };
     }
     FileBackupManager->InitTask(workHandle);
-    std::filesystem::path chunkOutPath(chunkOutPathStr);
-    if (!chunkOutPathStr.empty() && !std::filesystem::exists(chunkOutPath, ec)) {
-        std::filesystem::create_directories(chunkOutPath);
-    }
 
     uint8_t ParallelTaskNum = std::max(1, int(std::thread::hardware_concurrency()) - 1);
     FTaskSlotCounter<void> TaskCounter(ParallelTaskNum);
+    //workers hand new chunks over and keep scanning, zstd and the chunk file writes run on the pipeline threads
+    std::shared_ptr<IChunkStorePipeline> pChunkStorePipeline;
+    if (pChunkStore) {
+        ChunkStorePipelineOptions_t storeOptions;
+        storeOptions.CompressThreadNum = std::max(1u, std::thread::hardware_concurrency() / 2);
+        storeOptions.BufNum = ParallelTaskNum * 4 + storeOptions.CompressThreadNum;
+        storeOptions.MaxFileChunkSize = GetMaxFileChunkSize(chunkOptions.ChunkSize);
+        storeOptions.Compression = compressionOptions;
+        pChunkStorePipeline = NewChunkStorePipeline(pChunkStore, storeOptions);
+    }
     typedef struct TaskData_t {
         WorkflowHandle_t WorkflowHandle{ NullHandle };
         IFileBackupManagerInterface::TOneFileChunkDataPostProcessingTask PostTask;
         CommonTaskHandle_t ReadTickHandle;
+        bool bReadTick{ false };
     }TaskData_t;
     std::vector<TaskData_t> taskDataList(ParallelTaskNum);
     for (auto& taskData : taskDataList)
@@ -81,7 +191,9 @@ std::tuple< bool, std::shared_ptr<const FolderManifest_t>> gen_folder_manifest_b
             auto& finishedSlots = TaskCounter.CheckFinished();
             for (auto& slot : finishedSlots) {
                 taskDataList[slot.ID].PostTask();
-                GetTaskManagerSingleton()->RemoveTask(taskDataList[slot.ID].ReadTickHandle);
+                if (taskDataList[slot.ID].bReadTick) {
+                    GetTaskManagerSingleton()->RemoveTask(taskDataList[slot.ID].ReadTickHandle);
+                }
             }
 
             auto IDopt = TaskCounter.GetFreeSlot();
@@ -89,16 +201,8 @@ std::tuple< bool, std::shared_ptr<const FolderManifest_t>> gen_folder_manifest_b
                 auto i = *IDopt;
                 auto [task, readFileTick, postTask] = FileBackupManager->GenFolderChunkDataGetNextFileTask(workHandle,
                     [&](IChunkConverter* ChunkConverter, std::span<const char8_t> name, std::span<const char> content) {
-                        if (!chunkOutPathStr.empty()) {
-                            auto outFilePath = chunkOutPath / std::u8string_view(name.data(), name.size());
-                            std::ofstream ofs(outFilePath, std::ios::binary);
-                            if (ofs.is_open()) {
-                                ChunkConverter->Convert((const uint8_t*)content.data());
-                                auto ChunkFileBuf = ChunkConverter->GetChunkFileBuf();
-                                auto ChunkFileLen = ChunkConverter->GetChunkFileSize();
-                                ofs.write((const char*)ChunkFileBuf, ChunkFileLen);
-                                ofs.close();
-                            }
+                        if (pChunkStorePipeline) {
+                            pChunkStorePipeline->Enqueue(name, content);
                         }
                         auto process = FileBackupManager->GenFolderChunkDataGetProgress(workHandle);
                         if (Delegate) {
@@ -110,7 +214,11 @@ std::tuple< bool, std::shared_ptr<const FolderManifest_t>> gen_folder_manifest_b
                     auto [newhandle, newf] = GetTaskManagerSingleton()->AddTask(taskDataList[i].WorkflowHandle, task);
                     taskDataList[i].PostTask = postTask;
                     TaskCounter.SetFuture(i, newhandle, newf);
-                    taskDataList[i].ReadTickHandle = GetTaskManagerSingleton()->AddTick(GetTaskManagerSingleton()->GetMainThread(), readFileTick);
+                    //null when the io stage reads the file
+                    taskDataList[i].bReadTick = bool(readFileTick);
+                    if (readFileTick) {
+                        taskDataList[i].ReadTickHandle = GetTaskManagerSingleton()->AddTick(GetTaskManagerSingleton()->GetMainThread(), readFileTick);
+                    }
                 }
                 if (bExit) {
                     GetTaskManagerSingleton()->Stop();
@@ -118,20 +226,76 @@ std::tuple< bool, std::shared_ptr<const FolderManifest_t>> gen_folder_manifest_b
             }
         }
     );
+    //io stage, each workflow reads for all in-flight tasks so the tick thread only coordinates
+    std::vector<WorkflowHandle_t> ioWorkflowHandles;
+    //one tick per thread, an io_uring backed tick owns its ring
+    for (uint32_t i = 0; i < chunkOptions.IOThreadNum; i++) {
+        auto ioTick = FileBackupManager->GenFolderChunkDataGetIOTick(workHandle);
+        if (!ioTick) {
+            break;
+        }
+        auto ioHandle = ioWorkflowHandles.emplace_back(GetTaskManagerSingleton()->NewWorkflow());
+        GetTaskManagerSingleton()->AddTick(ioHandle, ioTick);
+    }
     FunctionExitHelper_t ExitHelper([&]() {
         for (auto& taskData : taskDataList)
         {
             GetTaskManagerSingleton()->ReleaseWorkflow(taskData.WorkflowHandle);
         }
+        for (auto& ioHandle : ioWorkflowHandles) {
+            GetTaskManagerSingleton()->ReleaseWorkflow(ioHandle);
+        }
         GetTaskManagerSingleton()->RemoveTask(tickHandle);
         });
     GetTaskManagerSingleton()->Run();
-    return { true, out };
+    if (pChunkStorePipeline && pChunkStorePipeline->Finish()) {
+        return { false ,nullptr, nullptr };
+    }
+    //a pack store only knows its new chunks on the next open once its index is written
+    if (pChunkStore && pChunkStore->Flush()) {
+        return { false ,nullptr, nullptr };
+    }
+    //the old index stays when this one could not be written, the next run then only stores some chunks again
+    if (bChunkIDIndexSaved) {
+        std::filesystem::rename(newChunkIDIndexPath, chunkIDIndexPath, ec);
+    }
+    return { true, out, outStatCache };
 }
-bool gen_folder_manifest_action(std::u8string_view workPathStr, std::u8string_view chunkListPathStr, std::u8string_view chunkOutPathStr, std::u8string_view manifestFilePathStr) {
+bool gen_folder_manifest_action(std::u8string_view workPathStr, std::u8string_view chunkListPathStr, std::u8string_view chunkOutPathStr, std::u8string_view manifestFilePathStr, EFileBackupChunkMode chunkMode, const GenFolderChunkOptions_t& chunkOptions, std::u8string_view previousManifestPathStr, std::u8string_view statCachePathStr, EChunkStoreKind chunkStoreKind, bool bChunkIDIndex, const ChunkCompressionOptions_t& compressionOptions) {
 
     std::vector<std::string> hexNameList;
     std::error_code ec;
+    std::shared_ptr<const FolderManifest_t> pPreviousManifest;
+    std::shared_ptr<const FileStatCache_t> pStatCache;
+    if (!previousManifestPathStr.empty()) {
+        FRawFile previousManifestFile;
+        if (previousManifestFile.Open(previousManifestPathStr, UTIL_OPEN_EXISTING) != ERR_SUCCESS) {
+            return false;
+        }
+        auto& charBuf = *FCharBuffer::GetThreadSingleton();
+        if (!LoadFileToCharBuffer(previousManifestFile, charBuf, FolderManifest_t::get_string_extra_space())) {
+            return false;
+        }
+        pPreviousManifest = FolderManifest_t::from_string(charBuf, ec);
+        if (ec) {
+            return false;
+        }
+    }
+    //no cache yet on the first run, every file is read
+    if (!statCachePathStr.empty() && std::filesystem::exists(std::filesystem::path(statCachePathStr), ec)) {
+        FRawFile statCacheFile;
+        if (statCacheFile.Open(statCachePathStr, UTIL_OPEN_EXISTING) != ERR_SUCCESS) {
+            return false;
+        }
+        auto& charBuf = *FCharBuffer::GetThreadSingleton();
+        if (!LoadFileToCharBuffer(statCacheFile, charBuf, FileStatCache_t::get_string_extra_space())) {
+            return false;
+        }
+        pStatCache = FileStatCache_t::from_string(charBuf, ec);
+        if (ec) {
+            return false;
+        }
+    }
     if (!chunkListPathStr.empty()) {
         std::filesystem::path chunkListPath(chunkListPathStr);
         if (!std::filesystem::exists(chunkListPath, ec) || ec) {
@@ -143,27 +307,23 @@ bool gen_folder_manifest_action(std::u8string_view workPathStr, std::u8string_vi
             hexNameList.push_back(line);
         }
     }
-    if (!chunkOutPathStr.empty()) {
-        DirUtil::IterateDir(chunkOutPathStr,
-            [&](DirEntry_t& entry)->bool {
-                if (entry.bDir) {
-                    return true;
-                }
-                hexNameList.push_back(entry.pPathBuf->FileName());
-                return true;
-            },
-            0);
-    }
-    auto [res, pFolderManifest] = gen_folder_manifest_by_chunklist(workPathStr, hexNameList, chunkOutPathStr,
+    auto [res, pFolderManifest, pOutStatCache] = gen_folder_manifest_by_chunklist(workPathStr, hexNameList, chunkOutPathStr,
         [](CompleteChunkData_t CompleteChunkData, GenProcessData_t GenProcessData) {
             GetTaskManagerSingleton()->AddTask(GetTaskManagerSingleton()->GetMainThread(),
                 [GenProcessData]() {
                     std::cout << "\r" << GenProcessData.CompleteSize << "/" << GenProcessData.TotalSize << std::flush;
                 }
             );
-        }
+        },
+        chunkMode,
+        chunkOptions,
+        pPreviousManifest,
+        pStatCache,
+        chunkStoreKind,
+        bChunkIDIndex,
+        compressionOptions
     );
-    if (!res) {
+    if (!res || !pFolderManifest) {
         return false;
     }
     auto& charBuf = *FCharBuffer::GetThreadSingleton();
@@ -188,10 +348,73 @@ bool gen_folder_manifest_action(std::u8string_view workPathStr, std::u8string_vi
         ofs << charBuf.View();
         ofs.close();
     }
+    if (!statCachePathStr.empty() && pOutStatCache) {
+        charBuf.Clear();
+        pOutStatCache->to_string(charBuf, ec);
+        if (ec) {
+            return false;
+        }
+        std::filesystem::path statCachePath(statCachePathStr);
+        std::filesystem::create_directories(statCachePath.parent_path(), ec);
+        if (ec) {
+            return false;
+        }
+        std::ofstream ofs(statCachePath, std::ios::binary);
+        if (!ofs.is_open()) {
+            return false;
+        }
+        ofs << charBuf.View();
+        ofs.close();
+    }
     return true;
 }
 
 
+bool migrate_chunk_store(std::u8string_view sourceDirStr, std::u8string_view targetDirStr, EChunkStoreKind targetKind)
+{
+    std::error_code ec;
+    std::filesystem::path sourceDir(sourceDirStr);
+    if (!std::filesystem::is_directory(sourceDir, ec)) {
+        return false;
+    }
+    auto pSourceStore = OpenChunkStore(sourceDirStr, EChunkStoreKind::Auto, ec);
+    if (!pSourceStore) {
+        return false;
+    }
+    auto pTargetStore = OpenChunkStore(targetDirStr, targetKind, ec);
+    if (!pTargetStore) {
+        return false;
+    }
+    std::vector<std::string> hexNameList;
+    pSourceStore->ForEachName([&](std::u8string_view hexName) {
+        hexNameList.emplace_back((const char*)hexName.data(), hexName.size());
+        });
+    std::vector<char> chunkFileBuf(NewChunkConverter()->GetChunkFileMaxSize());
+    uint64_t count{ 0 };
+    for (auto& hexName : hexNameList) {
+        std::u8string_view hexNameView((const char8_t*)hexName.data(), hexName.size());
+        size_t chunkFileLen{ 0 };
+        if (!pSourceStore->Get(hexNameView, chunkFileBuf.data(), chunkFileBuf.size(), chunkFileLen)) {
+            //too small for this chunk file, chunkFileLen is its length
+            if (chunkFileLen <= chunkFileBuf.size()) {
+                return false;
+            }
+            chunkFileBuf.resize(chunkFileLen);
+            if (!pSourceStore->Get(hexNameView, chunkFileBuf.data(), chunkFileBuf.size(), chunkFileLen)) {
+                return false;
+            }
+        }
+        if (!pTargetStore->Put(hexNameView, { chunkFileBuf.data(), chunkFileLen })) {
+            return false;
+        }
+        if (++count % 1024 == 0 || count == hexNameList.size()) {
+            std::cout << "\r" << count << "/" << hexNameList.size() << std::flush;
+        }
+    }
+    std::cout << std::endl;
+    return !pTargetStore->Flush();
+}
+
 bool compare_folder_manifest(std::u8string_view sourcePathStr, std::u8string_view targetPathStr, std::u8string_view outFilePathStr) {
     std::error_code ec;
     FRawFile sourceFile;
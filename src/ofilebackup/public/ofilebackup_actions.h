@@ -5,6 +5,10 @@
 #include <functional>
 #include <memory>
 #include <FileBackupCommon.h>
+#include <FileBackupManager.h>
+#include <ChunkStore.h>
+#include <ChunkStorePipeline.h>
+#include <string_view>
 typedef struct CompleteChunkData_t{
     const char8_t* name;
     uint32_t namelen;
@@ -16,7 +20,16 @@ typedef struct GenProcessData_t{
     uint64_t CompleteSize;
 }GenProcessData_t;
 typedef std::function<void(CompleteChunkData_t, GenProcessData_t)> TChunkCompleteDelegate;
-std::tuple< bool, std::shared_ptr<const FolderManifest_t>> gen_folder_manifest_by_chunklist(std::u8string_view workPathStr, std::vector<std::string>& hexNameList, std::u8string_view chunkOutPathStr, TChunkCompleteDelegate Delegate=nullptr);
-bool gen_folder_manifest_action(std::u8string_view workPath, std::u8string_view chunkListPathStr, std::u8string_view chunkOutPathStr, std::u8string_view manifestOutPathStr);
+bool parse_chunk_mode(std::string_view chunkModeStr, EFileBackupChunkMode& outChunkMode);
+bool parse_weak_hash_kind(std::string_view weakHashKindStr, EWeakHashKind& outWeakHashKind);
+bool parse_chunk_store_kind(std::string_view chunkStoreKindStr, EChunkStoreKind& outChunkStoreKind);
+//zstd strategy name, fast to btultra2, or default
+bool parse_compression_strategy(std::string_view strategyStr, int& outStrategy);
+//previousManifest and statCache make the scan incremental, the returned stat cache is the one for the next run
+std::tuple< bool, std::shared_ptr<const FolderManifest_t>, std::shared_ptr<const FileStatCache_t>> gen_folder_manifest_by_chunklist(std::u8string_view workPathStr, std::vector<std::string>& hexNameList, std::u8string_view chunkOutPathStr, TChunkCompleteDelegate Delegate=nullptr, EFileBackupChunkMode chunkMode = EFileBackupChunkMode::GatherAll, const GenFolderChunkOptions_t& chunkOptions = {}, std::shared_ptr<const FolderManifest_t> previousManifest = nullptr, std::shared_ptr<const FileStatCache_t> statCache = nullptr, EChunkStoreKind chunkStoreKind = EChunkStoreKind::Auto, bool bChunkIDIndex = false, const ChunkCompressionOptions_t& compressionOptions = {});
+//the stat cache is read if it exists and rewritten with the manifest
+bool gen_folder_manifest_action(std::u8string_view workPath, std::u8string_view chunkListPathStr, std::u8string_view chunkOutPathStr, std::u8string_view manifestOutPathStr, EFileBackupChunkMode chunkMode = EFileBackupChunkMode::GatherAll, const GenFolderChunkOptions_t& chunkOptions = {}, std::u8string_view previousManifestPathStr = {}, std::u8string_view statCachePathStr = {}, EChunkStoreKind chunkStoreKind = EChunkStoreKind::Auto, bool bChunkIDIndex = false, const ChunkCompressionOptions_t& compressionOptions = {});
 bool compare_folder_manifest(std::u8string_view sourcePath, std::u8string_view targetPath, std::u8string_view outFilePathStr);
+//copies every chunk of one store into another, a chunk dir into a pack store to start with
+bool migrate_chunk_store(std::u8string_view sourceDirStr, std::u8string_view targetDirStr, EChunkStoreKind targetKind = EChunkStoreKind::Pack);
 EFileBackupError recover_folder(std::u8string_view workPathStr, std::u8string_view manifestFilePathStr, std::u8string_view sourceManifestFilePathStr, std::u8string_view chunkPathStr, std::u8string_view tempPathStr);